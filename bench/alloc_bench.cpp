@@ -0,0 +1,126 @@
+// Allocation check: replaces the global operator new with a counting one,
+// warms a renderer up on the Beetle for a few frames, then counts the heap
+// allocations renderModel makes per frame in each shading mode, single
+// threaded and on a pool of 4. Exits non-zero if a warmed-up frame
+// allocates at all.
+//
+//   make bench && ./bench/alloc_bench [parts-dir | model.obj ...]
+
+#include "Renderer.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> allocations(0);
+
+static void* countedAlloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+static const char* DEFAULT_PARTS = "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts";
+
+struct Mode {
+    const char* name;
+    bool smooth, deferred, occlusion;
+    int samples;
+};
+
+static const Mode MODES[] = {{"flat", false, false, false, 1},
+                             {"smooth", true, false, false, 1},
+                             {"deferred", false, true, false, 1},
+                             {"msaa 4x smooth", true, false, false, 4},
+                             {"occlusion", false, false, true, 1}};
+
+static const int WARMUP_LAPS = 2, FRAMES = 12;
+
+int main(int argc, char** argv) {
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) inputs.push_back(argv[i]);
+    if (inputs.empty()) inputs.push_back(DEFAULT_PARTS);
+
+    Model model;
+    {
+        Renderer loader(1, 1);
+        std::streambuf* out = std::cout.rdbuf(nullptr);
+        bool loaded = loader.loadOBJFiles(inputs, model);
+        std::cout.rdbuf(out);
+        std::cout.clear();
+        if (!loaded) return 1;
+    }
+    model.generateNormals();
+    Vec3 lo, hi;
+    model.getBounds(lo, hi);
+    Vec3 center = (lo + hi) * 0.5f, size = hi - lo;
+    float maxDim = std::max({size.x, size.y, size.z});
+    // The camera moves every frame, so bins and triangle lists change size
+    std::vector<CameraSpec> cameras =
+        turntableCameras(center, Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f), 3.14159f / 4.0f, FRAMES);
+    for (CameraSpec& camera : cameras) {
+        camera.near = maxDim * 0.01f;
+        camera.fitFar(center, size.length() * 0.5f);
+    }
+
+    bool clean = true;
+    for (int threads : {1, 4}) {
+        for (const Mode& mode : MODES) {
+            Renderer renderer(800, 600, threads);
+            renderer.verbose = false;
+            renderer.smoothShading = mode.smooth;
+            renderer.deferred = mode.deferred;
+            renderer.occlusionCulling = mode.occlusion;
+            renderer.framebuffer.setHiZ(mode.occlusion);
+            renderer.framebuffer.setSampleCount(mode.samples);
+            Light directional;
+            directional.direction = Vec3(-1, -1, -1).normalize();
+            renderer.shader.lights.push_back(directional);
+            renderer.shader.enableShadows = true;
+            renderer.shader.enableAO = true;
+            renderer.shader.aoRadius = maxDim * 0.05f;
+            renderer.loadMaterials(model);
+            renderer.buildScene(model);
+
+            // Warm-up laps round the model size every buffer for every view
+            for (int lap = 0; lap < WARMUP_LAPS; lap++) {
+                for (int f = 0; f < FRAMES; f++) {
+                    renderer.setCamera(cameras[f]);
+                    renderer.framebuffer.clear(Color(20, 30, 50));
+                    renderer.renderModel(model);
+                }
+            }
+            size_t before = allocations.load();
+            auto start = std::chrono::steady_clock::now();
+            for (int f = 0; f < FRAMES; f++) {
+                renderer.setCamera(cameras[f]);
+                renderer.framebuffer.clear(Color(20, 30, 50));
+                renderer.renderModel(model);
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            size_t count = allocations.load() - before;
+            clean = clean && count == 0;
+            std::printf("%d thread%s  %-15s %8.2f allocations/frame  %7.2f ms/frame\n", threads,
+                        threads == 1 ? " " : "s", mode.name, (double)count / FRAMES, ms / FRAMES);
+        }
+    }
+    std::printf(clean ? "no allocations after warm-up\n" : "FAILED: frames still allocate\n");
+    return clean ? 0 : 1;
+}
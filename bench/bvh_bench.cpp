@@ -0,0 +1,162 @@
+// BVH benchmark: builds the scene BVH over every part of the Beetle with
+// one thread and with all of them, then measures closest-hit camera rays,
+// any-hit shadow rays (one at a time and as 4-ray packets) and short AO
+// rays, checking a sample of each against a brute-force loop.
+//
+//   make bench && ./bench/bvh_bench [parts-dir | model.obj ...]
+
+#include "Renderer.h"
+#include <chrono>
+#include <cstdio>
+
+static const char* DEFAULT_PARTS = "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts";
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reference any-hit / closest-hit over every triangle
+static float bruteForce(const std::vector<Vec3>& corners, const Ray& ray) {
+    float best = ray.tMax;
+    for (size_t t = 0; t < corners.size() / 3; t++) {
+        const Vec3* v = &corners[t * 3];
+        Vec3 e1 = v[1] - v[0], e2 = v[2] - v[0];
+        Vec3 p = ray.direction.cross(e2);
+        float det = e1.dot(p);
+        if (det == 0) continue;
+        float inv = 1.0f / det;
+        Vec3 s = ray.origin - v[0];
+        float u = s.dot(p) * inv;
+        if (u < 0 || u > 1) continue;
+        Vec3 q = s.cross(e1);
+        float w = ray.direction.dot(q) * inv;
+        if (w < 0 || u + w > 1) continue;
+        float d = e2.dot(q) * inv;
+        if (d > 0 && d < best) best = d;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) inputs.push_back(argv[i]);
+    if (inputs.empty()) inputs.push_back(DEFAULT_PARTS);
+
+    Renderer renderer(800, 600);
+    Model model;
+    if (!renderer.loadOBJFiles(inputs, model)) return 1;
+    const auto& indices = model.getIndices();
+    std::vector<Vec3> corners(indices.size());
+    for (size_t c = 0; c < indices.size(); c++) corners[c] = model.getVertices().position(indices[c]);
+    int count = (int)model.getTriangleCount();
+
+    // Build times
+    BVH bvh;
+    ThreadPool single(1);
+    double serialMs = 1e30, parallelMs = 1e30;
+    for (int it = 0; it < 5; it++) {
+        auto start = std::chrono::steady_clock::now();
+        bvh.build(corners.data(), count, &single);
+        serialMs = std::min(serialMs, seconds(start) * 1000.0);
+        start = std::chrono::steady_clock::now();
+        bvh.build(corners.data(), count, &renderer.getThreadPool());
+        parallelMs = std::min(parallelMs, seconds(start) * 1000.0);
+    }
+    std::printf("build: %d triangles, %d nodes, %.2f ms on 1 thread, %.2f ms on %d threads\n", count,
+                bvh.getNodeCount(), serialMs, parallelMs, renderer.getThreadCount());
+
+    // Camera rays over an 800x600 grid, framed like main.cpp
+    const BVHNode& root = bvh.getRoot();
+    Vec3 center = (root.boundsMin + root.boundsMax) * 0.5f;
+    Vec3 size = root.boundsMax - root.boundsMin;
+    float maxDim = std::max({size.x, size.y, size.z});
+    Vec3 eye = center + Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f);
+    Vec3 forward = (center - eye).normalize();
+    Vec3 right = forward.cross(Vec3(0, 1, 0)).normalize();
+    Vec3 up = right.cross(forward);
+    const int W = 800, H = 600;
+    float scale = std::tan(3.14159f / 8.0f);
+    std::vector<Ray> primary;
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            float px = (2.0f * (x + 0.5f) / W - 1.0f) * scale * W / H;
+            float py = (1.0f - 2.0f * (y + 0.5f) / H) * scale;
+            primary.push_back(Ray(eye, forward + right * px + up * py));
+        }
+    }
+
+    std::vector<RayHit> hits(primary.size());
+    std::vector<char> didHit(primary.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < primary.size(); i++) didHit[i] = bvh.intersect(primary[i], hits[i]);
+    double primarySeconds = seconds(start);
+
+    // Shadow and AO rays from every visible point
+    Vec3 lightPos = center + Vec3(maxDim, maxDim, maxDim);
+    float bias = size.length() * 1e-4f;
+    std::vector<Ray> shadow, ambient;
+    for (size_t i = 0; i < primary.size(); i++) {
+        if (!didHit[i]) continue;
+        const Vec3* v = &corners[hits[i].face * 3];
+        Vec3 normal = (v[1] - v[0]).cross(v[2] - v[0]).normalize();
+        if (normal.dot(primary[i].direction) > 0) normal = normal * -1.0f;
+        Vec3 p = primary[i].origin + primary[i].direction * hits[i].t + normal * bias;
+        shadow.push_back(Ray(p, lightPos - p, 1.0f));
+        Vec3 tangent = (std::fabs(normal.x) > 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(normal).normalize();
+        for (int s = 0; s < 4; s++) {
+            float phi = s * 2.3999632f, r = std::sqrt((s + 0.5f) / 4);
+            Vec3 dir = tangent * (r * std::cos(phi)) + normal.cross(tangent) * (r * std::sin(phi)) +
+                       normal * std::sqrt(1.0f - r * r);
+            ambient.push_back(Ray(p, dir, maxDim * 0.05f));
+        }
+    }
+
+    auto runSingle = [&](const std::vector<Ray>& rays, int& blocked) {
+        blocked = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (const Ray& ray : rays) blocked += bvh.occluded(ray);
+        return seconds(t0);
+    };
+    auto runPackets = [&](const std::vector<Ray>& rays, int& blocked) {
+        blocked = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        RayPacket4 packet;
+        for (size_t i = 0; i < rays.size(); i += 4) {
+            int active = 0;
+            for (int lane = 0; lane < 4 && i + lane < rays.size(); lane++) {
+                packet.set(lane, rays[i + lane]);
+                active |= 1 << lane;
+            }
+            for (int hit = bvh.occluded4(packet, active); hit; hit &= hit - 1) blocked++;
+        }
+        return seconds(t0);
+    };
+
+    int primaryHits = 0;
+    for (char h : didHit) primaryHits += h;
+    std::printf("closest hit: %zu camera rays, %d hits, %.2f Mrays/s\n", primary.size(), primaryHits,
+                primary.size() / primarySeconds * 1e-6);
+    int a, b;
+    double single1 = runSingle(shadow, a), packet1 = runPackets(shadow, b);
+    std::printf("shadow any hit: %zu rays, %d blocked, %.2f Mrays/s single, %.2f Mrays/s packets (%d blocked)\n",
+                shadow.size(), a, shadow.size() / single1 * 1e-6, shadow.size() / packet1 * 1e-6, b);
+    bool ok = a == b;
+    double single2 = runSingle(ambient, a), packet2 = runPackets(ambient, b);
+    std::printf("ao any hit:     %zu rays, %d blocked, %.2f Mrays/s single, %.2f Mrays/s packets (%d blocked)\n",
+                ambient.size(), a, ambient.size() / single2 * 1e-6, ambient.size() / packet2 * 1e-6, b);
+    ok = ok && a == b;
+
+    // Spot checks against every triangle
+    int mismatches = 0;
+    for (size_t i = 0; i < primary.size(); i += primary.size() / 97) {
+        float t = bruteForce(corners, primary[i]);
+        bool expect = t < primary[i].tMax;
+        if (expect != (bool)didHit[i] || (expect && hits[i].t != t)) mismatches++;
+    }
+    for (size_t i = 0; i < shadow.size(); i += std::max<size_t>(1, shadow.size() / 97)) {
+        if ((bruteForce(corners, shadow[i]) < shadow[i].tMax) != bvh.occluded(shadow[i])) mismatches++;
+    }
+    ok = ok && mismatches == 0;
+    std::printf("brute-force spot checks: %d mismatches\n", mismatches);
+    return ok ? 0 : 1;
+}
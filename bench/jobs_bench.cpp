@@ -0,0 +1,150 @@
+// Job system benchmark: runs the same work on pools of 1, 2, 4, ... threads
+// up to the hardware count (4 at least) and reports the speedup and
+// parallel efficiency against one thread for
+//   - scheduler overhead: a parallelFor over many tiny iterations, and a
+//     fan-out/fan-in graph of dependent jobs
+//   - loading: every part of the Beetle parsed from OBJ, no mesh cache
+//   - a frame: the shadow map, vertex, raster and SSAO passes of
+//     renderModel
+// On a machine with fewer cores than threads the extra threads only show
+// what the scheduling costs.
+//
+//   make bench && ./bench/jobs_bench [parts-dir | model.obj ...]
+
+#include "Renderer.h"
+#include <chrono>
+#include <cstdio>
+
+static const char* DEFAULT_PARTS = "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts";
+
+static const int WIDTH = 800, HEIGHT = 600;
+
+static double millis(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Best of iterations runs of fn, in milliseconds
+template <class Fn>
+static double best(int iterations, const Fn& fn) {
+    double ms = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        ms = std::min(ms, millis(start));
+    }
+    return ms;
+}
+
+// Frames the model the way main.cpp does, with a shadowed directional light
+static void setupScene(Renderer& renderer, const Model& model) {
+    Vec3 minBounds, maxBounds;
+    model.getBounds(minBounds, maxBounds);
+    Vec3 center = (minBounds + maxBounds) * 0.5f;
+    Vec3 size = maxBounds - minBounds;
+    float maxDim = std::max({size.x, size.y, size.z});
+    CameraSpec camera(center + Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f), center, 3.14159f / 4.0f);
+    camera.near = maxDim * 0.01f;
+    camera.fitFar(center, size.length() * 0.5f);
+    renderer.setCamera(camera);
+
+    renderer.shader.lights.clear();
+    Light directional;
+    directional.type = 0;
+    directional.direction = Vec3(-1, -1, -1).normalize();
+    renderer.shader.lights.push_back(directional);
+    renderer.shader.material.diffuse = Color(150, 150, 200);
+    renderer.shader.material.ambient = Color(30, 30, 50);
+    renderer.shader.enableShadows = true;
+    renderer.shader.enableAO = true;
+    renderer.shader.aoRadius = maxDim * 0.05f;
+}
+
+struct Result {
+    double tiny, graph, load, frame;
+};
+
+static Result measure(const std::vector<std::string>& inputs, int threads) {
+    Result result;
+    Renderer renderer(WIDTH, HEIGHT, threads);
+    ThreadPool& pool = renderer.getThreadPool();
+
+    // A million near-empty iterations: the cost of splitting and stealing
+    std::vector<float> values(1 << 20, 1.0f);
+    result.tiny = best(5, [&] {
+        pool.parallelForRange((int)values.size(), 256, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) values[i] = values[i] * 0.5f + 0.5f;
+        });
+    });
+
+    // 64 independent jobs feeding one job, 100 times over, each level
+    // waiting on the one before
+    std::atomic<int> sum(0);
+    result.graph = best(5, [&] {
+        JobHandle previous;
+        for (int level = 0; level < 100; level++) {
+            std::vector<JobHandle> fan;
+            for (int j = 0; j < 64; j++) {
+                fan.push_back(pool.submit([&sum] { sum.fetch_add(1); }, {previous}));
+            }
+            previous = pool.submit([&sum] { sum.fetch_add(1); }, fan);
+        }
+        pool.wait(previous);
+    });
+
+    // Loading reports on every call
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    renderer.useMeshCache = false;
+    Model model;
+    bool loaded = true;
+    result.load = best(3, [&] { loaded = loaded && renderer.loadOBJFiles(inputs, model); });
+    model.generateNormals();
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    if (!loaded) {
+        result.frame = 0;
+        return result;
+    }
+
+    setupScene(renderer, model);
+    renderer.verbose = false;
+    out = std::cout.rdbuf(nullptr);
+    renderer.buildScene(model);
+    result.frame = best(5, [&] {
+        renderer.invalidateShadowMaps();
+        renderer.framebuffer.clear(Color(20, 30, 50));
+        renderer.renderModel(model);
+    });
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    return result;
+}
+
+static void report(const char* name, int threads, double ms, double baseMs) {
+    double speedup = ms > 0 ? baseMs / ms : 0;
+    std::printf("  %-10s %8.3f ms  speedup %5.2fx  efficiency %5.1f%%\n", name, ms, speedup,
+                100.0 * speedup / threads);
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) inputs.push_back(argv[i]);
+    if (inputs.empty()) inputs.push_back(DEFAULT_PARTS);
+
+    int hardware = ThreadPool::defaultThreadCount();
+    std::vector<int> counts;
+    for (int n = 1; n < std::max(4, hardware); n *= 2) counts.push_back(n);
+    counts.push_back(std::max(4, hardware));
+    std::printf("%d hardware threads, %dx%d frames\n", hardware, WIDTH, HEIGHT);
+
+    Result base = {0, 0, 0, 0};
+    for (int threads : counts) {
+        Result result = measure(inputs, threads);
+        if (threads == 1) base = result;
+        std::printf("%d thread%s:\n", threads, threads == 1 ? "" : "s");
+        report("tiny jobs", threads, result.tiny, base.tiny);
+        report("job graph", threads, result.graph, base.graph);
+        report("load", threads, result.load, base.load);
+        report("frame", threads, result.frame, base.frame);
+    }
+    return 0;
+}
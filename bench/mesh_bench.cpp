@@ -0,0 +1,198 @@
+// Mesh layout benchmark: loads the Beetle, reports how many bytes per
+// triangle its welded vertex streams and index buffer take, then times the
+// vertex pass over every vertex with each SIMD kernel the CPU supports,
+// checking each against the scalar one bit for bit. Also checks that a
+// directory mixing an OBJ with normals and one without gets the same
+// corners cached and uncached, and that malformed faces stay within the
+// arrays the parser's count sized.
+//
+//   make bench && ./bench/mesh_bench [parts-dir | model.obj ...]
+
+#include "Renderer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+static const char* DEFAULT_PARTS = "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts";
+
+static double transform(VertexKernelFn kernel, const Model& model, const Shader& shader, int iterations,
+                        TransformedVertices& out) {
+    double best = 1e30;
+    int count = (int)model.getVertices().size();
+    for (int it = 0; it < iterations; it++) {
+        auto start = std::chrono::steady_clock::now();
+        kernel(model.getVertices(), shader.modelMatrix, shader.mvpMatrix, 0, count, out);
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+static bool sameOutput(const TransformedVertices& a, const TransformedVertices& b) {
+    const std::vector<float>* x[12] = {&a.x, &a.y, &a.z, &a.w, &a.worldX, &a.worldY, &a.worldZ,
+                                       &a.normalX, &a.normalY, &a.normalZ, &a.u, &a.v};
+    const std::vector<float>* y[12] = {&b.x, &b.y, &b.z, &b.w, &b.worldX, &b.worldY, &b.worldZ,
+                                       &b.normalX, &b.normalY, &b.normalZ, &b.u, &b.v};
+    for (int s = 0; s < 12; s++) {
+        if (std::memcmp(x[s]->data(), y[s]->data(), x[s]->size() * sizeof(float)) != 0) return false;
+    }
+    return true;
+}
+
+// Parses OBJ text into arrays sized by ObjParser::count, with a guard face
+// after them; true if the guard is intact and `triangles` faces were kept
+static bool parsesWithin(const std::string& text, size_t triangles) {
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    ObjCounts counts = ObjParser::count(begin, end);
+    std::vector<Vec3> vertices(counts.vertices), normals(counts.normals);
+    std::vector<Vec2> texCoords(counts.texCoords);
+    std::vector<Face> faces(counts.triangles + 1);
+    faces.back().v[0] = 12345;
+    ObjCounts parsed = ObjParser::parse(begin, end, ObjCounts(), ObjCounts(), counts, vertices.data(),
+                                        texCoords.data(), normals.data(), faces.data());
+    return faces.back().v[0] == 12345 && faces.back().v[1] == -1 && parsed.triangles == triangles;
+}
+
+static bool checkMalformedFaces() {
+    const std::string quad = "v 0 0 0\nv 1 0 0\nv 0 1 0\nv 1 1 0\n";
+    struct Case {
+        const char* faces;
+        size_t kept;
+    };
+    const Case cases[] = {{"f 1 2 3-1\n", 0},           {"f 1 2 3-1\nf 2 4 3\n", 1}, {"f 1 2 3/1/1/1\n", 0},
+                          {"f 1 2 3#x\n", 0},           {"f 1 2 999\n", 0},          {"f 1 2 3 4-1\n", 1},
+                          {"f 1 2 3 # comment\n", 1}};
+    bool ok = true;
+    for (const Case& c : cases) ok = parsesWithin(quad + c.faces, c.kept) && ok;
+    std::printf("malformed faces: %s\n", ok ? "kept within the counted arrays" : "MISMATCH");
+    return ok;
+}
+
+// Copies an OBJ without its vn lines or the normal index of each corner
+static bool writeWithoutNormals(const std::string& from, const std::string& to) {
+    std::ifstream in(from);
+    std::ofstream out(to);
+    if (!in || !out) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 3, "vn ") == 0) continue;
+        if (line.compare(0, 2, "f ") == 0) {
+            std::istringstream tokens(line.substr(2));
+            std::string token;
+            line = "f";
+            while (tokens >> token) {
+                size_t first = token.find('/'), second = first == std::string::npos ? first : token.find('/', first + 1);
+                if (second != std::string::npos) token.erase(second == first + 1 ? first : second);
+                line += " " + token;
+            }
+        }
+        out << line << "\n";
+    }
+    return true;
+}
+
+// Position, normal and uv of every corner, in face order
+static std::vector<float> corners(const Model& model) {
+    std::vector<float> out;
+    const VertexStreams& v = model.getVertices();
+    for (uint32_t i : model.getIndices()) {
+        const float values[8] = {v.x[i], v.y[i], v.z[i], v.normalX[i], v.normalY[i], v.normalZ[i], v.u[i], v.v[i]};
+        out.insert(out.end(), values, values + 8);
+    }
+    return out;
+}
+
+// Loads a directory holding one part with normals and one stripped of them
+// uncached, cached fresh and from the cache; all three must agree
+static bool checkMixedNormals(const std::string& parts) {
+    char dir[] = "/tmp/mesh_bench_XXXXXX";
+    if (!mkdtemp(dir)) return false;
+    std::string withNormals = std::string(dir) + "/Interior02Shape.obj", without = std::string(dir) + "/Wheel01Shape.obj";
+    bool ok = writeWithoutNormals(parts + "/Wheel01Shape.obj", without);
+    if (ok) {
+        std::ifstream in(parts + "/Interior02Shape.obj", std::ios::binary);
+        std::ofstream out(withNormals, std::ios::binary);
+        ok = in && out && (out << in.rdbuf());
+    }
+
+    std::vector<float> results[3];
+    Renderer renderer(800, 600, 1);
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    for (int run = 0; run < 3 && ok; run++) {
+        Model model;
+        renderer.useMeshCache = run > 0;
+        ok = renderer.loadOBJFiles(std::vector<std::string>{dir}, model);
+        model.generateNormals();
+        results[run] = corners(model);
+    }
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    for (const std::string& file : {withNormals, without}) {
+        unlink(file.c_str());
+        unlink((file + ".rmesh").c_str());
+    }
+    rmdir(dir);
+
+    bool same = ok && !results[0].empty() && results[0] == results[1] && results[0] == results[2];
+    std::printf("mixed normals directory: %zu corners, uncached/cached/from cache %s\n", results[0].size() / 8,
+                same ? "identical" : "MISMATCH");
+    return same;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) inputs.push_back(argv[i]);
+    if (inputs.empty()) inputs.push_back(DEFAULT_PARTS);
+
+    Renderer renderer(800, 600, 1);
+    Model model;
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    bool loaded = renderer.loadOBJFiles(inputs, model);
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    if (!loaded) return 1;
+    model.generateNormals();
+
+    size_t triangles = model.getTriangleCount(), vertices = model.getVertices().size();
+    std::printf("%zu triangles, %zu welded vertices (%.2f per triangle)\n", triangles, vertices,
+                (double)vertices / triangles);
+    std::printf("vertex streams %.1f B, indices %.1f B, materials %.1f B: %.1f bytes per triangle\n",
+                (double)model.getVertices().bytes() / triangles, 3.0 * sizeof(uint32_t),
+                (double)sizeof(uint16_t), (double)model.getMeshBytes() / triangles);
+
+    // A camera and a rotated model matrix, so every matrix entry is used
+    Vec3 lo, hi;
+    model.getBounds(lo, hi);
+    Vec3 center = (lo + hi) * 0.5f, size = hi - lo;
+    float maxDim = std::max({size.x, size.y, size.z});
+    CameraSpec camera(center + Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f), center, 3.14159f / 4.0f);
+    camera.near = maxDim * 0.01f;
+    camera.fitFar(center, size.length() * 0.5f);
+    renderer.setCamera(camera);
+    renderer.shader.modelMatrix = Matrix4x4::rotationY(0.3f);
+    renderer.shader.updateMVP();
+
+    TransformedVertices reference, result;
+    reference.resize(vertices);
+    result.resize(vertices);
+    transform(transformVerticesScalar, model, renderer.shader, 1, reference);
+    std::printf("vertex pass over all vertices, one thread:\n");
+    bool ok = true;
+    double scalarMs = 0;
+    const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::SSE4, SimdLevel::AVX2};
+    for (SimdLevel level : levels) {
+        if ((int)level > (int)cpuSimdLevel()) continue;
+        double ms = transform(selectVertexKernel(level), model, renderer.shader, 20, result);
+        if (level == SimdLevel::Scalar) scalarMs = ms;
+        bool same = sameOutput(result, reference);
+        ok = ok && same;
+        std::printf("  %-7s %8.3f ms  %5.2fx  %6.1f Mvertices/s  %s\n", simdLevelName(level), ms, scalarMs / ms,
+                    vertices / (ms * 1000.0), same ? "identical" : "MISMATCH");
+    }
+    ok = checkMixedNormals(DEFAULT_PARTS) && ok;
+    ok = checkMalformedFaces() && ok;
+    return ok ? 0 : 1;
+}
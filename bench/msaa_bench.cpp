@@ -0,0 +1,185 @@
+// Anti-aliasing benchmark: draws Interior02Shape.obj single sampled, with
+// 4x and 8x MSAA and with 4x SSAA (twice the resolution each way, box
+// filtered down), first as flat-coloured triangles straight into a
+// Framebuffer and then through the renderer with per-pixel shading. Reports
+// the time, the fragments shaded and the mean error against a 16x SSAA
+// reference of the same frame.
+//
+//   make bench && ./bench/msaa_bench [path/to/model.obj]
+
+#include "Renderer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static const char* DEFAULT_MODEL =
+    "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts/Interior02Shape.obj";
+
+static const int WIDTH = 800, HEIGHT = 600;
+
+// One way of anti-aliasing: samples per pixel with MSAA, or the factor
+// the image is supersampled by along each axis
+struct Mode {
+    const char* name;
+    int samples;
+    int scale;
+};
+
+static const Mode MODES[] = {{"1x", 1, 1}, {"msaa 4x", 4, 1}, {"msaa 8x", 8, 1}, {"ssaa 4x", 1, 2}};
+
+// Frames the model the way main.cpp does
+static void setupCamera(Renderer& renderer, const Model& model) {
+    Vec3 minBounds, maxBounds;
+    model.getBounds(minBounds, maxBounds);
+    Vec3 center = (minBounds + maxBounds) * 0.5f;
+    Vec3 size = maxBounds - minBounds;
+    float maxDim = std::max({size.x, size.y, size.z});
+    Vec3 eye = center + Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f);
+    float far = (eye - center).length() + size.length() * 0.5f;
+
+    renderer.shader.viewMatrix = Matrix4x4::lookAt(eye, center, Vec3(0, 1, 0));
+    renderer.shader.projectionMatrix =
+        Matrix4x4::perspective(3.14159f / 4.0f, (float)renderer.width / renderer.height, maxDim * 0.01f, far);
+    renderer.shader.cameraPos = eye;
+    renderer.shader.updateMVP();
+
+    renderer.shader.lights.clear();
+    Light directional;
+    directional.type = 0;
+    directional.direction = Vec3(-1, -1, -1).normalize();
+    renderer.shader.lights.push_back(directional);
+    renderer.shader.material.diffuse = Color(150, 150, 200);
+    renderer.shader.material.ambient = Color(30, 30, 50);
+}
+
+// Box filters a framebuffer scale times the size of out into out
+static void downsample(Framebuffer& in, int scale, std::vector<Color>& out) {
+    int n = scale * scale;
+    out.resize((size_t)WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            int sum[3] = {n / 2, n / 2, n / 2};
+            for (int sy = 0; sy < scale; sy++) {
+                const Color* row = in.getColorRow(y * scale + sy) + x * scale;
+                for (int sx = 0; sx < scale; sx++) {
+                    sum[0] += row[sx].r;
+                    sum[1] += row[sx].g;
+                    sum[2] += row[sx].b;
+                }
+            }
+            out[(size_t)y * WIDTH + x] = Color((unsigned char)(sum[0] / n), (unsigned char)(sum[1] / n),
+                                               (unsigned char)(sum[2] / n));
+        }
+    }
+}
+
+static void copyImage(Framebuffer& fb, std::vector<Color>& out) {
+    out.resize((size_t)WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; y++) std::copy(fb.getColorRow(y), fb.getColorRow(y) + WIDTH, &out[(size_t)y * WIDTH]);
+}
+
+// Mean absolute difference per channel, in 8-bit levels
+static double meanError(const std::vector<Color>& a, const std::vector<Color>& b) {
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        sum += std::abs(a[i].r - b[i].r) + std::abs(a[i].g - b[i].g) + std::abs(a[i].b - b[i].b);
+    }
+    return sum / (a.size() * 3.0);
+}
+
+// Screen position at scale times the resolution; depth stays
+static Vec3 scaled(const Vec3& v, int scale) { return Vec3(v.x * scale, v.y * scale, v.z); }
+
+// Flat-coloured triangles straight into a framebuffer, resolve included
+static double rasterize(const std::vector<ScreenTriangle>& triangles, int samples, int scale, int iterations,
+                        std::vector<Color>& image) {
+    Framebuffer fb(WIDTH * scale, HEIGHT * scale);
+    fb.setSampleCount(samples);
+    double best = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        fb.clear(Color(20, 30, 50));
+        auto start = std::chrono::steady_clock::now();
+        for (const ScreenTriangle& tri : triangles) {
+            fb.drawTriangle(scaled(tri.v[0], scale), scaled(tri.v[1], scale), scaled(tri.v[2], scale), tri.color);
+        }
+        fb.resolve();
+        if (scale > 1) {
+            std::vector<Color> filtered;
+            downsample(fb, scale, filtered);
+            image.swap(filtered);
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    if (scale == 1) copyImage(fb, image);
+    return best;
+}
+
+// The whole frame through the renderer with smooth shading
+static double renderFrame(const Model& model, int samples, int scale, int iterations, std::vector<Color>& image,
+                          size_t& fragments) {
+    Renderer renderer(WIDTH * scale, HEIGHT * scale);
+    renderer.smoothShading = true;
+    renderer.framebuffer.setSampleCount(samples);
+    setupCamera(renderer, model);
+
+    // renderModel reports on every frame
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    double best = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        auto start = std::chrono::steady_clock::now();
+        renderer.framebuffer.clear(Color(20, 30, 50));
+        renderer.renderModel(model);
+        if (scale > 1) {
+            std::vector<Color> filtered;
+            downsample(renderer.framebuffer, scale, filtered);
+            image.swap(filtered);
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    if (scale == 1) copyImage(renderer.framebuffer, image);
+    fragments = renderer.getShadedFragments();
+    return best;
+}
+
+int main(int argc, char** argv) {
+    Model model;
+    if (!model.loadOBJ(argc > 1 ? argv[1] : DEFAULT_MODEL)) return 1;
+    model.generateNormals();
+
+    // Screen-space triangles at the output resolution; supersampled runs
+    // scale them up
+    Renderer setup(WIDTH, HEIGHT, 1);
+    setupCamera(setup, model);
+    std::vector<ScreenTriangle> triangles;
+    for (int f = 0; f < (int)model.getTriangleCount(); f++) setup.processFace(model, f, triangles);
+
+    std::vector<Color> reference, image;
+    std::printf("%dx%d, %zu triangles\n", WIDTH, HEIGHT, triangles.size());
+    std::printf("raster only (flat colours, resolve included):\n");
+    rasterize(triangles, 1, 4, 1, reference);
+    double baseMs = 0;
+    for (const Mode& mode : MODES) {
+        double ms = rasterize(triangles, mode.samples, mode.scale, 10, image);
+        if (mode.samples == 1 && mode.scale == 1) baseMs = ms;
+        std::printf("  %-8s %8.3f ms  %5.2fx the cost of 1x  error %.3f\n", mode.name, ms, ms / baseMs,
+                    meanError(image, reference));
+    }
+
+    std::printf("smooth shading (renderModel, %d threads):\n", Renderer(1, 1).getThreadCount());
+    size_t fragments = 0, baseFragments = 0;
+    renderFrame(model, 1, 4, 1, reference, fragments);
+    for (const Mode& mode : MODES) {
+        double ms = renderFrame(model, mode.samples, mode.scale, 5, image, fragments);
+        if (mode.samples == 1 && mode.scale == 1) {
+            baseMs = ms;
+            baseFragments = fragments;
+        }
+        std::printf("  %-8s %8.3f ms  %5.2fx the cost of 1x  %8zu fragments shaded (%.2fx)  error %.3f\n", mode.name,
+                    ms, ms / baseMs, fragments, (double)fragments / baseFragments, meanError(image, reference));
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Raster kernel microbenchmark: rasterizes the screen-space triangles of
+// Interior02Shape.obj with every kernel the CPU supports and checks that
+// they all produce the same image as the scalar reference.
+//
+//   make bench && ./bench/raster_bench [path/to/model.obj]
+
+#include "Renderer.h"
+#include <chrono>
+#include <cstdio>
+
+static const char* DEFAULT_MODEL =
+    "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts/Interior02Shape.obj";
+
+// Screen-space triangles of the model framed the same way main.cpp does
+static std::vector<ScreenTriangle> setupTriangles(const Model& model, int width, int height) {
+    Renderer renderer(width, height, 1);
+    Vec3 minBounds, maxBounds;
+    model.getBounds(minBounds, maxBounds);
+    Vec3 center = (minBounds + maxBounds) * 0.5f;
+    Vec3 size = maxBounds - minBounds;
+    float maxDim = std::max({size.x, size.y, size.z});
+    Vec3 eye = center + Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f);
+    float far = (eye - center).length() + size.length() * 0.5f;
+
+    renderer.shader.viewMatrix = Matrix4x4::lookAt(eye, center, Vec3(0, 1, 0));
+    renderer.shader.projectionMatrix = Matrix4x4::perspective(3.14159f / 4.0f, (float)width / height, maxDim * 0.01f, far);
+    renderer.shader.cameraPos = eye;
+    renderer.shader.updateMVP();
+
+    std::vector<ScreenTriangle> triangles;
+    for (int f = 0; f < (int)model.getTriangleCount(); f++) renderer.processFace(model, f, triangles);
+    return triangles;
+}
+
+static double rasterize(Framebuffer& fb, const std::vector<ScreenTriangle>& triangles, int iterations) {
+    double best = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        fb.clear(Color(20, 30, 50));
+        auto start = std::chrono::steady_clock::now();
+        for (const ScreenTriangle& tri : triangles) {
+            fb.drawTriangle(tri.v[0], tri.v[1], tri.v[2], tri.color);
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+static bool sameImage(const Framebuffer& a, const Framebuffer& b) {
+    for (int y = 0; y < a.getHeight(); y++) {
+        for (int x = 0; x < a.getWidth(); x++) {
+            Color p = a.getPixel(x, y), q = b.getPixel(x, y);
+            if (p.r != q.r || p.g != q.g || p.b != q.b || a.getDepth(x, y) != b.getDepth(x, y)) return false;
+        }
+    }
+    return true;
+}
+
+static bool compareHiZ(const char* name, const std::vector<ScreenTriangle>& triangles, int width, int height) {
+    Framebuffer flat(width, height);
+    flat.setHiZ(false);
+    double flatMs = rasterize(flat, triangles, 20);
+    Framebuffer coarse(width, height);
+    coarse.setHiZ(true);
+    double coarseMs = rasterize(coarse, triangles, 20);
+    RasterStats stats = coarse.getStats();
+    bool same = sameImage(coarse, flat);
+    std::printf("  %-7s %8.3f ms  %5.2fx  %s  vs %.3f ms without; %llu/%llu triangles, %llu/%llu blocks culled\n",
+                name, coarseMs, flatMs / coarseMs, same ? "identical" : "MISMATCH", flatMs,
+                (unsigned long long)stats.trianglesCulled,
+                (unsigned long long)(stats.trianglesCulled + stats.trianglesDrawn),
+                (unsigned long long)stats.blocksCulled,
+                (unsigned long long)(stats.blocksCulled + stats.blocksDrawn));
+    return same;
+}
+
+int main(int argc, char** argv) {
+    Model model;
+    if (!model.loadOBJ(argc > 1 ? argv[1] : DEFAULT_MODEL)) return 1;
+
+    const int sizes[][2] = {{800, 600}, {3840, 2160}};
+    const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::SSE4, SimdLevel::AVX2};
+    bool ok = true;
+
+    for (const auto& size : sizes) {
+        int width = size[0], height = size[1];
+        std::vector<ScreenTriangle> triangles = setupTriangles(model, width, height);
+        std::printf("%dx%d, %zu triangles\n", width, height, triangles.size());
+
+        // Kernels alone, without coarse depth rejection
+        Framebuffer reference(width, height);
+        reference.setHiZ(false);
+        reference.setSimdLevel(SimdLevel::Scalar);
+        double scalarMs = rasterize(reference, triangles, 20);
+
+        for (SimdLevel level : levels) {
+            if ((int)level > (int)cpuSimdLevel()) continue;
+            Framebuffer fb(width, height);
+            fb.setHiZ(false);
+            fb.setSimdLevel(level);
+            double ms = rasterize(fb, triangles, 20);
+            bool same = sameImage(fb, reference);
+            ok = ok && same;
+            std::printf("  %-7s %8.3f ms  %5.2fx  %s\n", simdLevelName(level), ms, scalarMs / ms,
+                        same ? "identical" : "MISMATCH");
+        }
+
+        // Coarse depth rejection, as is and with the model behind a wall
+        // covering the screen
+        ok = compareHiZ("hi-z", triangles, width, height) && ok;
+        std::vector<ScreenTriangle> walled(2);
+        walled[0].v[0] = Vec3(0, 0, -0.5f);
+        walled[0].v[1] = Vec3((float)width, 0, -0.5f);
+        walled[0].v[2] = Vec3((float)width, (float)height, -0.5f);
+        walled[1].v[0] = walled[0].v[0];
+        walled[1].v[1] = walled[0].v[2];
+        walled[1].v[2] = Vec3(0, (float)height, -0.5f);
+        walled[0].color = walled[1].color = Color(90, 90, 90);
+        walled.insert(walled.end(), triangles.begin(), triangles.end());
+        ok = compareHiZ("walled", walled, width, height) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+// Render server benchmark and test client: sends render requests over the
+// server's Unix socket from several connections at once and reports the
+// latency of the first (cold: the model gets loaded) request, then p50,
+// p99 and max latency and throughput for the rest, with the server's
+// counts of coalesced and refused requests. Requests cycle through a few
+// distinct views, so concurrent clients asking for the same image share
+// one render.
+//
+// Without --socket the server runs inside this process, as
+// render_engine --serve would.
+//
+//   make bench && ./bench/server_bench [--socket path] [--clients N]
+//       [--requests N] [--views N] [--workers N] [--queue N] [--model path]
+
+#include "RenderServer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+static const char* DEFAULT_MODEL = "uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts";
+
+enum Outcome { RENDERED, BUSY, FAILED };
+
+// Sends one request on fd and reads the reply; the image must be a P6 PPM
+static Outcome request(int fd, SocketReader& reader, const std::string& line, std::string& reply) {
+    if (!writeAll(fd, line + "\n") || !reader.readLine(reply)) return FAILED;
+    if (reply == "BUSY") return BUSY;
+    if (reply.compare(0, 3, "OK ") != 0) return FAILED;
+    std::vector<unsigned char> image(std::strtoul(reply.c_str() + 3, nullptr, 10));
+    if (!reader.readBytes(image.data(), image.size())) return FAILED;
+    return image.size() > 2 && image[0] == 'P' && image[1] == '6' ? RENDERED : FAILED;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+static double millis(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string socketPath, model = DEFAULT_MODEL;
+    int clients = 4, requests = 64, views = 4, workers = 1, queue = 16;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::strcmp(argv[i], "--socket") == 0) {
+            socketPath = argv[i + 1];
+        } else if (std::strcmp(argv[i], "--clients") == 0) {
+            clients = std::max(1, std::atoi(argv[i + 1]));
+        } else if (std::strcmp(argv[i], "--requests") == 0) {
+            requests = std::max(1, std::atoi(argv[i + 1]));
+        } else if (std::strcmp(argv[i], "--views") == 0) {
+            views = std::max(1, std::atoi(argv[i + 1]));
+        } else if (std::strcmp(argv[i], "--workers") == 0) {
+            workers = std::max(1, std::atoi(argv[i + 1]));
+        } else if (std::strcmp(argv[i], "--queue") == 0) {
+            queue = std::max(1, std::atoi(argv[i + 1]));
+        } else if (std::strcmp(argv[i], "--model") == 0) {
+            model = argv[i + 1];
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::unique_ptr<RenderServer> server;
+    std::thread serving;
+    if (socketPath.empty()) {
+        socketPath = "/tmp/render_bench_" + std::to_string(getpid()) + ".sock";
+        server.reset(new RenderServer(socketPath, workers, 0, queue));
+        if (!server->start()) return 1;
+        serving = std::thread([&] { server->serve(); });
+        std::printf("in-process server: %d workers of %d threads, queue %d\n", server->getWorkerCount(),
+                    server->getThreadsPerWorker(), queue);
+    }
+
+    auto line = [&](int view) {
+        char fov[32];
+        std::snprintf(fov, sizeof(fov), " fov=%d", 40 + view);
+        return "render model=\"" + model + "\"" + fov;
+    };
+
+    int fd = connectUnixSocket(socketPath);
+    if (fd < 0) {
+        std::fprintf(stderr, "cannot connect to %s\n", socketPath.c_str());
+        return 1;
+    }
+    SocketReader reader(fd);
+    std::string reply;
+    auto start = std::chrono::steady_clock::now();
+    if (request(fd, reader, line(0), reply) != RENDERED) {
+        std::fprintf(stderr, "cold request failed: %s\n", reply.c_str());
+        return 1;
+    }
+    std::printf("cold request (model load): %.1f ms\n", millis(start));
+
+    std::vector<std::vector<double> > latencies(clients);
+    std::atomic<int> next(0), busy(0), failed(0);
+    std::vector<std::thread> threads;
+    start = std::chrono::steady_clock::now();
+    for (int c = 0; c < clients; c++) {
+        threads.push_back(std::thread([&, c] {
+            int connection = connectUnixSocket(socketPath);
+            if (connection < 0) {
+                failed++;
+                return;
+            }
+            SocketReader in(connection);
+            std::string answer;
+            for (int r = next++; r < requests; r = next++) {
+                auto sent = std::chrono::steady_clock::now();
+                Outcome outcome = request(connection, in, line(r % views), answer);
+                if (outcome == RENDERED) latencies[c].push_back(millis(sent));
+                if (outcome == BUSY) busy++;
+                if (outcome == FAILED) failed++;
+            }
+            close(connection);
+        }));
+    }
+    for (std::thread& thread : threads) thread.join();
+    double seconds = millis(start) / 1000.0;
+
+    std::vector<double> all;
+    for (const std::vector<double>& client : latencies) all.insert(all.end(), client.begin(), client.end());
+    std::printf("%d requests from %d clients over %d views: %.2f s, %.1f images/s\n", requests, clients, views,
+                seconds, all.size() / seconds);
+    std::printf("latency p50 %.1f ms  p99 %.1f ms  max %.1f ms  (%zu rendered, %d busy, %d failed)\n",
+                percentile(all, 0.5), percentile(all, 0.99), percentile(all, 1.0), all.size(), busy.load(),
+                failed.load());
+    if (writeAll(fd, std::string("stats\n")) && reader.readLine(reply)) std::printf("server: %s\n", reply.c_str());
+    close(fd);
+
+    if (server) {
+        server->stop();
+        serving.join();
+    }
+    return failed.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// Fragment shading benchmark: lights the same fragments with the
+// per-fragment Shader::fragmentShader and with Shader::shadeBatch, under
+// the lights main.cpp sets up (one directional, one point), and checks
+// that the two agree to within a couple of 8-bit levels, also with a
+// specular power of 0.
+//
+//   make bench && ./bench/shade_bench [fragments]
+
+#include "Shader.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? std::atoi(argv[1]) : 1 << 20;
+    if (count <= 0) return 1;
+
+    Shader shader;
+    shader.lights.clear();
+    Light directional;
+    directional.type = 0;
+    directional.direction = Vec3(-1, -1, -1).normalize();
+    shader.lights.push_back(directional);
+    Light point;
+    point.type = 1;
+    point.position = Vec3(200, 200, 200);
+    point.color = Color(255, 200, 150);
+    point.intensity = 0.8f;
+    shader.lights.push_back(point);
+    shader.material.diffuse = Color(150, 150, 200);
+    shader.material.ambient = Color(30, 30, 50);
+    shader.cameraPos = Vec3(400, 150, 600);
+
+    // Points on a model-sized box with random unit normals
+    std::vector<Vertex> fragments(count);
+    srand(1);
+    auto uniform = [] { return (float)rand() / RAND_MAX; };
+    for (Vertex& f : fragments) {
+        f.worldPos = Vec3(uniform() * 400 - 200, uniform() * 150, uniform() * 800 - 400);
+        Vec3 n;
+        do n = Vec3(uniform() * 2 - 1, uniform() * 2 - 1, uniform() * 2 - 1); while (n.length() > 1 || n.length() < 0.1f);
+        f.normal = n.normalize();
+    }
+
+    std::vector<Color> single(count), batched(count);
+    double singleSeconds = 1e30, batchSeconds = 1e30;
+    for (int it = 0; it < 3; it++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) single[i] = shader.fragmentShader(fragments[i]);
+        singleSeconds = std::min(singleSeconds, seconds(start));
+
+        start = std::chrono::steady_clock::now();
+        FragmentBatch batch;
+        for (int first = 0; first < count; first += FragmentBatch::CAPACITY) {
+            batch.count = 0;
+            int end = std::min(count, first + FragmentBatch::CAPACITY);
+            for (int i = first; i < end; i++) batch.push(fragments[i].worldPos, fragments[i].normal);
+            shader.shadeBatch(batch, shader.material, &batched[first]);
+        }
+        batchSeconds = std::min(batchSeconds, seconds(start));
+    }
+
+    auto compare = [&](int& differing) {
+        int worst = 0;
+        differing = 0;
+        for (int i = 0; i < count; i++) {
+            int d = std::max({std::abs(single[i].r - batched[i].r), std::abs(single[i].g - batched[i].g),
+                              std::abs(single[i].b - batched[i].b)});
+            worst = std::max(worst, d);
+            differing += d > 0;
+        }
+        return worst;
+    };
+    int differing;
+    int worst = compare(differing);
+    std::printf("fragmentShader: %.2f Mfragments/s\n", count / singleSeconds * 1e-6);
+    std::printf("shadeBatch:     %.2f Mfragments/s (%.2fx)\n", count / batchSeconds * 1e-6, singleSeconds / batchSeconds);
+    std::printf("%d of %d fragments differ, by at most %d\n", differing, count, worst);
+
+    // x^0 is 1 even where the highlight term is 0
+    shader.material.shininess = 0;
+    FragmentBatch batch;
+    for (int first = 0; first < count; first += FragmentBatch::CAPACITY) {
+        batch.count = 0;
+        int end = std::min(count, first + FragmentBatch::CAPACITY);
+        for (int i = first; i < end; i++) {
+            single[i] = shader.fragmentShader(fragments[i]);
+            batch.push(fragments[i].worldPos, fragments[i].normal);
+        }
+        shader.shadeBatch(batch, shader.material, &batched[first]);
+    }
+    int worstFlat = compare(differing);
+    std::printf("shininess 0: %d of %d fragments differ, by at most %d\n", differing, count, worstFlat);
+    return worst <= 2 && worstFlat <= 2 ? 0 : 1;
+}
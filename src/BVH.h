@@ -0,0 +1,534 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "Vec3.h"
+#include "ThreadPool.h"
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct Ray {
+    Vec3 origin;
+    Vec3 direction; // need not be normalized; t is in units of it
+    float tMax;
+
+    Ray() : tMax(std::numeric_limits<float>::max()) {}
+    Ray(const Vec3& o, const Vec3& d, float t = std::numeric_limits<float>::max())
+        : origin(o), direction(d), tMax(t) {}
+};
+
+struct RayHit {
+    float t;
+    int face; // index the triangle was added with
+    float u, v; // barycentrics of corners 1 and 2
+};
+
+// Four rays traced together, one per SIMD lane
+struct RayPacket4 {
+    float ox[4], oy[4], oz[4];
+    float dx[4], dy[4], dz[4];
+    float tMax[4];
+
+    void set(int lane, const Ray& ray) {
+        ox[lane] = ray.origin.x;
+        oy[lane] = ray.origin.y;
+        oz[lane] = ray.origin.z;
+        dx[lane] = ray.direction.x;
+        dy[lane] = ray.direction.y;
+        dz[lane] = ray.direction.z;
+        tMax[lane] = ray.tMax;
+    }
+
+    Ray get(int lane) const {
+        return Ray(Vec3(ox[lane], oy[lane], oz[lane]), Vec3(dx[lane], dy[lane], dz[lane]), tMax[lane]);
+    }
+};
+
+// Flattened node, two per cache line. Children are stored as adjacent
+// pairs, so an inner node only needs the index of its left child.
+struct BVHNode {
+    Vec3 boundsMin;
+    int32_t leftFirst; // left child, or first triangle of a leaf
+    Vec3 boundsMax;
+    int32_t count;     // triangles in a leaf, 0 for inner nodes
+};
+
+// Bounding volume hierarchy over triangles, built with a binned surface
+// area heuristic. Triangles are stored in traversal order as a corner and
+// two edges, ready for the intersection test.
+class BVH {
+public:
+    static const int BINS = 16;
+    static const int MAX_LEAF_SIZE = 8;
+
+private:
+    struct Triangle {
+        Vec3 v0, edge1, edge2;
+    };
+
+    // Triangle bounds during the build. Ranges of these are partitioned in
+    // place, so each split streams through memory instead of gathering.
+    struct BuildItem {
+        Vec3 boundsMin;
+        float pad;
+        Vec3 boundsMax;
+        int32_t index;
+
+        float centroid(int axis) const { return (boundsMin[axis] + boundsMax[axis]) * 0.5f; }
+    };
+
+    // A subtree left for the parallel phase: node to fill and its triangles
+    struct Task {
+        int node;
+        int begin, end;
+    };
+
+    std::vector<BVHNode> nodes;
+    std::vector<Triangle> triangles;
+    std::vector<int> faceIndex;
+
+    static float area(const Vec3& lo, const Vec3& hi) {
+        Vec3 d = hi - lo;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    static void grow(Vec3& lo, Vec3& hi, const Vec3& pLo, const Vec3& pHi) {
+        lo = Vec3(std::min(lo.x, pLo.x), std::min(lo.y, pLo.y), std::min(lo.z, pLo.z));
+        hi = Vec3(std::max(hi.x, pHi.x), std::max(hi.y, pHi.y), std::max(hi.z, pHi.z));
+    }
+
+#ifdef __SSE2__
+    // Loads of a BuildItem's bounds pick up the index or padding after
+    // them; masking that lane keeps integer bits, which are denormal floats
+    // and slow to compute with, out of the arithmetic
+    static __m128 xyzMask() { return _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)); }
+
+    static Vec3 toVec3(__m128 v) {
+        float f[4];
+        _mm_storeu_ps(f, v);
+        return Vec3(f[0], f[1], f[2]);
+    }
+#endif
+
+    // Counts and bounds of the triangles in each centroid bin, per axis
+    static void binItems(const std::vector<BuildItem>& items, int begin, int end, const Vec3& cLo,
+                         const float scale[3], int binCount[3][BINS], Vec3 binLo[3][BINS], Vec3 binHi[3][BINS]) {
+        const float inf = std::numeric_limits<float>::max();
+#ifdef __SSE2__
+        // Bounds as whole registers
+        __m128 lo[3][BINS], hi[3][BINS];
+        for (int axis = 0; axis < 3; axis++) {
+            for (int b = 0; b < BINS; b++) {
+                lo[axis][b] = _mm_set1_ps(inf);
+                hi[axis][b] = _mm_set1_ps(-inf);
+            }
+        }
+        for (int i = begin; i < end; i++) {
+            const BuildItem& item = items[i];
+            __m128 itemLo = _mm_and_ps(_mm_loadu_ps(&item.boundsMin.x), xyzMask());
+            __m128 itemHi = _mm_and_ps(_mm_loadu_ps(&item.boundsMax.x), xyzMask());
+            for (int axis = 0; axis < 3; axis++) {
+                int b = std::min(BINS - 1, (int)((item.centroid(axis) - cLo[axis]) * scale[axis]));
+                binCount[axis][b]++;
+                lo[axis][b] = _mm_min_ps(lo[axis][b], itemLo);
+                hi[axis][b] = _mm_max_ps(hi[axis][b], itemHi);
+            }
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            for (int b = 0; b < BINS; b++) {
+                binLo[axis][b] = toVec3(lo[axis][b]);
+                binHi[axis][b] = toVec3(hi[axis][b]);
+            }
+        }
+#else
+        for (int axis = 0; axis < 3; axis++) {
+            for (int b = 0; b < BINS; b++) {
+                binLo[axis][b] = Vec3(inf, inf, inf);
+                binHi[axis][b] = Vec3(-inf, -inf, -inf);
+            }
+        }
+        for (int i = begin; i < end; i++) {
+            const BuildItem& item = items[i];
+            for (int axis = 0; axis < 3; axis++) {
+                int b = std::min(BINS - 1, (int)((item.centroid(axis) - cLo[axis]) * scale[axis]));
+                binCount[axis][b]++;
+                grow(binLo[axis][b], binHi[axis][b], item.boundsMin, item.boundsMax);
+            }
+        }
+#endif
+    }
+
+    // Fills node with the bounds of [begin, end) and either makes it a leaf
+    // or partitions the range; returns the split point, or -1 for a leaf
+    static int split(std::vector<BuildItem>& items, BVHNode& node, int begin, int end) {
+        const float inf = std::numeric_limits<float>::max();
+        Vec3 lo(inf, inf, inf), hi(-inf, -inf, -inf);
+        Vec3 cLo = lo, cHi = hi;
+#ifdef __SSE2__
+        __m128 lo4 = _mm_set1_ps(inf), hi4 = _mm_set1_ps(-inf), cLo4 = lo4, cHi4 = hi4;
+        for (int i = begin; i < end; i++) {
+            __m128 itemLo = _mm_and_ps(_mm_loadu_ps(&items[i].boundsMin.x), xyzMask());
+            __m128 itemHi = _mm_and_ps(_mm_loadu_ps(&items[i].boundsMax.x), xyzMask());
+            __m128 c = _mm_mul_ps(_mm_add_ps(itemLo, itemHi), _mm_set1_ps(0.5f));
+            lo4 = _mm_min_ps(lo4, itemLo);
+            hi4 = _mm_max_ps(hi4, itemHi);
+            cLo4 = _mm_min_ps(cLo4, c);
+            cHi4 = _mm_max_ps(cHi4, c);
+        }
+        lo = toVec3(lo4);
+        hi = toVec3(hi4);
+        cLo = toVec3(cLo4);
+        cHi = toVec3(cHi4);
+#else
+        for (int i = begin; i < end; i++) {
+            const BuildItem& item = items[i];
+            Vec3 c = (item.boundsMin + item.boundsMax) * 0.5f;
+            grow(lo, hi, item.boundsMin, item.boundsMax);
+            grow(cLo, cHi, c, c);
+        }
+#endif
+        node.boundsMin = lo;
+        node.boundsMax = hi;
+        node.leftFirst = begin;
+        node.count = end - begin;
+        if (node.count <= 2) return -1;
+
+        // Cheapest bin boundary on any axis; costs are in units of one
+        // triangle test, with a node visit costing about as much. All three
+        // axes are binned in one pass over the triangles.
+        float scale[3];
+        for (int axis = 0; axis < 3; axis++) {
+            float extent = cHi[axis] - cLo[axis];
+            scale[axis] = extent > 0 ? BINS / extent : 0;
+        }
+        int binCount[3][BINS] = {{0}};
+        Vec3 binLo[3][BINS], binHi[3][BINS];
+        binItems(items, begin, end, cLo, scale, binCount, binLo, binHi);
+
+        float bestCost = inf;
+        int bestAxis = -1, bestBin = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0) continue;
+
+            // Sweep from the right, then from the left
+            float rightArea[BINS];
+            int rightCount[BINS];
+            Vec3 accLo(inf, inf, inf), accHi(-inf, -inf, -inf);
+            int count = 0;
+            for (int b = BINS - 1; b > 0; b--) {
+                count += binCount[axis][b];
+                if (binCount[axis][b]) grow(accLo, accHi, binLo[axis][b], binHi[axis][b]);
+                rightCount[b] = count;
+                rightArea[b] = count ? area(accLo, accHi) : 0;
+            }
+            accLo = Vec3(inf, inf, inf);
+            accHi = Vec3(-inf, -inf, -inf);
+            count = 0;
+            for (int b = 0; b < BINS - 1; b++) {
+                count += binCount[axis][b];
+                if (binCount[axis][b]) grow(accLo, accHi, binLo[axis][b], binHi[axis][b]);
+                if (!count || !rightCount[b + 1]) continue;
+                float cost = area(accLo, accHi) * count + rightArea[b + 1] * rightCount[b + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        float leafCost = area(lo, hi) * node.count;
+        float splitCost = area(lo, hi) + bestCost;
+        if (bestAxis < 0 || (splitCost >= leafCost && node.count <= MAX_LEAF_SIZE)) {
+            if (bestAxis >= 0 || node.count <= MAX_LEAF_SIZE) return -1;
+            // Identical centroids: halve the range so leaves stay small
+            return begin + node.count / 2;
+        }
+
+        float axisLo = cLo[bestAxis], axisScale = scale[bestAxis];
+        BuildItem* mid = std::partition(&items[0] + begin, &items[0] + end, [&](const BuildItem& item) {
+            return std::min(BINS - 1, (int)((item.centroid(bestAxis) - axisLo) * axisScale)) <= bestBin;
+        });
+        return (int)(mid - &items[0]);
+    }
+
+    // Builds the subtree of [begin, end) into out with its root at out[root]
+    static void buildRecursive(std::vector<BuildItem>& items, std::vector<BVHNode>& out, int root, int begin, int end) {
+        int mid = split(items, out[root], begin, end);
+        if (mid < 0) return;
+        int left = (int)out.size();
+        out.resize(out.size() + 2);
+        out[root].leftFirst = left;
+        out[root].count = 0;
+        buildRecursive(items, out, left, begin, mid);
+        buildRecursive(items, out, left + 1, mid, end);
+    }
+
+    // Splits serially until the ranges are small enough to share out
+    void buildTop(std::vector<BuildItem>& items, std::vector<Task>& tasks, int root, int begin, int end, int taskSize) {
+        if (end - begin <= taskSize) {
+            Task task = {root, begin, end};
+            tasks.push_back(task);
+            return;
+        }
+        int mid = split(items, nodes[root], begin, end);
+        if (mid < 0) return;
+        int left = (int)nodes.size();
+        nodes.resize(nodes.size() + 2);
+        nodes[root].leftFirst = left;
+        nodes[root].count = 0;
+        buildTop(items, tasks, left, begin, mid, taskSize);
+        buildTop(items, tasks, left + 1, mid, end, taskSize);
+    }
+
+    static bool intersectBox(const BVHNode& node, const Vec3& origin, const Vec3& invDir, float tMax, float& tNear) {
+        float tx1 = (node.boundsMin.x - origin.x) * invDir.x, tx2 = (node.boundsMax.x - origin.x) * invDir.x;
+        float ty1 = (node.boundsMin.y - origin.y) * invDir.y, ty2 = (node.boundsMax.y - origin.y) * invDir.y;
+        float tz1 = (node.boundsMin.z - origin.z) * invDir.z, tz2 = (node.boundsMax.z - origin.z) * invDir.z;
+        float t0 = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.0f));
+        float t1 = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), tMax));
+        tNear = t0;
+        return t0 <= t1;
+    }
+
+    // Moller-Trumbore; hits at t in (0, tMax)
+    static bool intersectTriangle(const Triangle& tri, const Ray& ray, float tMax, float& t, float& u, float& v) {
+        Vec3 p = ray.direction.cross(tri.edge2);
+        float det = tri.edge1.dot(p);
+        if (det == 0) return false;
+        float invDet = 1.0f / det;
+        Vec3 s = ray.origin - tri.v0;
+        u = s.dot(p) * invDet;
+        if (u < 0 || u > 1) return false;
+        Vec3 q = s.cross(tri.edge1);
+        v = ray.direction.dot(q) * invDet;
+        if (v < 0 || u + v > 1) return false;
+        t = tri.edge2.dot(q) * invDet;
+        return t > 0 && t < tMax;
+    }
+
+    static Vec3 inverse(const Vec3& d) {
+        const float inf = std::numeric_limits<float>::max();
+        return Vec3(d.x != 0 ? 1.0f / d.x : inf, d.y != 0 ? 1.0f / d.y : inf, d.z != 0 ? 1.0f / d.z : inf);
+    }
+
+    template <bool ANY_HIT>
+    bool traverse(const Ray& ray, RayHit* hit) const {
+        if (nodes.empty()) return false;
+        Vec3 invDir = inverse(ray.direction);
+        float tMax = ray.tMax;
+        bool found = false;
+        int stack[64];
+        int top = 0;
+        int index = 0;
+        float tNear;
+        if (!intersectBox(nodes[0], ray.origin, invDir, tMax, tNear)) return false;
+        while (true) {
+            const BVHNode& node = nodes[index];
+            if (node.count > 0) {
+                for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                    float t, u, v;
+                    if (!intersectTriangle(triangles[i], ray, tMax, t, u, v)) continue;
+                    if (ANY_HIT) return true;
+                    tMax = t;
+                    hit->t = t;
+                    hit->face = faceIndex[i];
+                    hit->u = u;
+                    hit->v = v;
+                    found = true;
+                }
+            } else {
+                // Visit the nearer child first and keep the other for later
+                int left = node.leftFirst;
+                float tLeft, tRight;
+                bool hitLeft = intersectBox(nodes[left], ray.origin, invDir, tMax, tLeft);
+                bool hitRight = intersectBox(nodes[left + 1], ray.origin, invDir, tMax, tRight);
+                if (hitLeft && hitRight) {
+                    bool leftFirst = tLeft <= tRight;
+                    if (top < 64) stack[top++] = leftFirst ? left + 1 : left;
+                    index = leftFirst ? left : left + 1;
+                    continue;
+                }
+                if (hitLeft || hitRight) {
+                    index = hitLeft ? left : left + 1;
+                    continue;
+                }
+            }
+            if (top == 0) break;
+            index = stack[--top];
+        }
+        return found;
+    }
+
+public:
+    // Builds over count triangles given as three corners each; hits report
+    // the triangle's position in that array
+    void build(const Vec3* corners, int count, ThreadPool* pool = nullptr) {
+        nodes.clear();
+        triangles.clear();
+        faceIndex.clear();
+        if (count <= 0) return;
+
+        std::vector<BuildItem> items(count);
+        auto prepare = [&](int begin, int end) {
+            for (int t = begin; t < end; t++) {
+                const Vec3* v = corners + t * 3;
+                BuildItem& item = items[t];
+                item.boundsMin = v[0];
+                item.boundsMax = v[0];
+                grow(item.boundsMin, item.boundsMax, v[1], v[1]);
+                grow(item.boundsMin, item.boundsMax, v[2], v[2]);
+                item.index = t;
+                item.pad = 0;
+            }
+        };
+        if (pool) pool->parallelForRange(count, 16384, prepare);
+        else prepare(0, count);
+
+        // The top of the tree is split on this thread; the subtrees below
+        // it are independent ranges of items and get built in parallel
+        int threads = pool ? pool->getThreadCount() : 1;
+        int taskSize = threads > 1 ? std::max(1024, count / (threads * 8)) : count;
+        std::vector<Task> tasks;
+        nodes.reserve(count * 2 / 3);
+        nodes.resize(1);
+        buildTop(items, tasks, 0, 0, count, taskSize);
+
+        std::vector<std::vector<BVHNode> > subtrees(tasks.size());
+        auto buildTask = [&](int i) {
+            subtrees[i].resize(1);
+            buildRecursive(items, subtrees[i], 0, tasks[i].begin, tasks[i].end);
+        };
+        if (pool) pool->parallelFor((int)tasks.size(), buildTask);
+        else for (int i = 0; i < (int)tasks.size(); i++) buildTask(i);
+
+        // Append each subtree below the top; its root replaces the task's
+        // placeholder node and its other nodes shift by the append offset
+        for (size_t i = 0; i < tasks.size(); i++) {
+            const std::vector<BVHNode>& sub = subtrees[i];
+            int offset = (int)nodes.size() - 1;
+            for (size_t n = 0; n < sub.size(); n++) {
+                BVHNode node = sub[n];
+                if (node.count == 0) node.leftFirst += offset;
+                if (n == 0) nodes[tasks[i].node] = node;
+                else nodes.push_back(node);
+            }
+        }
+
+        triangles.resize(count);
+        faceIndex.resize(count);
+        auto gather = [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                int t = items[i].index;
+                const Vec3* v = corners + t * 3;
+                triangles[i].v0 = v[0];
+                triangles[i].edge1 = v[1] - v[0];
+                triangles[i].edge2 = v[2] - v[0];
+                faceIndex[i] = t;
+            }
+        };
+        if (pool) pool->parallelForRange(count, 16384, gather);
+        else gather(0, count);
+    }
+
+    bool empty() const { return nodes.empty(); }
+    int getNodeCount() const { return (int)nodes.size(); }
+    int getTriangleCount() const { return (int)triangles.size(); }
+    const BVHNode& getRoot() const { return nodes[0]; }
+
+    // Nearest hit along the ray
+    bool intersect(const Ray& ray, RayHit& hit) const { return traverse<false>(ray, &hit); }
+
+    // Any hit before tMax, for shadow and occlusion rays
+    bool occluded(const Ray& ray) const { return traverse<true>(ray, nullptr); }
+
+    // Any-hit test of the rays in active (bit i = lane i); returns the mask
+    // of rays that hit. The packet walks the tree together, visiting a
+    // node while any of its live rays overlaps it.
+    int occluded4(const RayPacket4& packet, int active = 0xf) const {
+        if (nodes.empty() || !active) return 0;
+#ifdef __SSE2__
+        const __m128 ox = _mm_loadu_ps(packet.ox), oy = _mm_loadu_ps(packet.oy), oz = _mm_loadu_ps(packet.oz);
+        const __m128 dx = _mm_loadu_ps(packet.dx), dy = _mm_loadu_ps(packet.dy), dz = _mm_loadu_ps(packet.dz);
+        const __m128 tMax = _mm_loadu_ps(packet.tMax);
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+        float inv[3][4];
+        for (int i = 0; i < 4; i++) {
+            Vec3 d = inverse(Vec3(packet.dx[i], packet.dy[i], packet.dz[i]));
+            inv[0][i] = d.x;
+            inv[1][i] = d.y;
+            inv[2][i] = d.z;
+        }
+        const __m128 ix = _mm_loadu_ps(inv[0]), iy = _mm_loadu_ps(inv[1]), iz = _mm_loadu_ps(inv[2]);
+
+        int hit = 0;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const BVHNode& node = nodes[stack[--top]];
+            __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.x), ox), ix);
+            __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.x), ox), ix);
+            __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.y), oy), iy);
+            __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.y), oy), iy);
+            __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.z), oz), iz);
+            __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.z), oz), iz);
+            __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)),
+                                   _mm_max_ps(_mm_min_ps(tz1, tz2), zero));
+            __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)),
+                                   _mm_min_ps(_mm_max_ps(tz1, tz2), tMax));
+            int lanes = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & active & ~hit;
+            if (!lanes) continue;
+
+            if (node.count == 0) {
+                if (top + 2 > 64) continue;
+                stack[top++] = node.leftFirst + 1;
+                stack[top++] = node.leftFirst;
+                continue;
+            }
+
+            // Moller-Trumbore on all four rays against each triangle
+            for (int i = node.leftFirst; i < node.leftFirst + node.count && lanes; i++) {
+                const Triangle& tri = triangles[i];
+                __m128 e1x = _mm_set1_ps(tri.edge1.x), e1y = _mm_set1_ps(tri.edge1.y), e1z = _mm_set1_ps(tri.edge1.z);
+                __m128 e2x = _mm_set1_ps(tri.edge2.x), e2y = _mm_set1_ps(tri.edge2.y), e2z = _mm_set1_ps(tri.edge2.z);
+                __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+                __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+                __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+                __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+                __m128 invDet = _mm_div_ps(one, det);
+                __m128 sx = _mm_sub_ps(ox, _mm_set1_ps(tri.v0.x));
+                __m128 sy = _mm_sub_ps(oy, _mm_set1_ps(tri.v0.y));
+                __m128 sz = _mm_sub_ps(oz, _mm_set1_ps(tri.v0.z));
+                __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+                __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+                __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+                __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+                __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+                __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)),
+                                           _mm_cmple_ps(_mm_add_ps(u, v), one));
+                __m128 inRange = _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, tMax));
+                __m128 valid = _mm_cmpneq_ps(det, zero);
+                int hits = _mm_movemask_ps(_mm_and_ps(_mm_and_ps(inside, inRange), valid)) & lanes;
+                hit |= hits;
+                lanes &= ~hits;
+            }
+            if ((hit & active) == active) break;
+        }
+        return hit & active;
+#else
+        int hit = 0;
+        for (int i = 0; i < 4; i++) {
+            if ((active >> i & 1) && occluded(packet.get(i))) hit |= 1 << i;
+        }
+        return hit;
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "Vec3.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cmath>
+
+// A view to render: where the camera is, what it looks at, its vertical
+// field of view in radians and the depth range it keeps
+struct CameraSpec {
+    Vec3 position;
+    Vec3 target;
+    Vec3 up;
+    float fov;
+    float near, far;
+
+    CameraSpec() : position(0, 0, 3), target(0, 0, 0), up(0, 1, 0), fov(3.14159f / 4.0f), near(0.1f), far(100.0f) {}
+    CameraSpec(const Vec3& position_, const Vec3& target_, float fov_)
+        : position(position_), target(target_), up(0, 1, 0), fov(fov_), near(0.1f), far(100.0f) {}
+
+    // Moves the far plane out just enough to keep a sphere in view
+    void fitFar(const Vec3& center, float radius) { far = (position - center).length() + radius; }
+};
+
+// Reads one camera per line, "px py pz tx ty tz [fov in degrees]", with
+// fov defaulting to fovDefault; blank lines and # comments are skipped
+inline bool loadCameraFile(const std::string& filename, float fovDefault, std::vector<CameraSpec>& cameras) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open camera file " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        std::istringstream in(line);
+        std::string first;
+        if (!(in >> first) || first[0] == '#') continue;
+        in.clear();
+        in.seekg(0);
+        Vec3 position, target;
+        if (!(in >> position.x >> position.y >> position.z >> target.x >> target.y >> target.z)) {
+            std::cerr << "Error: " << filename << ":" << number << ": expected px py pz tx ty tz [fov]" << std::endl;
+            return false;
+        }
+        float distance = (target - position).length();
+        if (!(distance > 0) || !std::isfinite(distance)) {
+            std::cerr << "Error: " << filename << ":" << number << ": camera needs a finite target away from its position"
+                      << std::endl;
+            return false;
+        }
+        float degrees;
+        float fov = in >> degrees ? degrees * 3.14159f / 180.0f : fovDefault;
+        cameras.push_back(CameraSpec(position, target, fov));
+    }
+    return true;
+}
+
+// count cameras evenly spaced on a circle around the vertical axis through
+// target, the first at target + offset, all at its height and distance
+inline std::vector<CameraSpec> turntableCameras(const Vec3& target, const Vec3& offset, float fov, int count) {
+    std::vector<CameraSpec> cameras;
+    for (int i = 0; i < count; i++) {
+        float angle = 2.0f * 3.14159265f * i / count;
+        float c = std::cos(angle), s = std::sin(angle);
+        Vec3 rotated(offset.x * c + offset.z * s, offset.y, offset.z * c - offset.x * s);
+        cameras.push_back(CameraSpec(target + rotated, target, fov));
+    }
+    return cameras;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef CLIPPER_H
+#define CLIPPER_H
+
+#include "Vec3.h"
+
+// Clips polygons in homogeneous clip space, before the perspective divide,
+// so geometry crossing the eye plane is cut off instead of wrapping around.
+//
+// x and y are clipped against a guard band of guardBand * w rather than the
+// screen edges: the rasterizer already discards off-screen pixels, so those
+// planes only need to keep coordinates inside its fixed-point range.
+class Clipper {
+public:
+    enum Plane {
+        PLANE_NEAR = 1,
+        PLANE_FAR = 2,
+        PLANE_LEFT = 4,
+        PLANE_RIGHT = 8,
+        PLANE_BOTTOM = 16,
+        PLANE_TOP = 32
+    };
+
+    // A triangle gains at most one vertex per plane
+    static const int MAX_VERTICES = 3 + 6;
+
+    // Planes that v lies outside of, with x/y bounded by +-extent * w
+    static int outcode(const Vec4& v, float extent) {
+        int code = 0;
+        if (v.z < -v.w) code |= PLANE_NEAR;
+        if (v.z > v.w) code |= PLANE_FAR;
+        if (v.x < -extent * v.w) code |= PLANE_LEFT;
+        if (v.x > extent * v.w) code |= PLANE_RIGHT;
+        if (v.y < -extent * v.w) code |= PLANE_BOTTOM;
+        if (v.y > extent * v.w) code |= PLANE_TOP;
+        return code;
+    }
+
+    // Sutherland-Hodgman against every plane in planes. polygon holds count
+    // vertices and room for MAX_VERTICES; returns the clipped vertex count.
+    static int clipPolygon(Vec4* polygon, int count, int planes, float guardBand) {
+        Vec4 buffer[MAX_VERTICES];
+        for (int plane = PLANE_NEAR; plane <= PLANE_TOP && count >= 3; plane <<= 1) {
+            if (!(planes & plane)) continue;
+
+            int outCount = 0;
+            for (int i = 0; i < count; i++) {
+                const Vec4& a = polygon[i];
+                const Vec4& b = polygon[(i + 1) % count];
+                float da = distance(a, plane, guardBand);
+                float db = distance(b, plane, guardBand);
+                if (da >= 0) buffer[outCount++] = a;
+                if ((da >= 0) != (db >= 0)) buffer[outCount++] = a + (b - a) * (da / (da - db));
+            }
+            for (int i = 0; i < outCount; i++) polygon[i] = buffer[i];
+            count = outCount;
+        }
+        return count >= 3 ? count : 0;
+    }
+
+private:
+    // Signed distance to a plane, >= 0 on the inside
+    static float distance(const Vec4& v, int plane, float guardBand) {
+        switch (plane) {
+            case PLANE_NEAR: return v.w + v.z;
+            case PLANE_FAR: return v.w - v.z;
+            case PLANE_LEFT: return guardBand * v.w + v.x;
+            case PLANE_RIGHT: return guardBand * v.w - v.x;
+            case PLANE_BOTTOM: return guardBand * v.w + v.y;
+            default: return guardBand * v.w - v.y;
+        }
+    }
+};
+
+#endif
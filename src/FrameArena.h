@@ -0,0 +1,102 @@
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Linear allocator for data that lives for one frame. Allocating bumps an
+// offset and nothing is freed until reset(), which keeps the memory. A
+// frame that outgrows the block chains more; the next reset replaces the
+// chain with a single block as large as that frame needed, so once warmed
+// up frames are served without touching the heap. Not thread safe: one
+// thread builds a frame's lists.
+class FrameArena {
+private:
+    struct Block {
+        std::unique_ptr<char[]> memory;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t offset;    // into the last block
+    size_t allocated; // this frame, over every block
+
+    void addBlock(size_t size) {
+        Block block;
+        block.memory.reset(new char[size]);
+        block.size = size;
+        blocks.push_back(std::move(block));
+        offset = 0;
+    }
+
+public:
+    explicit FrameArena(size_t initialSize = 64 * 1024) : offset(0), allocated(0) {
+        blocks.reserve(16);
+        addBlock(initialSize);
+    }
+
+    // size bytes aligned to align, a power of two
+    void* allocate(size_t size, size_t align) {
+        Block* block = &blocks.back();
+        uintptr_t base = (uintptr_t)block->memory.get();
+        size_t start = ((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+        if (start + size > block->size) {
+            addBlock(std::max(block->size * 2, size + align));
+            block = &blocks.back();
+            base = (uintptr_t)block->memory.get();
+            start = ((base + align - 1) & ~(uintptr_t)(align - 1)) - base;
+        }
+        offset = start + size;
+        allocated += size;
+        return block->memory.get() + start;
+    }
+
+    // Frees everything allocated since the last reset
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block& block : blocks) total += block.size;
+            blocks.clear();
+            addBlock(total);
+        }
+        offset = 0;
+        allocated = 0;
+    }
+
+    size_t getAllocated() const { return allocated; }
+    size_t getCapacity() const {
+        size_t total = 0;
+        for (const Block& block : blocks) total += block.size;
+        return total;
+    }
+};
+
+// Standard allocator over a FrameArena; deallocation is a no-op
+template <class T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    FrameArena* arena;
+
+    explicit ArenaAllocator(FrameArena& arena_) : arena(&arena_) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+// A vector whose storage comes from a FrameArena, for lists rebuilt every
+// frame. Growing leaves the old storage in the arena until reset.
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
@@ -2,41 +2,157 @@
 #define FRAMEBUFFER_H
 
 #include "Vec3.h"
+#include "RasterKernels.h"
 #include <vector>
 #include <fstream>
 #include <algorithm>
 #include <limits>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <iostream>
+
+// Sub-pixel precision of the rasterizer (24.8 fixed point)
+const int SUBPIXEL_BITS = 8;
+const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+// Side of the square pixel blocks the coarse depth buffer tracks
+const int HIZ_BLOCK = 8;
+
+// Multisample positions from the pixel centre, in 1/16 pixel: the usual
+// rotated grid for 4x and the sparse pattern D3D specifies for 8x
+const int SAMPLE_GRID = 16;
+const int SAMPLE_PATTERN_4[4 * 2] = {-2, -6, 6, -2, -6, 2, 2, 6};
+const int SAMPLE_PATTERN_8[8 * 2] = {1, -3, -1, 3, 5, 1, -3, -5, -5, 5, -7, -1, 3, 7, 7, -7};
+
+// Early depth rejection counters, accumulated since the last clear(). A
+// triangle drawn tile by tile is counted once per tile.
+struct RasterStats {
+    uint64_t trianglesDrawn;  // reached the per-pixel kernels
+    uint64_t trianglesCulled; // hidden in every block they overlap
+    uint64_t blocksDrawn;
+    uint64_t blocksCulled;
+};
+
+// Edge function of a fixed-point edge a->b, set up at the centre of pixel
+// (px, py). The top-left bias is folded in so a pixel is covered exactly
+// when the value is >= 0.
+struct EdgeFunction {
+    int64_t stepX, stepY;
+    int64_t start;
+
+    EdgeFunction(int64_t ax, int64_t ay, int64_t bx, int64_t by, int px, int py) {
+        const int one = SUBPIXEL_ONE;
+        int64_t dx = bx - ax;
+        int64_t dy = by - ay;
+        bool topLeft = dy < 0 || (dy == 0 && dx > 0);
+        int64_t cx = (int64_t)px * one + one / 2;
+        int64_t cy = (int64_t)py * one + one / 2;
+        start = dx * (cy - ay) - dy * (cx - ax) - (topLeft ? 0 : 1);
+        stepX = -dy * one;
+        stepY = dx * one;
+    }
+};
 
 class Framebuffer {
 private:
     int width, height;
+    bool depthOnly; // no colour buffer; draws only test and write depth
     std::vector<Color> colorBuffer;
     std::vector<float> depthBuffer;
+    SimdLevel simdLevel;
+    RasterRowFn rasterRow;
+
+    // Multisampling: sampleCount colours and depths per pixel, one colour
+    // per triangle written to the samples it covers, averaged into
+    // colorBuffer by resolve(). The coarse depth blocks track samples.
+    int sampleCount;
+    const int* samplePattern;
+    std::vector<Color> sampleColors;
+    std::vector<float> sampleDepths;
+    RasterRowFn sampleRow;
+    ResolveRowFn resolveRow;
+
+    // Coarse depth: bounds on the nearest and farthest depth of each
+    // HIZ_BLOCK square. Drawing keeps them conservative and marks the block
+    // stale; a triangle that tighter bounds might cull recomputes them from
+    // the depth buffer first.
+    int blocksX, blocksY;
+    std::vector<float> blockMinDepth, blockMaxDepth;
+    std::vector<unsigned char> blockStale;
+    bool hiZ;
+    std::atomic<uint64_t> statTrianglesDrawn, statTrianglesCulled, statBlocksDrawn, statBlocksCulled;
+
+    void updateBlock(int block) {
+        int x0 = (block % blocksX) * HIZ_BLOCK, y0 = (block / blocksX) * HIZ_BLOCK;
+        int x1 = std::min(width, x0 + HIZ_BLOCK), y1 = std::min(height, y0 + HIZ_BLOCK);
+        if (sampleCount > 1) {
+            depthRange(&sampleDepths[((size_t)y0 * width + x0) * sampleCount], width * sampleCount,
+                       (x1 - x0) * sampleCount, y1 - y0, blockMinDepth[block], blockMaxDepth[block]);
+        } else {
+            depthRange(&depthBuffer[y0 * width + x0], width, x1 - x0, y1 - y0,
+                       blockMinDepth[block], blockMaxDepth[block]);
+        }
+        blockStale[block] = 0;
+    }
 
 public:
-    Framebuffer(int w, int h) : width(w), height(h) {
-        colorBuffer.resize(width * height);
+    Framebuffer(int w, int h, bool depthOnly_ = false)
+        : width(w), height(h), depthOnly(depthOnly_), sampleCount(1), samplePattern(nullptr), sampleRow(nullptr),
+          resolveRow(nullptr), hiZ(false) {
+        setSimdLevel(detectSimdLevel());
+        if (!depthOnly) colorBuffer.resize(width * height);
         depthBuffer.resize(width * height);
+        blocksX = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        blocksY = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        blockMinDepth.resize(blocksX * blocksY);
+        blockMaxDepth.resize(blocksX * blocksY);
+        blockStale.resize(blocksX * blocksY);
         clear();
     }
 
     void clear(Color color = Color(0, 0, 0)) {
         std::fill(colorBuffer.begin(), colorBuffer.end(), color);
         std::fill(depthBuffer.begin(), depthBuffer.end(), std::numeric_limits<float>::max());
+        std::fill(sampleColors.begin(), sampleColors.end(), color);
+        std::fill(sampleDepths.begin(), sampleDepths.end(), std::numeric_limits<float>::max());
+        std::fill(blockMinDepth.begin(), blockMinDepth.end(), std::numeric_limits<float>::max());
+        std::fill(blockMaxDepth.begin(), blockMaxDepth.end(), std::numeric_limits<float>::max());
+        std::fill(blockStale.begin(), blockStale.end(), 0);
+        resetStats();
     }
 
+    // Single sampled, a pixel passes or fails the depth test as a whole;
+    // multisampled, each of its samples does
     void setPixel(int x, int y, const Color& color, float depth = 0.0f) {
         if (x >= 0 && x < width && y >= 0 && y < height) {
             int index = y * width + x;
-            if (depth < depthBuffer[index]) {
-                colorBuffer[index] = color;
+            bool written = false;
+            if (sampleCount > 1) {
+                for (int k = 0; k < sampleCount; k++) {
+                    size_t sample = (size_t)index * sampleCount + k;
+                    if (depth < sampleDepths[sample]) {
+                        sampleColors[sample] = color;
+                        sampleDepths[sample] = depth;
+                        written = true;
+                    }
+                }
+            } else if (depth < depthBuffer[index]) {
+                if (!depthOnly) colorBuffer[index] = color;
                 depthBuffer[index] = depth;
+                written = true;
+            }
+            if (written) {
+                int block = (y / HIZ_BLOCK) * blocksX + x / HIZ_BLOCK;
+                blockMinDepth[block] = std::min(blockMinDepth[block], depth);
+                blockStale[block] = 1;
             }
         }
     }
 
     Color getPixel(int x, int y) const {
-        if (x >= 0 && x < width && y >= 0 && y < height) {
+        if (!depthOnly && x >= 0 && x < width && y >= 0 && y < height) {
             return colorBuffer[y * width + x];
         }
         return Color(0, 0, 0);
@@ -49,9 +165,116 @@ public:
         return std::numeric_limits<float>::max();
     }
 
+    // Rows of width entries, for passes over the finished image
+    const float* getDepthRow(int y) const { return &depthBuffer[y * width]; }
+    Color* getColorRow(int y) { return depthOnly ? nullptr : &colorBuffer[y * width]; }
+
+    // The getSampleCount() colours of pixel (x, y) that draws write, which
+    // are the pixel itself when single sampled
+    Color* getSampleColors(int x, int y) {
+        if (sampleCount > 1) return &sampleColors[((size_t)y * width + x) * sampleCount];
+        return depthOnly ? nullptr : &colorBuffer[y * width + x];
+    }
+
+    // Exchanges the colour buffer with pixels, which is resized to match,
+    // so a finished image can be handed off without a copy. The buffer then
+    // holds whatever pixels did until the next clear().
+    void swapColorBuffer(std::vector<Color>& pixels) {
+        if (depthOnly) return;
+        pixels.resize((size_t)width * height);
+        colorBuffer.swap(pixels);
+    }
+
+    // 1, 4 or 8 samples per pixel; clears the samples. Depth-only buffers
+    // are single sampled.
+    bool setSampleCount(int count) {
+        if ((count != 1 && count != 4 && count != 8) || (depthOnly && count != 1)) {
+            std::cerr << "Error: " << count << " samples per pixel not supported (use 1, 4 or 8)" << std::endl;
+            return false;
+        }
+        sampleCount = count;
+        samplePattern = count == 8 ? SAMPLE_PATTERN_8 : count == 4 ? SAMPLE_PATTERN_4 : nullptr;
+        size_t samples = count > 1 ? (size_t)width * height * count : 0;
+        sampleColors.assign(samples, Color(0, 0, 0));
+        sampleDepths.assign(samples, std::numeric_limits<float>::max());
+        sampleColors.shrink_to_fit();
+        sampleDepths.shrink_to_fit();
+        sampleRow = count > 1 ? rasterRowSamples<true> : nullptr;
+        resolveRow = selectResolveKernel(count);
+        return true;
+    }
+    int getSampleCount() const { return sampleCount; }
+
+    // Averages the samples of pixels [x0, x1) x [y0, y1) into the colour
+    // buffer and keeps their nearest depth in the depth buffer, for the
+    // passes and output that read pixels. Nothing to do single sampled.
+    void resolve(int x0, int y0, int x1, int y1) {
+        if (sampleCount == 1 || depthOnly) return;
+        for (int y = y0; y < y1; y++) {
+            size_t index = (size_t)y * width + x0;
+            resolveRow(&sampleColors[index * sampleCount], &sampleDepths[index * sampleCount], x1 - x0,
+                       &colorBuffer[index], &depthBuffer[index]);
+        }
+    }
+    void resolve() { resolve(0, 0, width, height); }
+
+    bool isDepthOnly() const { return depthOnly; }
     int getWidth() const { return width; }
     int getHeight() const { return height; }
 
+    // Selects the raster kernel; levels the CPU lacks fall back to the best it has
+    void setSimdLevel(SimdLevel level) {
+        SimdLevel supported = cpuSimdLevel();
+        simdLevel = (int)level < (int)supported ? level : supported;
+        rasterRow = selectRasterKernel(simdLevel, depthOnly);
+    }
+    SimdLevel getSimdLevel() const { return simdLevel; }
+
+    // Early rejection against the coarse depth blocks; the image is the
+    // same either way. Off by default: when little is hidden the per block
+    // tests cost more than they save.
+    void setHiZ(bool enabled) { hiZ = enabled; }
+    bool getHiZ() const { return hiZ; }
+
+    // Depth range of the block containing pixel (x, y)
+    void getBlockDepth(int x, int y, float& nearest, float& farthest) {
+        int block = (y / HIZ_BLOCK) * blocksX + x / HIZ_BLOCK;
+        if (blockStale[block]) updateBlock(block);
+        nearest = blockMinDepth[block];
+        farthest = blockMaxDepth[block];
+    }
+
+    // True if nothing at depth or beyond could show inside pixels [x0, x1] x
+    // [y0, y1]: every block there is already covered by nearer geometry
+    bool isRectHidden(int x0, int y0, int x1, int y1, float depth) {
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, width - 1);
+        y1 = std::min(y1, height - 1);
+        if (x0 > x1 || y0 > y1) return true;
+        for (int by = y0 / HIZ_BLOCK; by <= y1 / HIZ_BLOCK; by++) {
+            for (int bx = x0 / HIZ_BLOCK; bx <= x1 / HIZ_BLOCK; bx++) {
+                int block = by * blocksX + bx;
+                if (blockStale[block]) updateBlock(block);
+                if (!(depth >= blockMaxDepth[block])) return false;
+            }
+        }
+        return true;
+    }
+
+    RasterStats getStats() const {
+        RasterStats stats;
+        stats.trianglesDrawn = statTrianglesDrawn.load();
+        stats.trianglesCulled = statTrianglesCulled.load();
+        stats.blocksDrawn = statBlocksDrawn.load();
+        stats.blocksCulled = statBlocksCulled.load();
+        return stats;
+    }
+
+    void resetStats() {
+        statTrianglesDrawn = statTrianglesCulled = statBlocksDrawn = statBlocksCulled = 0;
+    }
+
     // Lesson 1: Bresenham's Line Drawing Algorithm
     void drawLine(int x0, int y0, int x1, int y1, const Color& color) {
         int dx = abs(x1 - x0);
@@ -77,45 +300,305 @@ public:
         }
     }
 
-    // Helper function for barycentric coordinates
-    Vec3 barycentric(const Vec2& p, const Vec2& a, const Vec2& b, const Vec2& c) const {
-        float denom = (b.y - c.y) * (a.x - c.x) + (c.x - b.x) * (a.y - c.y);
-        if (std::abs(denom) < 0.001f) return Vec3(-1, 0, 0); // Degenerate triangle
-        
-        float w0 = ((b.y - c.y) * (p.x - c.x) + (c.x - b.x) * (p.y - c.y)) / denom;
-        float w1 = ((c.y - a.y) * (p.x - c.x) + (a.x - c.x) * (p.y - c.y)) / denom;
-        float w2 = 1.0f - w0 - w1;
-        
-        return Vec3(w0, w1, w2);
-    }
-
     // Lesson 2: Triangle rasterization
     void drawTriangle(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Color& color) {
-        Vec2 bboxmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
-        Vec2 bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-        Vec2 clamp(width - 1, height - 1);
-
-        // Find bounding box
-        bboxmin.x = std::max(0.0f, std::min({bboxmin.x, v0.x, v1.x, v2.x}));
-        bboxmin.y = std::max(0.0f, std::min({bboxmin.y, v0.y, v1.y, v2.y}));
-        bboxmax.x = std::min(clamp.x, std::max({bboxmax.x, v0.x, v1.x, v2.x}));
-        bboxmax.y = std::min(clamp.y, std::max({bboxmax.y, v0.y, v1.y, v2.y}));
-
-        Vec2 P;
-        for (P.x = bboxmin.x; P.x <= bboxmax.x; P.x++) {
-            for (P.y = bboxmin.y; P.y <= bboxmax.y; P.y++) {
-                Vec3 bc_screen = barycentric(P, Vec2(v0.x, v0.y), Vec2(v1.x, v1.y), Vec2(v2.x, v2.y));
-                if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0) continue;
-                
-                // Lesson 3: Z-buffer (depth testing)
-                float z = v0.z * bc_screen.x + v1.z * bc_screen.y + v2.z * bc_screen.z;
-                setPixel((int)P.x, (int)P.y, color, z);
+        drawTriangle(v0, v1, v2, color, 0, 0, width, height);
+    }
+
+    // Half-space rasterizer. Vertices are snapped to fixed point and the three
+    // edge functions are stepped incrementally in exact integer arithmetic,
+    // sampling at pixel centres with a top-left fill rule, so triangles that
+    // share an edge never leave cracks or touch a pixel twice.
+    //
+    // Only pixels inside [minX, maxX) x [minY, maxY) are written. Edge values
+    // and depth do not depend on where traversal starts, so drawing a
+    // triangle tile by tile gives exactly the pixels of drawing it in one go.
+    // Calls may run concurrently on disjoint rectangles whose edges are
+    // multiples of HIZ_BLOCK, since each coarse depth block has one owner.
+    void drawTriangle(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Color& color,
+                      int minX, int minY, int maxX, int maxY) {
+        rasterize(v0, v1, v2, minX, minY, maxX, maxY, [&](RasterRow& row, int x, int y) {
+            size_t index = (size_t)y * width + x;
+            row.color = color;
+            if (sampleCount > 1) {
+                sampleRow(row, &sampleColors[index * sampleCount], &sampleDepths[index * sampleCount]);
+            } else {
+                rasterRow(row, depthOnly ? nullptr : &colorBuffer[index], &depthBuffer[index]);
             }
+        });
+    }
+
+    // Draws a triangle like drawTriangle, but instead of writing a colour
+    // hands each pixel with samples that pass the depth test to
+    // fragment(x, y, values, samples), with the attributes of planes
+    // interpolated at the pixel centre and samples the mask of those that
+    // passed, which getSampleColors(x, y) indexes; it is 1 single sampled.
+    // Planes supplies COUNT and a Stepper that walks it along a row.
+    template <class Planes, class Fragment>
+    void drawTriangleVaryings(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Planes& planes,
+                              int minX, int minY, int maxX, int maxY, Fragment&& fragment) {
+        rasterize(v0, v1, v2, minX, minY, maxX, maxY, [&](RasterRow& row, int x, int y) {
+            typename Planes::Stepper stepper(planes, x, y);
+            size_t index = (size_t)y * width + x;
+            float* depths = sampleCount > 1 ? &sampleDepths[index * sampleCount] : &depthBuffer[index];
+            int64_t w0 = row.w[0], w1 = row.w[1], w2 = row.w[2];
+            float values[Planes::COUNT];
+            for (int i = 0; i < row.count; i++) {
+                if (sampleCount > 1) {
+                    // One fragment for all the samples it covers
+                    unsigned covered = coveredSamples(*row.samples, w0, w1, w2);
+                    if (covered) {
+                        float z = row.zRow + row.zStepX * (float)(row.xOffset + i);
+                        unsigned passed = writeSamples(*row.samples, covered, z, depths + i * sampleCount, nullptr,
+                                                       row.color);
+                        if (passed) {
+                            stepper.get(values);
+                            fragment(x + i, y, values, passed);
+                        }
+                    }
+                } else if ((w0 | w1 | w2) >= 0) {
+                    // Same depth as the kernels compute
+                    float z = row.zRow + row.zStepX * (float)(row.xOffset + i);
+                    if (z < depths[i]) {
+                        depths[i] = z;
+                        stepper.get(values);
+                        fragment(x + i, y, values, 1u);
+                    }
+                }
+                w0 += row.stepX[0];
+                w1 += row.stepX[1];
+                w2 += row.stepX[2];
+                stepper.step();
+            }
+        });
+    }
+
+private:
+    // Triangle setup, traversal and coarse depth culling shared by the draw
+    // calls; drawRow(row, x, y) depth-tests one row of a span from pixel (x, y)
+    template <class RowFn>
+    void rasterize(const Vec3& v0, const Vec3& v1, const Vec3& v2, int minX, int minY, int maxX, int maxY,
+                   const RowFn& drawRow) {
+        // Keep edge function products inside 64 bits
+        const float limit = (float)(1 << 22);
+        const Vec3* v[3] = {&v0, &v1, &v2};
+        for (int i = 0; i < 3; i++) {
+            if (!(std::abs(v[i]->x) < limit && std::abs(v[i]->y) < limit)) return;
+        }
+
+        int64_t x0 = std::llround(v0.x * SUBPIXEL_ONE), y0 = std::llround(v0.y * SUBPIXEL_ONE);
+        int64_t x1 = std::llround(v1.x * SUBPIXEL_ONE), y1 = std::llround(v1.y * SUBPIXEL_ONE);
+        int64_t x2 = std::llround(v2.x * SUBPIXEL_ONE), y2 = std::llround(v2.y * SUBPIXEL_ONE);
+        float z0 = v0.z, z1 = v1.z, z2 = v2.z;
+
+        // Orient counter-clockwise so inside means all edges >= 0
+        int64_t area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+        if (area == 0) return;
+        if (area < 0) {
+            std::swap(x1, x2);
+            std::swap(y1, y2);
+            std::swap(z1, z2);
+            area = -area;
+        }
+
+        // Pixel bounding box, clipped to the screen
+        int bx0 = std::max(0, (int)(std::min({x0, x1, x2}) >> SUBPIXEL_BITS));
+        int by0 = std::max(0, (int)(std::min({y0, y1, y2}) >> SUBPIXEL_BITS));
+        int bx1 = std::min(width - 1, (int)(std::max({x0, x1, x2}) >> SUBPIXEL_BITS));
+        int by1 = std::min(height - 1, (int)(std::max({y0, y1, y2}) >> SUBPIXEL_BITS));
+        if (bx0 > bx1 || by0 > by1) return;
+
+        // Depth plane relative to the bounding box corner
+        double fx1 = (double)(x1 - x0) / SUBPIXEL_ONE, fy1 = (double)(y1 - y0) / SUBPIXEL_ONE;
+        double fx2 = (double)(x2 - x0) / SUBPIXEL_ONE, fy2 = (double)(y2 - y0) / SUBPIXEL_ONE;
+        double farea = fx1 * fy2 - fy1 * fx2;
+        double dzdx = ((z1 - z0) * fy2 - (z2 - z0) * fy1) / farea;
+        double dzdy = ((z2 - z0) * fx1 - (z1 - z0) * fx2) / farea;
+        double cx = bx0 + 0.5 - (double)x0 / SUBPIXEL_ONE;
+        double cy = by0 + 0.5 - (double)y0 / SUBPIXEL_ONE;
+        float zBase = (float)(z0 + dzdx * cx + dzdy * cy);
+        float zStepX = (float)dzdx, zStepY = (float)dzdy;
+
+        // Clip traversal to the requested rectangle
+        int px0 = std::max(bx0, minX), px1 = std::min(bx1, maxX - 1);
+        int py0 = std::max(by0, minY), py1 = std::min(by1, maxY - 1);
+        if (px0 > px1 || py0 > py1) return;
+
+        EdgeFunction e12(x1, y1, x2, y2, px0, py0);
+        EdgeFunction e20(x2, y2, x0, y0, px0, py0);
+        EdgeFunction e01(x0, y0, x1, y1, px0, py0);
+
+        RasterRow row;
+        row.stepX[0] = e12.stepX;
+        row.stepX[1] = e20.stepX;
+        row.stepX[2] = e01.stepX;
+        row.zStepX = zStepX;
+
+        // Offsets of the samples from pixel centres; all zero single sampled
+        const EdgeFunction* edges[3] = {&e12, &e20, &e01};
+        const int64_t stepY[3] = {e12.stepY, e20.stepY, e01.stepY};
+        SampleOffsets samples;
+        samples.setup(samplePattern, sampleCount, SAMPLE_GRID, row.stepX, stepY, zStepX, zStepY);
+        row.samples = sampleCount > 1 ? &samples : nullptr;
+
+        // Rasterizes [sx0, sx1] x [sy0, sy1]
+        auto drawSpan = [&](int sx0, int sx1, int sy0, int sy1) {
+            int64_t dx = sx0 - px0, dy = sy0 - py0;
+            int64_t row12 = e12.start + dx * e12.stepX + dy * e12.stepY;
+            int64_t row20 = e20.start + dx * e20.stepX + dy * e20.stepY;
+            int64_t row01 = e01.start + dx * e01.stepX + dy * e01.stepY;
+            row.count = sx1 - sx0 + 1;
+            row.xOffset = sx0 - bx0;
+            for (int y = sy0; y <= sy1; y++) {
+                // Lesson 3: Z-buffer (depth testing), done inside the row kernel
+                row.w[0] = row12;
+                row.w[1] = row20;
+                row.w[2] = row01;
+                row.zRow = zBase + zStepY * (float)(y - by0);
+                drawRow(row, sx0, y);
+                row12 += e12.stepY;
+                row20 += e20.stepY;
+                row01 += e01.stepY;
+            }
+        };
+
+        if (!hiZ) {
+            drawSpan(px0, px1, py0, py1);
+            statTrianglesDrawn.fetch_add(1, std::memory_order_relaxed);
+            for (int by = py0 / HIZ_BLOCK; by <= py1 / HIZ_BLOCK; by++) {
+                for (int bx = px0 / HIZ_BLOCK; bx <= px1 / HIZ_BLOCK; bx++) {
+                    blockMinDepth[by * blocksX + bx] = std::numeric_limits<float>::lowest();
+                    blockStale[by * blocksX + bx] = 1;
+                }
+            }
+            return;
         }
+
+        // Coarse depth test per block: the nearest depth the kernels can
+        // produce inside a block is bounded by the plane at the block's
+        // corners, moved out to the farthest samples, and by the nearest
+        // vertex. The margin covers the float rounding of the kernels'
+        // incremental depth, so a block is only skipped when none of its
+        // samples could pass the depth test.
+        float zNearest = std::min({z0, z1, z2});
+        float margin = (std::abs(zBase) + std::abs(zStepX) * (bx1 - bx0 + 1) +
+                        std::abs(zStepY) * (by1 - by0 + 1)) * (1.0f / (1 << 20));
+
+        // How the samples of [sx0, sx1] x [sy0, sy1] are covered: 0 not at
+        // all, 1 partly, 2 completely. Edge functions are linear, so their
+        // extremes over the rectangle are at its corners.
+        auto coverage = [&](int sx0, int sx1, int sy0, int sy1) {
+            int result = 2;
+            for (int i = 0; i < 3; i++) {
+                const EdgeFunction* e = edges[i];
+                int64_t corner = e->start + (int64_t)(sx0 - px0) * e->stepX + (int64_t)(sy0 - py0) * e->stepY;
+                int64_t ax = e->stepX * (sx1 - sx0), ay = e->stepY * (sy1 - sy0);
+                if (corner + std::max<int64_t>(ax, 0) + std::max<int64_t>(ay, 0) + samples.wMax[i] < 0) return 0;
+                if (corner + std::min<int64_t>(ax, 0) + std::min<int64_t>(ay, 0) + samples.wMin[i] < 0) result = 1;
+            }
+            return result;
+        };
+        int blocksDrawn = 0, blocksCulled = 0;
+        for (int by = py0 / HIZ_BLOCK; by <= py1 / HIZ_BLOCK; by++) {
+            int sy0 = std::max(py0, by * HIZ_BLOCK), sy1 = std::min(py1, by * HIZ_BLOCK + HIZ_BLOCK - 1);
+            float zy = zBase + std::min(zStepY * (sy0 - by0), zStepY * (sy1 - by0));
+            float zyFar = zBase + std::max(zStepY * (sy0 - by0), zStepY * (sy1 - by0));
+            bool fullRows = sy0 == by * HIZ_BLOCK && sy1 == std::min(height, by * HIZ_BLOCK + HIZ_BLOCK) - 1;
+
+            // Runs of visible blocks along the band are drawn as one span
+            int runStart = -1;
+            int bxLast = px1 / HIZ_BLOCK;
+            for (int bx = px0 / HIZ_BLOCK; bx <= bxLast + 1; bx++) {
+                bool visible = false;
+                if (bx <= bxLast) {
+                    int block = by * blocksX + bx;
+                    int sx0 = std::max(px0, bx * HIZ_BLOCK), sx1 = std::min(px1, bx * HIZ_BLOCK + HIZ_BLOCK - 1);
+                    float zPlane = zy + std::min(zStepX * (sx0 - bx0), zStepX * (sx1 - bx0)) + samples.zMin;
+                    float zLow = std::max(zPlane, zNearest) - margin;
+                    int covered = coverage(sx0, sx1, sy0, sy1);
+                    visible = covered && !(zLow >= blockMaxDepth[block]);
+
+                    // Tightening a stale block can only help if the triangle
+                    // is not already in front of everything in it
+                    if (visible && blockStale[block] && zLow >= blockMinDepth[block]) {
+                        updateBlock(block);
+                        visible = !(zLow >= blockMaxDepth[block]);
+                    }
+                    if (visible) {
+                        // A block the triangle covers completely ends up no
+                        // farther than the triangle's farthest depth in it
+                        if (covered == 2 && fullRows && sx0 == bx * HIZ_BLOCK &&
+                            sx1 == std::min(width, sx0 + HIZ_BLOCK) - 1) {
+                            float zFar = zyFar + std::max(zStepX * (sx0 - bx0), zStepX * (sx1 - bx0)) + samples.zMax;
+                            zFar = std::min(zFar, std::max({z0, z1, z2})) + margin;
+                            blockMaxDepth[block] = std::min(blockMaxDepth[block], zFar);
+                        }
+                        blockMinDepth[block] = std::min(blockMinDepth[block], zLow);
+                        blockStale[block] = 1;
+                        blocksDrawn++;
+                    } else if (covered) {
+                        blocksCulled++;
+                    }
+                }
+                if (visible && runStart < 0) runStart = bx;
+                if (!visible && runStart >= 0) {
+                    drawSpan(std::max(px0, runStart * HIZ_BLOCK), std::min(px1, bx * HIZ_BLOCK - 1), sy0, sy1);
+                    runStart = -1;
+                }
+            }
+        }
+
+        bool culled = blocksCulled && !blocksDrawn;
+        (culled ? statTrianglesCulled : statTrianglesDrawn).fetch_add(1, std::memory_order_relaxed);
+        if (blocksDrawn) statBlocksDrawn.fetch_add(blocksDrawn, std::memory_order_relaxed);
+        if (blocksCulled) statBlocksCulled.fetch_add(blocksCulled, std::memory_order_relaxed);
     }
 
-    // Save as PPM file
-    void saveToPPM(const std::string& filename) const {
+public:
+    // Packs rows [y0, y1) as 8-bit RGB, top row first as PPM stores them
+    void packRGBRows(int y0, int y1, unsigned char* out) const { packRGBRows(colorBuffer.data(), width, y0, y1, out); }
+
+    static void packRGBRows(const Color* pixels, int width, int y0, int y1, unsigned char* out) {
+        for (int y = y1 - 1; y >= y0; y--) {
+            const Color* row = &pixels[(size_t)y * width];
+            for (int x = 0; x < width; x++) {
+                *out++ = row[x].r;
+                *out++ = row[x].g;
+                *out++ = row[x].b;
+            }
+        }
+    }
+
+    static std::string ppmHeader(int w, int h) {
+        return "P6\n" + std::to_string(w) + " " + std::to_string(h) + "\n255\n";
+    }
+
+    // Save as PPM file: binary P6 assembled in one buffer and written with a
+    // single call, or the ASCII P3 variant for older tools. False, with an
+    // error printed, if the file could not be written.
+    bool saveToPPM(const std::string& filename, bool binary = true) const {
+        if (!binary) return saveToPPMAscii(filename);
+        std::vector<unsigned char> bytes;
+        encodePPM(colorBuffer.data(), width, height, bytes);
+        std::ofstream file(filename, std::ios::binary);
+        file.write((const char*)bytes.data(), bytes.size());
+        file.close();
+        if (!file) {
+            std::cerr << "Error: Cannot write " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // A whole binary PPM of w x h pixels, bottom row first, in bytes
+    static void encodePPM(const Color* pixels, int w, int h, std::vector<unsigned char>& bytes) {
+        std::string header = ppmHeader(w, h);
+        bytes.resize(header.size() + (size_t)w * h * 3);
+        std::copy(header.begin(), header.end(), bytes.begin());
+        packRGBRows(pixels, w, 0, h, &bytes[header.size()]);
+    }
+
+    bool saveToPPMAscii(const std::string& filename) const {
         std::ofstream file(filename);
         file << "P3\n" << width << " " << height << "\n255\n";
         for (int y = height - 1; y >= 0; y--) {
@@ -125,6 +608,12 @@ public:
             }
             file << "\n";
         }
+        file.close();
+        if (!file) {
+            std::cerr << "Error: Cannot write " << filename << std::endl;
+            return false;
+        }
+        return true;
     }
 };
 
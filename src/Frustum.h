@@ -0,0 +1,58 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include "Vec3.h"
+#include "Matrix4x4.h"
+
+// Plane n.p + d = 0 with a unit normal pointing into the kept half-space
+struct Plane {
+    Vec3 normal;
+    float d;
+
+    float distance(const Vec3& p) const { return normal.dot(p) + d; }
+};
+
+// The six planes bounding the clip volume of a matrix, in the space the
+// matrix maps from: with projection * view * model they are in object space.
+class Frustum {
+public:
+    Plane planes[6]; // left, right, bottom, top, near, far
+
+    explicit Frustum(const Matrix4x4& m) {
+        // -w <= x, y, z <= w on each row of the clip transform
+        for (int i = 0; i < 3; i++) {
+            for (int side = 0; side < 2; side++) {
+                float sign = side == 0 ? 1.0f : -1.0f;
+                Plane& plane = planes[i * 2 + side];
+                plane.normal = Vec3(m.m[3][0] + sign * m.m[i][0], m.m[3][1] + sign * m.m[i][1],
+                                    m.m[3][2] + sign * m.m[i][2]);
+                plane.d = m.m[3][3] + sign * m.m[i][3];
+                float length = plane.normal.length();
+                if (length > 0) {
+                    plane.normal = plane.normal * (1.0f / length);
+                    plane.d /= length;
+                }
+            }
+        }
+    }
+
+    bool intersectsSphere(const Vec3& center, float radius) const {
+        for (const Plane& plane : planes) {
+            if (plane.distance(center) < -radius) return false;
+        }
+        return true;
+    }
+
+    // Conservative: a box near a frustum corner may pass without touching it
+    bool intersectsBox(const Vec3& lo, const Vec3& hi) const {
+        for (const Plane& plane : planes) {
+            // Corner farthest along the plane normal
+            Vec3 p(plane.normal.x >= 0 ? hi.x : lo.x, plane.normal.y >= 0 ? hi.y : lo.y,
+                   plane.normal.z >= 0 ? hi.z : lo.z);
+            if (plane.distance(p) < 0) return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include "Vec3.h"
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+// Surface attributes of every visible pixel, for deferred shading. Depth
+// stays in the framebuffer, where world positions are recovered from;
+// the normal is octahedral-encoded into two 16-bit values and the
+// material is an index into Shader::materials, 6 bytes a pixel in all.
+class GBuffer {
+private:
+    int width, height;
+    std::vector<uint32_t> normals;
+    std::vector<uint16_t> materials;
+
+public:
+    GBuffer() : width(0), height(0) {}
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        normals.resize((size_t)w * h);
+        materials.resize((size_t)w * h);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    void set(int x, int y, const Vec3& normal, uint16_t material) {
+        normals[y * width + x] = encodeNormal(normal);
+        materials[y * width + x] = material;
+    }
+
+    Vec3 getNormal(int x, int y) const { return decodeNormal(normals[y * width + x]); }
+    uint16_t getMaterial(int x, int y) const { return materials[y * width + x]; }
+
+    // Unit vector to the octahedron |x| + |y| + |z| = 1, its lower half
+    // folded over the upper, as two snorm16 values
+    static uint32_t encodeNormal(const Vec3& n) {
+        float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+        if (!(l1 > 0)) return 0;
+        float x = n.x / l1, y = n.y / l1;
+        if (n.z < 0) {
+            float fx = (1.0f - std::fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+            float fy = (1.0f - std::fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+            x = fx;
+            y = fy;
+        }
+        return snorm16(x) | (snorm16(y) << 16);
+    }
+
+    static Vec3 decodeNormal(uint32_t bits) {
+        float x = (int16_t)(bits & 0xffff) * (1.0f / 32767.0f);
+        float y = (int16_t)(bits >> 16) * (1.0f / 32767.0f);
+        float z = 1.0f - std::fabs(x) - std::fabs(y);
+        if (z < 0) {
+            float fx = (1.0f - std::fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+            float fy = (1.0f - std::fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+            x = fx;
+            y = fy;
+        }
+        return Vec3(x, y, z).normalize();
+    }
+
+    // The deferred raster pass draws each face's index in place of its
+    // colour, so the depth-tested kernels leave the index of the visible
+    // face in every pixel
+    static Color faceColor(uint32_t face) {
+        static_assert(sizeof(Color) == sizeof(uint32_t), "face indices are stored as colours");
+        unsigned char bytes[4];
+        std::memcpy(bytes, &face, sizeof(face));
+        return Color(bytes[0], bytes[1], bytes[2], bytes[3]);
+    }
+
+    static uint32_t colorFace(const Color& color) {
+        uint32_t face;
+        std::memcpy(&face, &color, sizeof(face));
+        return face;
+    }
+
+private:
+    static uint32_t snorm16(float v) {
+        float clamped = std::max(-1.0f, std::min(1.0f, v));
+        return (uint16_t)(int16_t)std::lround(clamped * 32767.0f);
+    }
+};
+
+#endif
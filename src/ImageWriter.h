@@ -0,0 +1,145 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include "Framebuffer.h"
+#include "ThreadPool.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Writes a binary PPM while the image is still being rendered. The file is
+// sized up front, so bands of rows can be written with pwrite in any order
+// and from any thread as soon as they are final.
+class PPMStreamWriter {
+private:
+    int fd;
+    int width, height;
+    size_t headerSize;
+
+    PPMStreamWriter(const PPMStreamWriter&);
+    PPMStreamWriter& operator=(const PPMStreamWriter&);
+
+    bool writeAt(const unsigned char* data, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written <= 0) return false;
+            data += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+public:
+    PPMStreamWriter() : fd(-1), width(0), height(0), headerSize(0) {}
+    ~PPMStreamWriter() { close(); }
+
+    bool open(const std::string& filename, int w, int h) {
+        close();
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        width = w;
+        height = h;
+
+        std::string header = Framebuffer::ppmHeader(w, h);
+        headerSize = header.size();
+        if (ftruncate(fd, (off_t)(headerSize + (size_t)w * h * 3)) != 0 ||
+            !writeAt((const unsigned char*)header.data(), header.size(), 0)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Writes framebuffer rows [y0, y1); PPM stores rows top down, so the
+    // band is one contiguous range of the file
+    bool writeRows(const Framebuffer& framebuffer, int y0, int y1) {
+        if (fd < 0 || y0 >= y1) return fd >= 0;
+        std::vector<unsigned char> bytes((size_t)(y1 - y0) * width * 3);
+        framebuffer.packRGBRows(y0, y1, bytes.data());
+        off_t offset = (off_t)(headerSize + (size_t)(height - y1) * width * 3);
+        return writeAt(bytes.data(), bytes.size(), offset);
+    }
+
+    bool close() {
+        if (fd < 0) return true;
+        bool ok = ::close(fd) == 0;
+        fd = -1;
+        return ok;
+    }
+};
+
+// Encodes and writes whole frames as binary PPMs as jobs on a ThreadPool,
+// so frames are written while the next ones render. Up to depth frames are
+// in flight: submit takes the framebuffer's colours by swapping in the
+// buffer of the frame depth submits back, once that one is written. Each
+// write depends on the one before, so files appear in order.
+class PPMFrameEncoder {
+private:
+    struct Slot {
+        std::vector<Color> pixels;
+        std::vector<unsigned char> bytes;
+        JobHandle job;
+    };
+
+    ThreadPool& pool;
+    std::vector<Slot> slots;
+    size_t submitted;
+    JobHandle last;
+    std::atomic<bool> ok;
+    double waitSeconds;
+
+    PPMFrameEncoder(const PPMFrameEncoder&);
+    PPMFrameEncoder& operator=(const PPMFrameEncoder&);
+
+    void waitFor(const JobHandle& job) {
+        auto start = std::chrono::steady_clock::now();
+        pool.wait(job);
+        waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+public:
+    explicit PPMFrameEncoder(ThreadPool& pool_, int depth = 2)
+        : pool(pool_), slots(std::max(1, depth)), submitted(0), ok(true), waitSeconds(0) {}
+
+    ~PPMFrameEncoder() { waitFor(last); }
+
+    // Queues the framebuffer's image to be written to name. The framebuffer
+    // needs a clear() before it is drawn into again.
+    void submit(Framebuffer& framebuffer, const std::string& name) {
+        Slot& slot = slots[submitted++ % slots.size()];
+        waitFor(slot.job);
+        framebuffer.swapColorBuffer(slot.pixels);
+        int width = framebuffer.getWidth(), height = framebuffer.getHeight();
+        Slot* target = &slot;
+        slot.job = pool.submit([this, target, width, height, name] {
+            Framebuffer::encodePPM(target->pixels.data(), width, height, target->bytes);
+            std::ofstream file(name, std::ios::binary);
+            bool written = file.write((const char*)target->bytes.data(), target->bytes.size()).good();
+            if (!written) {
+                std::cerr << "Error: Cannot write " << name << std::endl;
+                ok.store(false);
+            }
+        }, {last});
+        last = slot.job;
+    }
+
+    // Waits for every frame; false if any could not be written
+    bool finish() {
+        waitFor(last);
+        return ok.load();
+    }
+
+    // Time submit and finish spent waiting for the encoder to catch up
+    double getWaitSeconds() const { return waitSeconds; }
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of a whole file. Uses mmap where possible and falls back
+// to reading the file into memory.
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+    void* mapping;
+    std::vector<char> buffer;
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+public:
+    MappedFile() : bytes(nullptr), length(0), mapping(nullptr) {}
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& filename) {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = (size_t)info.st_size;
+        if (length == 0) {
+            ::close(fd);
+            bytes = "";
+            return true;
+        }
+
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, length, MADV_SEQUENTIAL);
+            mapping = mapped;
+            bytes = (const char*)mapped;
+            return true;
+        }
+
+        std::ifstream file(filename, std::ios::binary);
+        buffer.resize(length);
+        if (!file.read(buffer.data(), length)) {
+            close();
+            return false;
+        }
+        bytes = buffer.data();
+        return true;
+    }
+
+    void close() {
+        if (mapping) munmap(mapping, length);
+        mapping = nullptr;
+        bytes = nullptr;
+        length = 0;
+        std::vector<char>().swap(buffer);
+    }
+
+    const char* data() const { return bytes; }
+    const char* end() const { return bytes + length; }
+    size_t size() const { return length; }
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef MATERIALLIBRARY_H
+#define MATERIALLIBRARY_H
+
+#include "Shader.h"
+#include "Texture.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+// Materials by name from .mtl files: Kd, Ka, Ks, Ns, Tf, Ni and illum,
+// plus map_Kd and map_Bump/bump/norm through a TextureCache. Other
+// statements are skipped.
+class MaterialLibrary {
+private:
+    std::map<std::string, Material> materials;
+    std::vector<std::string> files;
+
+    static Color readColor(std::istringstream& in, const Color& fallback) {
+        float rgb[3];
+        if (!(in >> rgb[0])) return fallback;
+        // A single value is grey
+        if (!(in >> rgb[1] >> rgb[2])) rgb[1] = rgb[2] = rgb[0];
+        unsigned char c[3];
+        for (int i = 0; i < 3; i++) c[i] = (unsigned char)(std::max(0.0f, std::min(1.0f, rgb[i])) * 255.0f + 0.5f);
+        return Color(c[0], c[1], c[2]);
+    }
+
+    // Last word of a map statement; options such as -bm come before it
+    static std::string mapFile(std::istringstream& in) {
+        std::string word, last;
+        while (in >> word) last = word;
+        return last;
+    }
+
+public:
+    // Material::ambient is added to every fragment as is, so Ka is scaled
+    // by the ambient light it would reflect
+    float ambientLight;
+
+    MaterialLibrary() : ambientLight(0.25f) {}
+
+    // Adds the materials of an .mtl file. Each starts as base, so fields
+    // the file leaves out keep its values; the first definition of a name
+    // wins. Maps are loaded through textures, relative to the file.
+    bool load(const std::string& filename, const Material& base, TextureCache* textures = nullptr) {
+        if (std::find(files.begin(), files.end(), filename) != files.end()) return true;
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Error: Cannot open material library " << filename << std::endl;
+            return false;
+        }
+        files.push_back(filename);
+        size_t slash = filename.find_last_of('/');
+        std::string directory = slash == std::string::npos ? std::string() : filename.substr(0, slash + 1);
+
+        Material material;
+        std::string name, line;
+        bool open = false;
+        auto finish = [&]() {
+            if (open) materials.insert(std::make_pair(name, material));
+        };
+        while (std::getline(file, line)) {
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword) || keyword[0] == '#') continue;
+            if (keyword == "newmtl") {
+                finish();
+                std::getline(in >> std::ws, name);
+                while (!name.empty() && (name.back() == '\r' || name.back() == ' ')) name.pop_back();
+                material = base;
+                open = true;
+            } else if (!open) {
+                continue;
+            } else if (keyword == "Kd") {
+                material.diffuse = readColor(in, material.diffuse);
+            } else if (keyword == "Ka") {
+                Color ka = readColor(in, Color(0, 0, 0));
+                material.ambient = Color((unsigned char)(ka.r * ambientLight + 0.5f), (unsigned char)(ka.g * ambientLight + 0.5f),
+                                         (unsigned char)(ka.b * ambientLight + 0.5f));
+            } else if (keyword == "Ks") {
+                material.specular = readColor(in, material.specular);
+            } else if (keyword == "Tf") {
+                material.transmission = readColor(in, material.transmission);
+            } else if (keyword == "Ns") {
+                // An exponent under 1 would light the whole hemisphere
+                float ns;
+                if (in >> ns) material.shininess = std::max(1.0f, ns);
+            } else if (keyword == "Ni") {
+                in >> material.refractiveIndex;
+            } else if (keyword == "illum") {
+                in >> material.illumination;
+            } else if (textures && keyword == "map_Kd") {
+                std::string map = mapFile(in);
+                if (!map.empty()) material.diffuseMap = textures->load(directory + map);
+            } else if (textures && (keyword == "map_Bump" || keyword == "map_bump" || keyword == "bump" ||
+                                    keyword == "norm")) {
+                std::string map = mapFile(in);
+                if (!map.empty()) material.normalMap = textures->load(directory + map);
+            }
+        }
+        finish();
+        return true;
+    }
+
+    // Null if no file loaded so far defines name
+    const Material* find(const std::string& name) const {
+        auto it = materials.find(name);
+        return it == materials.end() ? nullptr : &it->second;
+    }
+
+    size_t size() const { return materials.size(); }
+    size_t fileCount() const { return files.size(); }
+};
+
+#endif
@@ -30,15 +30,60 @@ public:
     }
 
     Vec3 transform(const Vec3& v, float w = 1.0f) const {
-        float x = m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3] * w;
-        float y = m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3] * w;
-        float z = m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3] * w;
-        float wResult = m[3][0] * v.x + m[3][1] * v.y + m[3][2] * v.z + m[3][3] * w;
+        return transform4(v, w).project();
+    }
 
-        if (wResult != 0.0f && wResult != 1.0f) {
-            return Vec3(x / wResult, y / wResult, z / wResult);
-        }
-        return Vec3(x, y, z);
+    // Homogeneous transform without the divide by w
+    Vec4 transform4(const Vec3& v, float w = 1.0f) const {
+        return Vec4(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3] * w,
+                    m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3] * w,
+                    m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3] * w,
+                    m[3][0] * v.x + m[3][1] * v.y + m[3][2] * v.z + m[3][3] * w);
+    }
+
+    // General inverse by cofactors, in double precision; a singular matrix
+    // gives the identity
+    Matrix4x4 inverse() const {
+        double a[16], inv[16];
+        for (int i = 0; i < 16; i++) a[i] = m[i / 4][i % 4];
+        inv[0] = a[5] * a[10] * a[15] - a[5] * a[11] * a[14] - a[9] * a[6] * a[15] + a[9] * a[7] * a[14] +
+                 a[13] * a[6] * a[11] - a[13] * a[7] * a[10];
+        inv[4] = -a[4] * a[10] * a[15] + a[4] * a[11] * a[14] + a[8] * a[6] * a[15] - a[8] * a[7] * a[14] -
+                 a[12] * a[6] * a[11] + a[12] * a[7] * a[10];
+        inv[8] = a[4] * a[9] * a[15] - a[4] * a[11] * a[13] - a[8] * a[5] * a[15] + a[8] * a[7] * a[13] +
+                 a[12] * a[5] * a[11] - a[12] * a[7] * a[9];
+        inv[12] = -a[4] * a[9] * a[14] + a[4] * a[10] * a[13] + a[8] * a[5] * a[14] - a[8] * a[6] * a[13] -
+                  a[12] * a[5] * a[10] + a[12] * a[6] * a[9];
+        inv[1] = -a[1] * a[10] * a[15] + a[1] * a[11] * a[14] + a[9] * a[2] * a[15] - a[9] * a[3] * a[14] -
+                 a[13] * a[2] * a[11] + a[13] * a[3] * a[10];
+        inv[5] = a[0] * a[10] * a[15] - a[0] * a[11] * a[14] - a[8] * a[2] * a[15] + a[8] * a[3] * a[14] +
+                 a[12] * a[2] * a[11] - a[12] * a[3] * a[10];
+        inv[9] = -a[0] * a[9] * a[15] + a[0] * a[11] * a[13] + a[8] * a[1] * a[15] - a[8] * a[3] * a[13] -
+                 a[12] * a[1] * a[11] + a[12] * a[3] * a[9];
+        inv[13] = a[0] * a[9] * a[14] - a[0] * a[10] * a[13] - a[8] * a[1] * a[14] + a[8] * a[2] * a[13] +
+                  a[12] * a[1] * a[10] - a[12] * a[2] * a[9];
+        inv[2] = a[1] * a[6] * a[15] - a[1] * a[7] * a[14] - a[5] * a[2] * a[15] + a[5] * a[3] * a[14] +
+                 a[13] * a[2] * a[7] - a[13] * a[3] * a[6];
+        inv[6] = -a[0] * a[6] * a[15] + a[0] * a[7] * a[14] + a[4] * a[2] * a[15] - a[4] * a[3] * a[14] -
+                 a[12] * a[2] * a[7] + a[12] * a[3] * a[6];
+        inv[10] = a[0] * a[5] * a[15] - a[0] * a[7] * a[13] - a[4] * a[1] * a[15] + a[4] * a[3] * a[13] +
+                  a[12] * a[1] * a[7] - a[12] * a[3] * a[5];
+        inv[14] = -a[0] * a[5] * a[14] + a[0] * a[6] * a[13] + a[4] * a[1] * a[14] - a[4] * a[2] * a[13] -
+                  a[12] * a[1] * a[6] + a[12] * a[2] * a[5];
+        inv[3] = -a[1] * a[6] * a[11] + a[1] * a[7] * a[10] + a[5] * a[2] * a[11] - a[5] * a[3] * a[10] -
+                 a[9] * a[2] * a[7] + a[9] * a[3] * a[6];
+        inv[7] = a[0] * a[6] * a[11] - a[0] * a[7] * a[10] - a[4] * a[2] * a[11] + a[4] * a[3] * a[10] +
+                 a[8] * a[2] * a[7] - a[8] * a[3] * a[6];
+        inv[11] = -a[0] * a[5] * a[11] + a[0] * a[7] * a[9] + a[4] * a[1] * a[11] - a[4] * a[3] * a[9] -
+                  a[8] * a[1] * a[7] + a[8] * a[3] * a[5];
+        inv[15] = a[0] * a[5] * a[10] - a[0] * a[6] * a[9] - a[4] * a[1] * a[10] + a[4] * a[2] * a[9] +
+                  a[8] * a[1] * a[6] - a[8] * a[2] * a[5];
+
+        Matrix4x4 result;
+        double det = a[0] * inv[0] + a[1] * inv[4] + a[2] * inv[8] + a[3] * inv[12];
+        if (det == 0) return result;
+        for (int i = 0; i < 16; i++) result.m[i / 4][i % 4] = (float)(inv[i] / det);
+        return result;
     }
 
     static Matrix4x4 translation(float x, float y, float z) {
@@ -102,9 +147,26 @@ public:
         return result;
     }
 
+    static Matrix4x4 orthographic(float left, float right, float bottom, float top, float near, float far) {
+        Matrix4x4 result;
+        result.m[0][0] = 2.0f / (right - left);
+        result.m[1][1] = 2.0f / (top - bottom);
+        result.m[2][2] = -2.0f / (far - near);
+        result.m[0][3] = -(right + left) / (right - left);
+        result.m[1][3] = -(top + bottom) / (top - bottom);
+        result.m[2][3] = -(far + near) / (far - near);
+        return result;
+    }
+
     static Matrix4x4 lookAt(const Vec3& eye, const Vec3& target, const Vec3& up) {
         Vec3 forward = (target - eye).normalize();
-        Vec3 right = forward.cross(up).normalize();
+        Vec3 right = forward.cross(up);
+        // Looking along up (straight down, say) leaves no right vector:
+        // take the screen's up from another axis
+        if (!(right.length() > 1e-6f * up.length())) {
+            right = forward.cross(std::fabs(forward.x) < 0.9f ? Vec3(1, 0, 0) : Vec3(0, 0, 1));
+        }
+        right = right.normalize();
         Vec3 newUp = right.cross(forward);
 
         Matrix4x4 result;
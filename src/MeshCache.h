@@ -0,0 +1,381 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include "Model.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Bump whenever the OBJ loader or the post-processing stored in the cache
+// changes what a model looks like; every existing .rmesh is then rebuilt.
+const uint32_t OBJ_LOADER_VERSION = 5;
+
+// Binary mesh cache (.rmesh) kept next to each source OBJ as <source>.rmesh.
+//
+// Layout: an RMeshHeader, a table of RMeshSection entries, then the raw
+// section arrays, each 16-byte aligned and in native byte order. A cache is
+// only used if its format and loader versions match and its hash equals the
+// hash of the current source bytes; otherwise the source is re-parsed and
+// the cache rewritten. Unknown section types are skipped so sections can be
+// added without breaking older readers.
+class MeshCache {
+public:
+    enum SectionType {
+        SECTION_POSITIONS = 1, // float: the welded vertices' x, y and z streams, one after another
+        SECTION_TEXCOORDS = 2, // float: u and v streams
+        SECTION_NORMALS = 3,   // float: x, y and z streams, including generated normals
+        SECTION_INDICES = 4,   // uint32: three vertex indices per face
+        SECTION_PARTS = 5,     // RMeshPart
+        SECTION_NAMES = 6,     // part and material names the parts point into
+        SECTION_FACE_MATERIALS = 7, // uint16 material id per face
+        SECTION_MATERIALS = 8,      // RMeshName: usemtl names, by material id
+        SECTION_LIBRARIES = 9       // RMeshName: mtllib paths, relative to the source's directory
+    };
+
+    // A ModelPart without its bounds, which are recomputed on load
+    struct RMeshPart {
+        int32_t firstFace;
+        int32_t faceCount;
+        uint32_t nameOffset, nameLength;
+        uint32_t materialOffset, materialLength;
+    };
+
+    // A string in the names section
+    struct RMeshName {
+        uint32_t offset, length;
+    };
+
+    struct RMeshSection {
+        uint32_t type;
+        uint32_t elementSize;
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct RMeshHeader {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t loaderVersion;
+        uint64_t sourceHash;
+        uint64_t sourceSize;
+        uint32_t sectionCount;
+        uint32_t reserved;
+    };
+
+    static const uint32_t FORMAT_VERSION = 3;
+    static const uint32_t SECTION_COUNT = 9;
+
+    static_assert(sizeof(float) == 4 && sizeof(RMeshPart) == 24 && sizeof(RMeshName) == 8,
+                  "rmesh stores these types as raw arrays");
+
+    static std::string cachePath(const std::string& source) { return source + ".rmesh"; }
+
+    // 64-bit hash of the source bytes, mixed with the loader version
+    static uint64_t hashBytes(const char* data, size_t size) {
+        const uint64_t prime = 0x100000001b3ULL;
+        uint64_t hash = 0xcbf29ce484222325ULL ^ ((uint64_t)OBJ_LOADER_VERSION << 32) ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * prime;
+            hash ^= hash >> 29;
+        }
+        for (; i < size; i++) hash = (hash ^ (unsigned char)data[i]) * prime;
+        hash ^= hash >> 32;
+        hash *= 0xd6e8feb86659fd93ULL;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    // Loads a cache into model if it matches the given source hash
+    static bool load(const std::string& path, uint64_t sourceHash, uint64_t sourceSize, Model& model) {
+        MappedFile file;
+        if (!file.open(path) || file.size() < sizeof(RMeshHeader)) return false;
+
+        RMeshHeader header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, magic(), 8) != 0 || header.formatVersion != FORMAT_VERSION ||
+            header.loaderVersion != OBJ_LOADER_VERSION || header.sourceHash != sourceHash ||
+            header.sourceSize != sourceSize) {
+            return false;
+        }
+
+        size_t tableEnd = sizeof(RMeshHeader) + (size_t)header.sectionCount * sizeof(RMeshSection);
+        if (tableEnd > file.size()) return false;
+
+        model.clear();
+        std::vector<RMeshPart> parts;
+        std::vector<RMeshName> materials, libraries;
+        std::vector<char> names;
+        VertexStreams& v = model.vertices;
+        FloatStream* positions[3] = {&v.x, &v.y, &v.z};
+        FloatStream* normals[3] = {&v.normalX, &v.normalY, &v.normalZ};
+        FloatStream* texCoords[2] = {&v.u, &v.v};
+        int found = 0;
+        for (uint32_t s = 0; s < header.sectionCount; s++) {
+            RMeshSection section;
+            std::memcpy(&section, file.data() + sizeof(RMeshHeader) + s * sizeof(RMeshSection), sizeof(section));
+            if (section.offset > file.size() ||
+                section.count > (file.size() - section.offset) / std::max<uint32_t>(section.elementSize, 1)) {
+                return false;
+            }
+            const char* data = file.data() + section.offset;
+            bool ok = true;
+            switch (section.type) {
+                case SECTION_POSITIONS: ok = readStreams(section, data, positions, 3); break;
+                case SECTION_TEXCOORDS: ok = readStreams(section, data, texCoords, 2); break;
+                case SECTION_NORMALS: ok = readStreams(section, data, normals, 3); break;
+                case SECTION_INDICES: ok = readArray(section, data, model.indices); break;
+                case SECTION_PARTS: ok = readArray(section, data, parts); break;
+                case SECTION_NAMES: ok = readArray(section, data, names); break;
+                case SECTION_FACE_MATERIALS: ok = readArray(section, data, model.faceMaterials); break;
+                case SECTION_MATERIALS: ok = readArray(section, data, materials); break;
+                case SECTION_LIBRARIES: ok = readArray(section, data, libraries); break;
+                default: continue;
+            }
+            if (!ok) return false;
+            found++;
+        }
+        size_t vertexCount = v.x.size();
+        if (found != (int)SECTION_COUNT || v.u.size() != vertexCount || v.normalX.size() != vertexCount ||
+            model.indices.size() % 3 != 0 || model.faceMaterials.size() != model.getTriangleCount()) {
+            return false;
+        }
+        for (uint32_t index : model.indices) {
+            if (index >= vertexCount) return false;
+        }
+        for (const RMeshName& n : materials) {
+            if ((size_t)n.offset + n.length > names.size()) return false;
+            model.materialNames.push_back(std::string(names.data() + n.offset, n.length));
+        }
+        for (uint16_t id : model.faceMaterials) {
+            if (id != NO_MATERIAL && id >= model.materialNames.size()) return false;
+        }
+        std::string directory = Model::directoryOf(path);
+        for (const RMeshName& n : libraries) {
+            if ((size_t)n.offset + n.length > names.size()) return false;
+            model.materialLibraries.push_back(directory + std::string(names.data() + n.offset, n.length));
+        }
+
+        for (const RMeshPart& p : parts) {
+            if (p.firstFace < 0 || p.faceCount < 0 || (size_t)p.firstFace + p.faceCount > model.getTriangleCount() ||
+                (size_t)p.nameOffset + p.nameLength > names.size() ||
+                (size_t)p.materialOffset + p.materialLength > names.size()) {
+                return false;
+            }
+            ModelPart part;
+            part.name.assign(names.data() + p.nameOffset, p.nameLength);
+            part.material.assign(names.data() + p.materialOffset, p.materialLength);
+            part.firstFace = p.firstFace;
+            part.faceCount = p.faceCount;
+            model.parts.push_back(part);
+        }
+        model.updatePartVertices();
+        model.updatePartBounds();
+        return true;
+    }
+
+    // Writes the model's state to path; the file is replaced atomically
+    static bool save(const std::string& path, uint64_t sourceHash, uint64_t sourceSize, const Model& model) {
+        std::vector<RMeshPart> parts;
+        std::vector<char> names;
+        for (const ModelPart& part : model.parts) {
+            RMeshPart p;
+            p.firstFace = part.firstFace;
+            p.faceCount = part.faceCount;
+            p.nameOffset = (uint32_t)names.size();
+            p.nameLength = (uint32_t)part.name.size();
+            names.insert(names.end(), part.name.begin(), part.name.end());
+            p.materialOffset = (uint32_t)names.size();
+            p.materialLength = (uint32_t)part.material.size();
+            names.insert(names.end(), part.material.begin(), part.material.end());
+            parts.push_back(p);
+        }
+        auto addName = [&](const std::string& name) {
+            RMeshName n = {(uint32_t)names.size(), (uint32_t)name.size()};
+            names.insert(names.end(), name.begin(), name.end());
+            return n;
+        };
+        std::vector<RMeshName> materials, libraries;
+        for (const std::string& name : model.materialNames) materials.push_back(addName(name));
+        std::string directory = Model::directoryOf(path);
+        for (const std::string& library : model.materialLibraries) {
+            bool local = !directory.empty() && library.compare(0, directory.size(), directory) == 0;
+            libraries.push_back(addName(local ? library.substr(directory.size()) : library));
+        }
+
+        const VertexStreams& v = model.vertices;
+        const FloatStream* positions[3] = {&v.x, &v.y, &v.z};
+        const FloatStream* normals[3] = {&v.normalX, &v.normalY, &v.normalZ};
+        const FloatStream* texCoords[2] = {&v.u, &v.v};
+
+        RMeshSection sections[SECTION_COUNT] = {
+            streamSection(SECTION_POSITIONS, positions, 3),
+            streamSection(SECTION_TEXCOORDS, texCoords, 2),
+            streamSection(SECTION_NORMALS, normals, 3),
+            section(SECTION_INDICES, model.indices),
+            section(SECTION_PARTS, parts),
+            section(SECTION_NAMES, names),
+            section(SECTION_FACE_MATERIALS, model.faceMaterials),
+            section(SECTION_MATERIALS, materials),
+            section(SECTION_LIBRARIES, libraries)
+        };
+        uint64_t offset = align(sizeof(RMeshHeader) + sizeof(sections));
+        for (RMeshSection& s : sections) {
+            s.offset = offset;
+            offset = align(offset + s.count * s.elementSize);
+        }
+
+        RMeshHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, magic(), 8);
+        header.formatVersion = FORMAT_VERSION;
+        header.loaderVersion = OBJ_LOADER_VERSION;
+        header.sourceHash = sourceHash;
+        header.sourceSize = sourceSize;
+        header.sectionCount = SECTION_COUNT;
+
+        std::vector<char> bytes(offset, 0);
+        std::memcpy(&bytes[0], &header, sizeof(header));
+        std::memcpy(&bytes[sizeof(header)], sections, sizeof(sections));
+        copyStreams(sections[0], positions, 3, bytes);
+        copyStreams(sections[1], texCoords, 2, bytes);
+        copyStreams(sections[2], normals, 3, bytes);
+        copyArray(sections[3], model.indices, bytes);
+        copyArray(sections[4], parts, bytes);
+        copyArray(sections[5], names, bytes);
+        copyArray(sections[6], model.faceMaterials, bytes);
+        copyArray(sections[7], materials, bytes);
+        copyArray(sections[8], libraries, bytes);
+
+        std::string temp = path + ".tmp";
+        FILE* out = std::fopen(temp.c_str(), "wb");
+        if (!out) return false;
+        bool ok = std::fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+        ok = std::fclose(out) == 0 && ok;
+        if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+            std::remove(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Loads OBJ files into one model, using each file's .rmesh when it is
+    // current and re-parsing (and re-caching) the ones that are not.
+    // Generated normals are computed per file before caching.
+    static bool loadOBJFiles(const std::vector<std::string>& filenames, Model& model, ThreadPool* pool = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        int count = (int)filenames.size();
+        std::vector<Model> parts(count);
+        std::vector<char> ok(count, 0), cached(count, 0);
+
+        auto loadOne = [&](int i, ThreadPool* chunkPool) {
+            MappedFile source;
+            if (!source.open(filenames[i])) {
+                std::cerr << "Error: Cannot open file " << filenames[i] << std::endl;
+                return;
+            }
+            uint64_t hash = hashBytes(source.data(), source.size());
+            std::string path = cachePath(filenames[i]);
+            if (load(path, hash, source.size(), parts[i])) {
+                ok[i] = cached[i] = 1;
+                return;
+            }
+            if (!parts[i].loadOBJFiles(std::vector<std::string>(1, filenames[i]), chunkPool, false)) return;
+            parts[i].generateNormals();
+            if (!save(path, hash, source.size(), parts[i])) {
+                std::cerr << "Warning: Cannot write mesh cache " << path << std::endl;
+            }
+            ok[i] = 1;
+        };
+
+        // Files are loaded side by side and each splits its parse into chunks
+        // on the same pool, so threads done with small files steal chunks of
+        // the large ones
+        if (pool) {
+            pool->parallelFor(count, [&](int i) { loadOne(i, pool); });
+        } else {
+            for (int i = 0; i < count; i++) loadOne(i, nullptr);
+        }
+
+        model.clear();
+        int hits = 0;
+        for (int i = 0; i < count; i++) {
+            if (!ok[i]) {
+                model.clear();
+                return false;
+            }
+            hits += cached[i];
+            model.append(parts[i]);
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Loaded model: " << model.vertices.size() << " vertices, " << model.getTriangleCount()
+                  << " faces from " << count << (count == 1 ? " file" : " files") << " ("
+                  << hits << " from .rmesh cache, " << seconds * 1000.0 << " ms)" << std::endl;
+        return true;
+    }
+
+private:
+    static const char* magic() { return "RMESH\r\n\x1a"; }
+
+    static uint64_t align(uint64_t offset) { return (offset + 15) & ~(uint64_t)15; }
+
+    template <typename T>
+    static RMeshSection section(uint32_t type, const std::vector<T>& array) {
+        RMeshSection s;
+        s.type = type;
+        s.elementSize = sizeof(T);
+        s.offset = 0;
+        s.count = array.size();
+        return s;
+    }
+
+    // A section of count equally long float streams stored back to back
+    static RMeshSection streamSection(uint32_t type, const FloatStream* const* streams, int count) {
+        RMeshSection s;
+        s.type = type;
+        s.elementSize = sizeof(float);
+        s.offset = 0;
+        s.count = streams[0]->size() * count;
+        return s;
+    }
+
+    static void copyStreams(const RMeshSection& s, const FloatStream* const* streams, int count,
+                            std::vector<char>& bytes) {
+        size_t length = streams[0]->size() * sizeof(float);
+        for (int i = 0; i < count; i++) {
+            if (length) std::memcpy(&bytes[s.offset + i * length], streams[i]->data(), length);
+        }
+    }
+
+    static bool readStreams(const RMeshSection& s, const char* data, FloatStream* const* streams, int count) {
+        if (s.elementSize != sizeof(float) || s.count % count != 0) return false;
+        size_t length = s.count / count;
+        for (int i = 0; i < count; i++) {
+            streams[i]->resize(length);
+            if (length) std::memcpy(streams[i]->data(), data + i * length * sizeof(float), length * sizeof(float));
+        }
+        return true;
+    }
+
+    template <typename T>
+    static void copyArray(const RMeshSection& s, const std::vector<T>& array, std::vector<char>& bytes) {
+        if (!array.empty()) std::memcpy(&bytes[s.offset], array.data(), array.size() * sizeof(T));
+    }
+
+    template <typename T>
+    static bool readArray(const RMeshSection& s, const char* data, std::vector<T>& array) {
+        if (s.elementSize != sizeof(T)) return false;
+        array.resize(s.count);
+        if (s.count) std::memcpy(array.data(), data, s.count * sizeof(T));
+        return true;
+    }
+};
+
+#endif
@@ -2,157 +2,632 @@
 #define MODEL_H
 
 #include "Vec3.h"
+#include "Simd.h"
+#include "MappedFile.h"
+#include "ObjParser.h"
+#include "ThreadPool.h"
 #include <vector>
 #include <string>
-#include <fstream>
-#include <sstream>
+#include <memory>
+#include <chrono>
 #include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
 
-struct Face {
-    int v[3];  // vertex indices
-    int vt[3]; // texture coordinate indices
-    int vn[3]; // normal indices
-    
-    Face() {
-        for (int i = 0; i < 3; i++) {
-            v[i] = vt[i] = vn[i] = -1;
+// Welded vertices, one aligned array per component, so the vertex pass
+// loads the same component of several vertices at once
+struct VertexStreams {
+    FloatStream x, y, z;
+    FloatStream normalX, normalY, normalZ;
+    FloatStream u, v;
+
+    size_t size() const { return x.size(); }
+    bool empty() const { return x.empty(); }
+
+    void clear() {
+        for (FloatStream* s : {&x, &y, &z, &normalX, &normalY, &normalZ, &u, &v}) s->clear();
+    }
+
+    void push(const Vec3& position, const Vec3& normal, const Vec2& texCoord) {
+        x.push_back(position.x); y.push_back(position.y); z.push_back(position.z);
+        normalX.push_back(normal.x); normalY.push_back(normal.y); normalZ.push_back(normal.z);
+        u.push_back(texCoord.x); v.push_back(texCoord.y);
+    }
+
+    void append(const VertexStreams& other) {
+        FloatStream* to[8] = {&x, &y, &z, &normalX, &normalY, &normalZ, &u, &v};
+        const FloatStream* from[8] = {&other.x, &other.y, &other.z, &other.normalX, &other.normalY,
+                                      &other.normalZ, &other.u, &other.v};
+        for (int s = 0; s < 8; s++) to[s]->insert(to[s]->end(), from[s]->begin(), from[s]->end());
+    }
+
+    Vec3 position(size_t i) const { return Vec3(x[i], y[i], z[i]); }
+    Vec3 normal(size_t i) const { return Vec3(normalX[i], normalY[i], normalZ[i]); }
+    Vec2 texCoord(size_t i) const { return Vec2(u[i], v[i]); }
+
+    void setNormal(size_t i, const Vec3& n) {
+        normalX[i] = n.x; normalY[i] = n.y; normalZ[i] = n.z;
+    }
+
+    // Bytes of vertex data, not counting spare capacity
+    size_t bytes() const { return size() * 8 * sizeof(float); }
+};
+
+// Open-addressed table from vertex keys (bit patterns of what a corner
+// feeds the vertex shader) to welded vertex indices, at most half full
+class VertexWelder {
+public:
+    static const int KEY_WORDS = 9; // position, normal, uv, OBJ position index
+
+    explicit VertexWelder(size_t corners) : count(0) {
+        size_t capacity = 16;
+        while (capacity < corners * 2) capacity *= 2;
+        slots.assign(capacity, -1);
+        mask = capacity - 1;
+    }
+
+    static void key(const Vec3& position, const Vec3& normal, const Vec2& texCoord, int source,
+                    uint32_t out[KEY_WORDS]) {
+        float values[8] = {position.x, position.y, position.z, normal.x, normal.y, normal.z,
+                           texCoord.x, texCoord.y};
+        std::memcpy(out, values, sizeof(values));
+        out[8] = (uint32_t)source;
+    }
+
+    // Index of the vertex with this key; a new key gets the next index and
+    // returns true
+    bool insert(const uint32_t key[KEY_WORDS], uint32_t& index) {
+        uint32_t hash = 2166136261u;
+        for (int k = 0; k < KEY_WORDS; k++) hash = (hash ^ key[k]) * 16777619u;
+        size_t slot = (hash ^ (hash >> 15)) & mask;
+        while (slots[slot] >= 0 && !std::equal(key, key + KEY_WORDS, &keys[slots[slot] * KEY_WORDS])) {
+            slot = (slot + 1) & mask;
+        }
+        bool added = slots[slot] < 0;
+        if (added) {
+            slots[slot] = (int)count++;
+            keys.insert(keys.end(), key, key + KEY_WORDS);
         }
+        index = (uint32_t)slots[slot];
+        return added;
     }
+
+private:
+    std::vector<int> slots;
+    std::vector<uint32_t> keys;
+    size_t mask, count;
+};
+
+// The faces of one OBJ group (g/o), with its bounds
+struct ModelPart {
+    std::string name;     // g/o name, or the file name before the first group
+    std::string material; // usemtl name of its first face, empty if none
+    int firstFace;
+    int faceCount;
+    Vec3 boundsMin, boundsMax;
+    Vec3 center;          // bounding sphere
+    float radius;
+
+    ModelPart() : firstFace(0), faceCount(0), radius(0) {}
+};
+
+// Material id of faces without a usemtl
+const uint16_t NO_MATERIAL = 0xffff;
+
+// Range of welded vertices [first, end) that a part's corners refer to
+struct VertexRange {
+    int first, end;
 };
 
 class Model {
 private:
-    std::vector<Vec3> vertices;
-    std::vector<Vec2> texCoords;
-    std::vector<Vec3> normals;
-    std::vector<Face> faces;
+    friend class MeshCache;
+
+    // Each distinct (position, normal, uv) once, in first-use order, and
+    // three indices into them per face
+    VertexStreams vertices;
+    std::vector<uint32_t> indices;
+    std::vector<ModelPart> parts; // cover faces in order
+    std::vector<VertexRange> partVertices;      // per part
+    std::vector<uint16_t> faceMaterials;        // per face, into materialNames
+    std::vector<std::string> materialNames;     // usemtl names, in order of first use
+    std::vector<std::string> materialLibraries; // mtllib files, relative to the working directory
+
+    // Until generateNormals runs, vertices from files without normals
+    // keep the OBJ position they came from, so normals can be averaged per
+    // position; -1 for the rest, which keep their normal. Empty when no
+    // file lacked normals.
+    std::vector<int> vertexSources;
+    int sourceCount;
+
+    static void forEach(ThreadPool* pool, int count, const std::function<void(int)>& fn) {
+        if (pool) {
+            pool->parallelFor(count, fn);
+        } else {
+            for (int i = 0; i < count; i++) fn(i);
+        }
+    }
+
+    // Begins a part at face; the previous part ends there. Repeating the
+    // current group name within a file, as exporters often do, continues it.
+    void startPart(size_t face, const std::string& name, const std::string& material, bool newFile = false) {
+        if (!newFile && !parts.empty() && parts.back().name == name) return;
+        if (!parts.empty() && parts.back().firstFace == (int)face) parts.pop_back();
+        ModelPart part;
+        part.name = name;
+        part.material = material;
+        part.firstFace = (int)face;
+        parts.push_back(part);
+    }
+
+    // Sizes the parts from where the next one starts and drops empty ones
+    void finishParts(size_t faceCount) {
+        std::vector<ModelPart> kept;
+        for (size_t i = 0; i < parts.size(); i++) {
+            int end = i + 1 < parts.size() ? parts[i + 1].firstFace : (int)faceCount;
+            parts[i].faceCount = end - parts[i].firstFace;
+            if (parts[i].faceCount > 0) kept.push_back(parts[i]);
+        }
+        parts.swap(kept);
+    }
+
+    uint16_t materialId(const std::string& name) {
+        size_t id = std::find(materialNames.begin(), materialNames.end(), name) - materialNames.begin();
+        if (id == materialNames.size()) {
+            if (id >= NO_MATERIAL) return NO_MATERIAL;
+            materialNames.push_back(name);
+        }
+        return (uint16_t)id;
+    }
+
+    void addMaterialLibrary(const std::string& path) {
+        if (std::find(materialLibraries.begin(), materialLibraries.end(), path) == materialLibraries.end()) {
+            materialLibraries.push_back(path);
+        }
+    }
+
+    // Orders the faces of every part by material, keeping their order
+    // within a material, so each part draws as one run per material
+    void sortFacesByMaterial(std::vector<Face>& faces) {
+        std::vector<int> order;
+        std::vector<Face> sortedFaces;
+        std::vector<uint16_t> sortedMaterials;
+        for (ModelPart& part : parts) {
+            int first = part.firstFace, end = first + part.faceCount;
+            if (std::is_sorted(faceMaterials.begin() + first, faceMaterials.begin() + end)) continue;
+            order.resize(part.faceCount);
+            for (int i = 0; i < part.faceCount; i++) order[i] = first + i;
+            std::stable_sort(order.begin(), order.end(),
+                             [&](int a, int b) { return faceMaterials[a] < faceMaterials[b]; });
+            sortedFaces.clear();
+            sortedMaterials.clear();
+            for (int f : order) {
+                sortedFaces.push_back(faces[f]);
+                sortedMaterials.push_back(faceMaterials[f]);
+            }
+            std::copy(sortedFaces.begin(), sortedFaces.end(), faces.begin() + first);
+            std::copy(sortedMaterials.begin(), sortedMaterials.end(), faceMaterials.begin() + first);
+            uint16_t id = faceMaterials[first];
+            part.material = id == NO_MATERIAL ? std::string() : materialNames[id];
+        }
+    }
+
+    static std::string fileStem(const std::string& path) {
+        size_t slash = path.find_last_of('/');
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        size_t dot = name.find_last_of('.');
+        return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+    }
 
 public:
-    Model() {}
+    // Directory part of a path with its trailing slash, empty if none
+    static std::string directoryOf(const std::string& path) {
+        size_t slash = path.find_last_of('/');
+        return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+    }
+
+private:
 
-    bool loadOBJ(const std::string& filename) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Error: Cannot open file " << filename << std::endl;
+    // Welds the parsed face corners into the vertex streams and the index
+    // buffer. Corners share a vertex when their position, texture
+    // coordinate and normal are bitwise equal, not just their indices:
+    // exporters often write a separate normal per corner even where the
+    // values repeat. Faces of file i start at fileFaces[i]; for files
+    // without normals the OBJ position is part of the key.
+    void weld(const std::vector<Vec3>& positions, const std::vector<Vec2>& texCoords,
+              const std::vector<Vec3>& normals, const std::vector<Face>& faces,
+              const std::vector<size_t>& fileFaces, const std::vector<char>& fileNormals) {
+        bool generate = std::find(fileNormals.begin(), fileNormals.end(), 0) != fileNormals.end();
+        sourceCount = generate ? (int)positions.size() : 0;
+        vertices.clear();
+        vertexSources.clear();
+        indices.resize(faces.size() * 3);
+        VertexWelder welder(indices.size());
+        size_t file = 0;
+        for (size_t f = 0; f < faces.size(); f++) {
+            while (file + 1 < fileFaces.size() && fileFaces[file + 1] <= f) file++;
+            bool fileHasNormals = fileNormals[file] != 0;
+            const Face& face = faces[f];
+            for (int i = 0; i < 3; i++) {
+                bool inRange = face.v[i] >= 0 && (size_t)face.v[i] < positions.size();
+                Vec3 position = inRange ? positions[face.v[i]] : Vec3(0, 0, 0);
+                Vec3 normal = face.vn[i] >= 0 && (size_t)face.vn[i] < normals.size() ? normals[face.vn[i]]
+                                                                                    : Vec3(0, 0, 1);
+                Vec2 texCoord = face.vt[i] >= 0 && (size_t)face.vt[i] < texCoords.size() ? texCoords[face.vt[i]]
+                                                                                        : Vec2(0, 0);
+                int source = fileHasNormals || !inRange ? -1 : face.v[i];
+                uint32_t key[VertexWelder::KEY_WORDS];
+                VertexWelder::key(position, normal, texCoord, source, key);
+                if (welder.insert(key, indices[f * 3 + i])) {
+                    vertices.push(position, normal, texCoord);
+                    if (generate) vertexSources.push_back(source);
+                }
+            }
+        }
+        updatePartVertices();
+    }
+
+    // Welds the vertices again once generated normals have made some of
+    // them equal, keeping first-use order
+    void reweld() {
+        VertexStreams welded;
+        std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+        VertexWelder welder(indices.size());
+        for (uint32_t& index : indices) {
+            if (remap[index] == UINT32_MAX) {
+                uint32_t key[VertexWelder::KEY_WORDS];
+                VertexWelder::key(vertices.position(index), vertices.normal(index), vertices.texCoord(index), -1, key);
+                if (welder.insert(key, remap[index])) {
+                    welded.push(vertices.position(index), vertices.normal(index), vertices.texCoord(index));
+                }
+            }
+            index = remap[index];
+        }
+        vertices = welded;
+        updatePartVertices();
+    }
+
+    // The welded vertices each part's faces use; parts that share none get
+    // disjoint ranges
+    void updatePartVertices() {
+        partVertices.resize(parts.size());
+        for (size_t p = 0; p < parts.size(); p++) {
+            partVertices[p] = vertexRange(parts[p].firstFace, parts[p].faceCount);
+        }
+    }
+
+    VertexRange vertexRange(int firstFace, int faceCount) const {
+        VertexRange range = {(int)vertices.size(), 0};
+        for (size_t c = (size_t)firstFace * 3; c < (size_t)(firstFace + faceCount) * 3; c++) {
+            range.first = std::min(range.first, (int)indices[c]);
+            range.end = std::max(range.end, (int)indices[c] + 1);
+        }
+        return range;
+    }
+
+public:
+    Model() : sourceCount(0) {}
+
+    // Replaces the model with the contents of an OBJ file. The file is
+    // memory-mapped, counted once to size the arrays, then parsed in place;
+    // with a pool, large files are split into chunks parsed in parallel.
+    bool loadOBJ(const std::string& filename, ThreadPool* pool = nullptr) {
+        return loadOBJFiles(std::vector<std::string>(1, filename), pool);
+    }
+
+    // Loads every .obj file in a directory into one model, in name order
+    bool loadOBJDirectory(const std::string& directory, ThreadPool* pool = nullptr) {
+        std::vector<std::string> filenames;
+        if (!listOBJFiles(directory, filenames)) {
+            std::cerr << "Error: Cannot read directory " << directory << std::endl;
             return false;
         }
+        if (filenames.empty()) {
+            std::cerr << "Error: No .obj files in " << directory << std::endl;
+            return false;
+        }
+        return loadOBJFiles(filenames, pool);
+    }
 
-        std::string line;
-        while (std::getline(file, line)) {
-            std::istringstream iss(line);
-            std::string prefix;
-            iss >> prefix;
+    // Replaces the model with the merged contents of several OBJ files.
+    // Every file is cut into chunks at line boundaries. Counting the chunks
+    // gives each one its exact output position, so all chunks of all files
+    // are parsed concurrently straight into shared arrays, with each file's
+    // indices rebased onto where its elements land; the corners are then
+    // welded into the vertex streams and those arrays dropped.
+    bool loadOBJFiles(const std::vector<std::string>& filenames, ThreadPool* pool = nullptr,
+                      bool report = true) {
+        const size_t CHUNK_SIZE = 512 * 1024;
+        auto start = std::chrono::steady_clock::now();
 
-            if (prefix == "v") {
-                // Vertex
-                float x, y, z;
-                iss >> x >> y >> z;
-                vertices.push_back(Vec3(x, y, z));
+        clear();
+
+        std::vector<std::unique_ptr<MappedFile> > files;
+        std::vector<Vec3> positions, normals;
+        std::vector<Vec2> texCoords;
+        std::vector<Face> faces;
+        size_t totalBytes = 0;
+        for (const std::string& filename : filenames) {
+            files.push_back(std::unique_ptr<MappedFile>(new MappedFile()));
+            if (!files.back()->open(filename)) {
+                std::cerr << "Error: Cannot open file " << filename << std::endl;
+                return false;
             }
-            else if (prefix == "vt") {
-                // Texture coordinate
-                float u, v;
-                iss >> u >> v;
-                texCoords.push_back(Vec2(u, v));
+            totalBytes += files.back()->size();
+        }
+
+        struct Chunk {
+            int file;
+            const char* begin;
+            const char* end;
+            ObjCounts counts;
+            ObjCounts start;
+            ObjCounts parsed;
+            std::vector<ObjGroup> groups;
+        };
+        std::vector<Chunk> chunks;
+        for (int f = 0; f < (int)files.size(); f++) {
+            const char* begin = files[f]->data();
+            const char* end = files[f]->end();
+            const char* p = begin;
+            do {
+                Chunk chunk;
+                chunk.file = f;
+                chunk.begin = p;
+                chunk.end = ObjParser::nextLine(std::min(p + CHUNK_SIZE, end), begin, end);
+                chunks.push_back(chunk);
+                p = chunk.end;
+            } while (p < end);
+        }
+
+        forEach(pool, (int)chunks.size(), [&](int c) {
+            chunks[c].counts = ObjParser::count(chunks[c].begin, chunks[c].end);
+        });
+
+        // Prefix sums give each chunk its output position and each file its base
+        ObjCounts total;
+        std::vector<ObjCounts> fileBase(files.size());
+        for (size_t c = 0; c < chunks.size(); c++) {
+            if (c == 0 || chunks[c].file != chunks[c - 1].file) fileBase[chunks[c].file] = total;
+            chunks[c].start = total;
+            total.vertices += chunks[c].counts.vertices;
+            total.texCoords += chunks[c].counts.texCoords;
+            total.normals += chunks[c].counts.normals;
+            total.triangles += chunks[c].counts.triangles;
+        }
+
+        positions.resize(total.vertices);
+        texCoords.resize(total.texCoords);
+        normals.resize(total.normals);
+        faces.resize(total.triangles);
+
+        forEach(pool, (int)chunks.size(), [&](int c) {
+            Chunk& chunk = chunks[c];
+            chunk.parsed = ObjParser::parse(chunk.begin, chunk.end, fileBase[chunk.file], chunk.start,
+                                            chunk.counts, positions.data(), texCoords.data(), normals.data(),
+                                            faces.data(), &chunk.groups);
+        });
+
+        // Close the gaps left by dropped faces, split the faces into parts
+        // wherever a file or group starts, and give every face the id of
+        // the usemtl before it
+        size_t faceCount = 0, materialStart = 0;
+        std::vector<size_t> fileFaces;
+        std::vector<char> fileNormals;
+        std::string material;
+        uint16_t materialIndex = NO_MATERIAL;
+        faceMaterials.resize(total.triangles);
+        auto endMaterialRun = [&](size_t face) {
+            std::fill(faceMaterials.begin() + materialStart, faceMaterials.begin() + face, materialIndex);
+            materialStart = face;
+        };
+        for (size_t c = 0; c < chunks.size(); c++) {
+            const Chunk& chunk = chunks[c];
+            if (faceCount != chunk.start.triangles) {
+                std::copy(faces.begin() + chunk.start.triangles,
+                          faces.begin() + chunk.start.triangles + chunk.parsed.triangles,
+                          faces.begin() + faceCount);
             }
-            else if (prefix == "vn") {
-                // Normal
-                float x, y, z;
-                iss >> x >> y >> z;
-                normals.push_back(Vec3(x, y, z));
+            if (c == 0 || chunk.file != chunks[c - 1].file) {
+                fileFaces.push_back(faceCount);
+                fileNormals.push_back(0);
+                endMaterialRun(faceCount);
+                material.clear();
+                materialIndex = NO_MATERIAL;
+                startPart(faceCount, fileStem(filenames[chunk.file]), material, true);
             }
-            else if (prefix == "f") {
-                // Face
-                Face face;
-                std::string vertex;
-                int vertexIndex = 0;
-                
-                while (iss >> vertex && vertexIndex < 3) {
-                    std::istringstream vertexStream(vertex);
-                    std::string index;
-                    
-                    // Parse vertex index
-                    if (std::getline(vertexStream, index, '/')) {
-                        face.v[vertexIndex] = std::stoi(index) - 1; // OBJ is 1-indexed
-                    }
-                    
-                    // Parse texture coordinate index
-                    if (std::getline(vertexStream, index, '/')) {
-                        if (!index.empty()) {
-                            face.vt[vertexIndex] = std::stoi(index) - 1;
-                        }
-                    }
-                    
-                    // Parse normal index
-                    if (std::getline(vertexStream, index)) {
-                        if (!index.empty()) {
-                            face.vn[vertexIndex] = std::stoi(index) - 1;
-                        }
-                    }
-                    
-                    vertexIndex++;
-                }
-                
-                if (vertexIndex == 3) {
-                    faces.push_back(face);
+            for (const ObjGroup& g : chunk.groups) {
+                size_t face = faceCount + g.face;
+                if (g.type == 'g') {
+                    startPart(face, g.name, material);
+                } else if (g.type == 'l') {
+                    addMaterialLibrary(directoryOf(filenames[chunk.file]) + g.name);
+                } else {
+                    // Parts are objects, not material runs: they keep the
+                    // material their first face uses
+                    endMaterialRun(face);
+                    material = g.name;
+                    materialIndex = materialId(material);
+                    if (parts.back().firstFace == (int)face) parts.back().material = material;
                 }
             }
+            if (chunk.counts.normals > 0) fileNormals.back() = 1;
+            faceCount += chunk.parsed.triangles;
+        }
+        endMaterialRun(faceCount);
+        if (faceCount < total.triangles) {
+            std::cerr << "Warning: dropped " << total.triangles - faceCount
+                      << " faces with missing or out of range vertex indices";
+            if (files.size() == 1) std::cerr << " in " << filenames[0];
+            std::cerr << std::endl;
         }
+        faces.resize(faceCount);
+        faceMaterials.resize(faceCount);
+        finishParts(faceCount);
+        sortFacesByMaterial(faces);
+        weld(positions, texCoords, normals, faces, fileFaces, fileNormals);
+        updatePartBounds(pool);
+
+        if (!report) return true;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double megabytes = totalBytes / (1024.0 * 1024.0);
+        std::cout << "Loaded model: " << vertices.size() << " vertices, " << faces.size() << " faces";
+        if (files.size() > 1) std::cout << " from " << files.size() << " files";
+        std::cout << " (" << megabytes << " MB in " << seconds * 1000.0 << " ms, "
+                  << (seconds > 0 ? megabytes / seconds : 0.0) << " MB/s, "
+                  << (pool ? pool->getThreadCount() : 1) << " threads)" << std::endl;
+        return true;
+    }
 
-        file.close();
-        std::cout << "Loaded model: " << vertices.size() << " vertices, " 
-                  << faces.size() << " faces" << std::endl;
+    // Sorted paths of the .obj files in a directory
+    static bool listOBJFiles(const std::string& directory, std::vector<std::string>& filenames) {
+        DIR* dir = opendir(directory.c_str());
+        if (!dir) return false;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0) {
+                filenames.push_back(directory + "/" + name);
+            }
+        }
+        closedir(dir);
+        std::sort(filenames.begin(), filenames.end());
         return true;
     }
 
-    // Generate normals if not provided
+    static bool isDirectory(const std::string& path) {
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+    }
+
+    // Generate normals where the file had none: each OBJ position gets the
+    // average of the normals of the faces around it
     void generateNormals() {
-        if (!normals.empty()) return;
-        
-        normals.resize(vertices.size(), Vec3(0, 0, 0));
-        
-        for (const Face& face : faces) {
-            Vec3 v0 = vertices[face.v[0]];
-            Vec3 v1 = vertices[face.v[1]];
-            Vec3 v2 = vertices[face.v[2]];
-            
+        if (vertexSources.empty()) return;
+
+        std::vector<Vec3> sums(sourceCount, Vec3(0, 0, 0));
+        for (size_t c = 0; c < indices.size(); c += 3) {
+            const uint32_t* corner = &indices[c];
+            if (vertexSources[corner[0]] < 0 || vertexSources[corner[1]] < 0 ||
+                vertexSources[corner[2]] < 0) continue;
+            Vec3 v0 = vertices.position(corner[0]);
+            Vec3 v1 = vertices.position(corner[1]);
+            Vec3 v2 = vertices.position(corner[2]);
+
             Vec3 normal = (v1 - v0).cross(v2 - v0).normalize();
-            
-            normals[face.v[0]] = normals[face.v[0]] + normal;
-            normals[face.v[1]] = normals[face.v[1]] + normal;
-            normals[face.v[2]] = normals[face.v[2]] + normal;
+
+            for (int i = 0; i < 3; i++) {
+                Vec3& sum = sums[vertexSources[corner[i]]];
+                sum = sum + normal;
+            }
         }
-        
-        for (Vec3& normal : normals) {
+
+        for (Vec3& normal : sums) {
             normal = normal.normalize();
         }
+
+        for (size_t i = 0; i < vertices.size(); i++) {
+            if (vertexSources[i] >= 0) vertices.setNormal(i, sums[vertexSources[i]]);
+        }
+        vertexSources.clear();
+        sourceCount = 0;
+        reweld();
+    }
+
+    // Recomputes each part's box and bounding sphere from its faces
+    void updatePartBounds(ThreadPool* pool = nullptr) {
+        forEach(pool, (int)parts.size(), [&](int p) {
+            ModelPart& part = parts[p];
+            size_t begin = (size_t)part.firstFace * 3, end = begin + (size_t)part.faceCount * 3;
+            Vec3 lo(0, 0, 0), hi(0, 0, 0);
+            for (size_t c = begin; c < end; c++) {
+                Vec3 v = vertices.position(indices[c]);
+                if (c == begin) lo = hi = v;
+                lo = Vec3(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+                hi = Vec3(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+            }
+            part.boundsMin = lo;
+            part.boundsMax = hi;
+            part.center = (lo + hi) * 0.5f;
+
+            float radiusSquared = 0;
+            for (size_t c = begin; c < end; c++) {
+                Vec3 d = vertices.position(indices[c]) - part.center;
+                radiusSquared = std::max(radiusSquared, d.dot(d));
+            }
+            part.radius = std::sqrt(radiusSquared);
+        });
+    }
+
+    // Appends another model, rebasing its indices past this model's
+    // vertices. Vertices are not welded across the two.
+    void append(const Model& other) {
+        uint32_t vertexBase = (uint32_t)vertices.size();
+        size_t firstFace = getTriangleCount();
+
+        // Vertices that already have their normal get -1
+        if (!vertexSources.empty() || !other.vertexSources.empty()) {
+            vertexSources.resize(vertexBase, -1);
+            for (int source : other.vertexSources) vertexSources.push_back(source >= 0 ? source + sourceCount : -1);
+            vertexSources.resize(vertexBase + other.vertices.size(), -1);
+            sourceCount += other.sourceCount;
+        }
+
+        vertices.append(other.vertices);
+        for (uint32_t index : other.indices) indices.push_back(index + vertexBase);
+        for (uint16_t id : other.faceMaterials) {
+            faceMaterials.push_back(id == NO_MATERIAL ? id : materialId(other.materialNames[id]));
+        }
+        for (const std::string& library : other.materialLibraries) addMaterialLibrary(library);
+        for (size_t p = 0; p < other.parts.size(); p++) {
+            ModelPart part = other.parts[p];
+            part.firstFace += (int)firstFace;
+            parts.push_back(part);
+            VertexRange range = other.partVertices[p];
+            partVertices.push_back(VertexRange{range.first + (int)vertexBase, range.end + (int)vertexBase});
+        }
+    }
+
+    void clear() {
+        vertices.clear();
+        indices.clear();
+        parts.clear();
+        partVertices.clear();
+        faceMaterials.clear();
+        materialNames.clear();
+        materialLibraries.clear();
+        vertexSources.clear();
+        sourceCount = 0;
+    }
+
+    // Box around every vertex; false for an empty model
+    bool getBounds(Vec3& lo, Vec3& hi) const {
+        if (vertices.empty()) return false;
+        lo = hi = vertices.position(0);
+        for (size_t i = 1; i < vertices.size(); i++) {
+            Vec3 v = vertices.position(i);
+            lo = Vec3(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+            hi = Vec3(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+        }
+        return true;
     }
 
     // Accessors
-    const std::vector<Vec3>& getVertices() const { return vertices; }
-    const std::vector<Vec2>& getTexCoords() const { return texCoords; }
-    const std::vector<Vec3>& getNormals() const { return normals; }
-    const std::vector<Face>& getFaces() const { return faces; }
-    
-    Vec3 getVertex(int index) const {
-        if (index >= 0 && (size_t)index < vertices.size()) {
-            return vertices[index];
-        }
-        return Vec3(0, 0, 0);
-    }
-    
-    Vec3 getNormal(int index) const {
-        if (index >= 0 && (size_t)index < normals.size()) {
-            return normals[index];
-        }
-        return Vec3(0, 0, 1);
-    }
-    
-    Vec2 getTexCoord(int index) const {
-        if (index >= 0 && (size_t)index < texCoords.size()) {
-            return texCoords[index];
-        }
-        return Vec2(0, 0);
+    const VertexStreams& getVertices() const { return vertices; }
+    const std::vector<uint32_t>& getIndices() const { return indices; }
+    size_t getTriangleCount() const { return indices.size() / 3; }
+    const std::vector<ModelPart>& getParts() const { return parts; }
+    const std::vector<uint16_t>& getFaceMaterials() const { return faceMaterials; }
+    const std::vector<std::string>& getMaterialNames() const { return materialNames; }
+    const std::vector<std::string>& getMaterialLibraries() const { return materialLibraries; }
+    // Welded vertices used by each part; parts that share none get disjoint ranges
+    const std::vector<VertexRange>& getPartVertices() const { return partVertices; }
+
+    // Bytes held by the vertex streams, index buffer and face materials
+    size_t getMeshBytes() const {
+        return vertices.bytes() + indices.size() * sizeof(uint32_t) + faceMaterials.size() * sizeof(uint16_t);
     }
 };
 
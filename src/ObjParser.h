@@ -0,0 +1,296 @@
+#ifndef OBJPARSER_H
+#define OBJPARSER_H
+
+#include "Vec3.h"
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+struct Face {
+    int v[3];  // vertex indices
+    int vt[3]; // texture coordinate indices
+    int vn[3]; // normal indices
+
+    Face() {
+        for (int i = 0; i < 3; i++) {
+            v[i] = vt[i] = vn[i] = -1;
+        }
+    }
+};
+
+// Element counts of an OBJ buffer. Faces with more than three corners are
+// counted as the triangles of their fan.
+struct ObjCounts {
+    size_t vertices;
+    size_t texCoords;
+    size_t normals;
+    size_t triangles;
+
+    ObjCounts() : vertices(0), texCoords(0), normals(0), triangles(0) {}
+};
+
+// A g/o (type 'g'), usemtl (type 'm') or mtllib (type 'l') statement; it
+// applies to the faces from index `face` on, counted within the parsed range
+struct ObjGroup {
+    size_t face;
+    char type;
+    std::string name;
+};
+
+// Allocation-free OBJ scanner working directly on the file bytes. A counting
+// pass sizes the output arrays, then the parse pass fills them in place;
+// only group and material names are copied out.
+class ObjParser {
+private:
+    static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    static const char* skipBlanks(const char* p, const char* end) {
+        while (p < end && isBlank(*p)) p++;
+        return p;
+    }
+
+    static const char* skipLine(const char* p, const char* end) {
+        while (p < end && *p != '\n') p++;
+        return p < end ? p + 1 : end;
+    }
+
+    // Keyword of the line starting at p: 'v', 't' (vt), 'n' (vn), 'f',
+    // 'g' (g or o), 'm' (usemtl), 'l' (mtllib) or 0
+    static char lineType(const char* p, const char* end) {
+        if (p >= end) return 0;
+        if (*p == 'v') {
+            if (p + 1 < end && isBlank(p[1])) return 'v';
+            if (p + 2 < end && isBlank(p[2])) {
+                if (p[1] == 't') return 't';
+                if (p[1] == 'n') return 'n';
+            }
+        } else if (*p == 'f' && p + 1 < end && isBlank(p[1])) {
+            return 'f';
+        } else if ((*p == 'g' || *p == 'o') && p + 1 < end && isBlank(p[1])) {
+            return 'g';
+        } else if (*p == 'u' && end - p > 6 && std::equal(p, p + 6, "usemtl") && isBlank(p[6])) {
+            return 'm';
+        } else if (*p == 'm' && end - p > 6 && std::equal(p, p + 6, "mtllib") && isBlank(p[6])) {
+            return 'l';
+        }
+        return 0;
+    }
+
+    // Rest of the line from p, without surrounding blanks
+    static std::string lineText(const char* p, const char* end) {
+        p = skipBlanks(p, end);
+        const char* e = p;
+        while (e < end && *e != '\n' && *e != '#') e++;
+        while (e > p && isBlank(e[-1])) e--;
+        return std::string(p, e);
+    }
+
+    // mantissa * 10^exponent, dividing for negative exponents so common
+    // values like 0.1 round the same way strtod does
+    static double scaleByPowerOfTen(double mantissa, int exponent) {
+        static const double table[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        if (exponent >= 0 && exponent <= 22) return mantissa * table[exponent];
+        if (exponent < 0 && exponent >= -22) return mantissa / table[-exponent];
+        return mantissa * std::pow(10.0, exponent);
+    }
+
+    // Locale-independent decimal float. Leaves p unchanged if there is no number.
+    static float parseFloat(const char*& p, const char* end) {
+        const char* s = skipBlanks(p, end);
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+')) negative = *s++ == '-';
+
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        int digits = 0;
+        bool any = false;
+        for (; s < end && isDigit(*s); s++, any = true) {
+            if (digits < 19) { mantissa = mantissa * 10 + (*s - '0'); if (mantissa) digits++; }
+            else exponent++;
+        }
+        if (s < end && *s == '.') {
+            for (s++; s < end && isDigit(*s); s++, any = true) {
+                if (digits < 19) { mantissa = mantissa * 10 + (*s - '0'); exponent--; if (mantissa) digits++; }
+            }
+        }
+        if (!any) return 0.0f;
+
+        if (s < end && (*s == 'e' || *s == 'E')) {
+            const char* e = s + 1;
+            bool negativeExp = false;
+            if (e < end && (*e == '-' || *e == '+')) negativeExp = *e++ == '-';
+            if (e < end && isDigit(*e)) {
+                int value = 0;
+                for (; e < end && isDigit(*e); e++) {
+                    if (value < 10000) value = value * 10 + (*e - '0');
+                }
+                exponent += negativeExp ? -value : value;
+                s = e;
+            }
+        }
+
+        p = s;
+        double value = scaleByPowerOfTen((double)mantissa, exponent);
+        return (float)(negative ? -value : value);
+    }
+
+    static long parseInt(const char*& p, const char* end) {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+        long value = 0;
+        for (; p < end && isDigit(*p); p++) value = value * 10 + (*p - '0');
+        return negative ? -value : value;
+    }
+
+    // OBJ indices are 1-based from the start of their file, or negative to
+    // count back from the most recently defined element. Returns -1 if absent
+    // or outside the elements the file has defined so far.
+    static int resolveIndex(long index, size_t base, size_t defined) {
+        long resolved = index > 0 ? (long)base + index - 1 : (long)defined + index;
+        if (index == 0 || resolved < (long)base || resolved >= (long)defined) return -1;
+        return (int)resolved;
+    }
+
+    // Reads one v[/vt][/vn] corner of a face: one blank-delimited token, as
+    // count() sees it. A token with anything left after the indices is a
+    // corner without a vertex. Returns false at end of line.
+    static bool parseCorner(const char*& p, const char* end, const ObjCounts& base,
+                            const ObjCounts& defined, int& v, int& vt, int& vn) {
+        p = skipBlanks(p, end);
+        if (p >= end || *p == '\n' || *p == '#') return false;
+
+        const char* start = p;
+        v = resolveIndex(parseInt(p, end), base.vertices, defined.vertices);
+        vt = vn = -1;
+        if (p < end && *p == '/') {
+            p++;
+            if (p < end && *p != '/') vt = resolveIndex(parseInt(p, end), base.texCoords, defined.texCoords);
+            if (p < end && *p == '/') {
+                p++;
+                vn = resolveIndex(parseInt(p, end), base.normals, defined.normals);
+            }
+        }
+
+        // Skip the rest of a bad token so it stays one corner
+        if (p == start || (p < end && !isBlank(*p) && *p != '\n')) {
+            while (p < end && !isBlank(*p) && *p != '\n') p++;
+            v = -1;
+        }
+        return true;
+    }
+
+public:
+    static ObjCounts count(const char* p, const char* end) {
+        ObjCounts counts;
+        while (p < end) {
+            p = skipBlanks(p, end);
+            char type = lineType(p, end);
+            if (type == 'v') counts.vertices++;
+            else if (type == 't') counts.texCoords++;
+            else if (type == 'n') counts.normals++;
+            else if (type == 'f') {
+                int corners = 0;
+                const char* s = p + 1;
+                while (true) {
+                    s = skipBlanks(s, end);
+                    if (s >= end || *s == '\n' || *s == '#') break;
+                    corners++;
+                    while (s < end && !isBlank(*s) && *s != '\n') s++;
+                }
+                if (corners >= 3) counts.triangles += corners - 2;
+                p = s;
+            }
+            p = skipLine(p, end);
+        }
+        return counts;
+    }
+
+    // Start of the next line at or after p; used to split a file into chunks
+    static const char* nextLine(const char* p, const char* begin, const char* end) {
+        if (p <= begin) return begin;
+        return p >= end ? end : skipLine(p - 1, end);
+    }
+
+    // Parses [p, end) into arrays sized from count(). Elements are written
+    // from index `start` on, where `start` counts everything that precedes
+    // this range in the merged model; `base` is where the range's file
+    // starts, for its 1-based indices, and `capacity` is what count()
+    // found in the range; nothing past it is written. Returns how many
+    // elements of each kind were written; faces with a missing or out of
+    // range vertex index are dropped.
+    // Group and material statements are appended to groups if given.
+    static ObjCounts parse(const char* p, const char* end, const ObjCounts& base, const ObjCounts& start,
+                           const ObjCounts& capacity, Vec3* vertices, Vec2* texCoords, Vec3* normals, Face* faces,
+                           std::vector<ObjGroup>* groups = nullptr) {
+        vertices += start.vertices;
+        texCoords += start.texCoords;
+        normals += start.normals;
+        faces += start.triangles;
+
+        ObjCounts out;
+        ObjCounts defined = start;
+        while (p < end) {
+            p = skipBlanks(p, end);
+            char type = lineType(p, end);
+            if (type == 'v' && out.vertices < capacity.vertices) {
+                p += 1;
+                float x = parseFloat(p, end);
+                float y = parseFloat(p, end);
+                float z = parseFloat(p, end);
+                vertices[out.vertices++] = Vec3(x, y, z);
+                defined.vertices++;
+            } else if (type == 't' && out.texCoords < capacity.texCoords) {
+                p += 2;
+                float u = parseFloat(p, end);
+                float v = parseFloat(p, end);
+                texCoords[out.texCoords++] = Vec2(u, v);
+                defined.texCoords++;
+            } else if (type == 'n' && out.normals < capacity.normals) {
+                p += 2;
+                float x = parseFloat(p, end);
+                float y = parseFloat(p, end);
+                float z = parseFloat(p, end);
+                normals[out.normals++] = Vec3(x, y, z);
+                defined.normals++;
+            } else if (type == 'f') {
+                // Fan-triangulate polygons around their first corner
+                p += 1;
+                Face face;
+                int corner = 0;
+                bool valid = true;
+                int v, vt, vn;
+                while (parseCorner(p, end, base, defined, v, vt, vn)) {
+                    if (v < 0) valid = false;
+                    int slot = corner < 3 ? corner : 2;
+                    if (corner >= 3) {
+                        face.v[1] = face.v[2];
+                        face.vt[1] = face.vt[2];
+                        face.vn[1] = face.vn[2];
+                    }
+                    face.v[slot] = v;
+                    face.vt[slot] = vt;
+                    face.vn[slot] = vn;
+                    corner++;
+                    if (corner >= 3 && valid && out.triangles < capacity.triangles) faces[out.triangles++] = face;
+                }
+            } else if ((type == 'g' || type == 'm' || type == 'l') && groups) {
+                ObjGroup group;
+                group.face = out.triangles;
+                group.type = type;
+                group.name = lineText(p + (type == 'g' ? 1 : 6), end);
+                groups->push_back(group);
+            }
+            p = skipLine(p, end);
+        }
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,369 @@
+#ifndef RASTERKERNELS_H
+#define RASTERKERNELS_H
+
+#include "Vec3.h"
+#include "Simd.h"
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// Most samples per pixel the multisampled kernels handle
+const int MAX_SAMPLES = 8;
+
+// A triangle's change of each edge function and of depth from the centre
+// of a pixel to each of its samples, with their extremes, so that pixels
+// can be accepted or rejected as a whole from the centre values
+struct SampleOffsets {
+    int count;
+    int64_t w[3][MAX_SAMPLES];
+    int64_t wMin[3], wMax[3];
+    float z[MAX_SAMPLES];
+    float zMin, zMax;
+
+    // pattern holds count (x, y) pairs in units of 1 / grid pixel; stepX and
+    // stepY are the edge functions' change per pixel, which grid divides.
+    // A null pattern is a single sample at the centre.
+    void setup(const int* pattern, int samples, int grid, const int64_t stepX[3], const int64_t stepY[3],
+               float zStepX, float zStepY) {
+        count = samples;
+        for (int k = 0; k < count; k++) {
+            int ox = pattern ? pattern[k * 2] : 0, oy = pattern ? pattern[k * 2 + 1] : 0;
+            for (int e = 0; e < 3; e++) {
+                w[e][k] = (stepX[e] * ox + stepY[e] * oy) / grid;
+                wMin[e] = k ? std::min(wMin[e], w[e][k]) : w[e][k];
+                wMax[e] = k ? std::max(wMax[e], w[e][k]) : w[e][k];
+            }
+            z[k] = zStepX * ((float)ox / grid) + zStepY * ((float)oy / grid);
+            zMin = k ? std::min(zMin, z[k]) : z[k];
+            zMax = k ? std::max(zMax, z[k]) : z[k];
+        }
+    }
+};
+
+// One row of a triangle's bounding box, as set up by Framebuffer::drawTriangle.
+// Pixel i of the row is covered when (w[0] | w[1] | w[2]) >= 0 after i steps,
+// and its depth is zRow + zStepX * (xOffset + i). Every kernel evaluates
+// exactly this, so all of them write bit-identical results. Multisampled
+// rows add samples' offsets to both.
+struct RasterRow {
+    int count;
+    int xOffset;
+    int64_t w[3];
+    int64_t stepX[3];
+    float zRow;
+    float zStepX;
+    Color color;
+    const SampleOffsets* samples; // null when single sampled
+};
+
+// Kernels instantiated with COLOR false only test and write depth; colors
+// is then never touched and may be null.
+typedef void (*RasterRowFn)(const RasterRow& row, Color* colors, float* depths);
+
+// Reference kernel
+template <bool COLOR>
+inline void rasterRowScalar(const RasterRow& row, Color* colors, float* depths) {
+    int64_t w0 = row.w[0], w1 = row.w[1], w2 = row.w[2];
+    for (int i = 0; i < row.count; i++) {
+        if ((w0 | w1 | w2) >= 0) {
+            float z = row.zRow + row.zStepX * (float)(row.xOffset + i);
+            if (z < depths[i]) {
+                if (COLOR) colors[i] = row.color;
+                depths[i] = z;
+            }
+        }
+        w0 += row.stepX[0];
+        w1 += row.stepX[1];
+        w2 += row.stepX[2];
+    }
+}
+
+// Finishes a row from pixel `first` on with the scalar kernel
+template <bool COLOR>
+inline void rasterRowTail(const RasterRow& row, int first, Color* colors, float* depths) {
+    if (first >= row.count) return;
+    RasterRow tail = row;
+    tail.count = row.count - first;
+    tail.xOffset = row.xOffset + first;
+    for (int e = 0; e < 3; e++) tail.w[e] = row.w[e] + first * row.stepX[e];
+    rasterRowScalar<COLOR>(tail, COLOR ? colors + first : colors, depths + first);
+}
+
+#ifdef RENDER_SIMD_X86
+
+static_assert(sizeof(Color) == 4, "raster kernels store colours as 32-bit lanes");
+
+inline uint32_t packColor(const Color& c) {
+    uint32_t bits;
+    std::memcpy(&bits, &c, sizeof(bits));
+    return bits;
+}
+
+// 4x1 blocks: edge values as int64 pairs, coverage from their sign bits
+template <bool COLOR>
+RENDER_TARGET_SSE4 inline void rasterRowSSE4(const RasterRow& row, Color* colors, float* depths) {
+    __m128i wa[3], wb[3], step[3];
+    for (int e = 0; e < 3; e++) {
+        int64_t w = row.w[e], s = row.stepX[e];
+        wa[e] = _mm_set_epi64x(w + s, w);
+        wb[e] = _mm_set_epi64x(w + 3 * s, w + 2 * s);
+        step[e] = _mm_set1_epi64x(4 * s);
+    }
+    const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+    const __m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128 zRow = _mm_set1_ps(row.zRow);
+    const __m128 zStep = _mm_set1_ps(row.zStepX);
+    const __m128i color = _mm_set1_epi32((int)packColor(row.color));
+
+    int i = 0;
+    for (; i + 4 <= row.count; i += 4) {
+        __m128i ora = _mm_or_si128(_mm_or_si128(wa[0], wa[1]), wa[2]);
+        __m128i orb = _mm_or_si128(_mm_or_si128(wb[0], wb[1]), wb[2]);
+        int outside = _mm_movemask_pd(_mm_castsi128_pd(ora)) |
+                      (_mm_movemask_pd(_mm_castsi128_pd(orb)) << 2);
+        for (int e = 0; e < 3; e++) {
+            wa[e] = _mm_add_epi64(wa[e], step[e]);
+            wb[e] = _mm_add_epi64(wb[e], step[e]);
+        }
+        if (outside == 0xF) continue;
+
+        __m128i bits = _mm_set1_epi32(~outside & 0xF);
+        __m128 covered = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, laneBits), laneBits));
+        __m128 x = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(row.xOffset + i), laneIndex));
+        __m128 z = _mm_add_ps(zRow, _mm_mul_ps(zStep, x));
+        __m128 depth = _mm_loadu_ps(depths + i);
+        __m128 pass = _mm_and_ps(covered, _mm_cmplt_ps(z, depth));
+        if (_mm_movemask_ps(pass) == 0) continue;
+
+        _mm_storeu_ps(depths + i, _mm_blendv_ps(depth, z, pass));
+        if (COLOR) {
+            __m128i* dst = (__m128i*)(colors + i);
+            _mm_storeu_si128(dst, _mm_blendv_epi8(_mm_loadu_si128(dst), color, _mm_castps_si128(pass)));
+        }
+    }
+    rasterRowTail<COLOR>(row, i, colors, depths);
+}
+
+// 8x1 blocks; the row tail runs as a partial block with masked loads and
+// stores, so short rows never drop to the scalar kernel
+template <bool COLOR>
+RENDER_TARGET_AVX2 inline void rasterRowAVX2(const RasterRow& row, Color* colors, float* depths) {
+    __m256i wa[3], wb[3], step[3];
+    for (int e = 0; e < 3; e++) {
+        int64_t w = row.w[e], s = row.stepX[e];
+        wa[e] = _mm256_setr_epi64x(w, w + s, w + 2 * s, w + 3 * s);
+        wb[e] = _mm256_setr_epi64x(w + 4 * s, w + 5 * s, w + 6 * s, w + 7 * s);
+        step[e] = _mm256_set1_epi64x(8 * s);
+    }
+    const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 zRow = _mm256_set1_ps(row.zRow);
+    const __m256 zStep = _mm256_set1_ps(row.zStepX);
+    const __m256i color = _mm256_set1_epi32((int)packColor(row.color));
+
+    for (int i = 0; i < row.count; i += 8) {
+        __m256i ora = _mm256_or_si256(_mm256_or_si256(wa[0], wa[1]), wa[2]);
+        __m256i orb = _mm256_or_si256(_mm256_or_si256(wb[0], wb[1]), wb[2]);
+        int outside = _mm256_movemask_pd(_mm256_castsi256_pd(ora)) |
+                      (_mm256_movemask_pd(_mm256_castsi256_pd(orb)) << 4);
+        for (int e = 0; e < 3; e++) {
+            wa[e] = _mm256_add_epi64(wa[e], step[e]);
+            wb[e] = _mm256_add_epi64(wb[e], step[e]);
+        }
+        if (outside == 0xFF) continue;
+
+        __m256i bits = _mm256_set1_epi32(~outside & 0xFF);
+        __m256i inside = _mm256_cmpeq_epi32(_mm256_and_si256(bits, laneBits), laneBits);
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(_mm256_set1_epi32(row.count - i), laneIndex));
+
+        __m256 x = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(row.xOffset + i), laneIndex));
+        __m256 z = _mm256_add_ps(zRow, _mm256_mul_ps(zStep, x));
+        __m256 depth = _mm256_maskload_ps(depths + i, inside);
+        __m256i pass = _mm256_and_si256(inside, _mm256_castps_si256(_mm256_cmp_ps(z, depth, _CMP_LT_OQ)));
+        if (_mm256_testz_si256(pass, pass)) continue;
+
+        _mm256_maskstore_ps(depths + i, pass, z);
+        if (COLOR) _mm256_maskstore_epi32((int*)(colors + i), pass, color);
+    }
+}
+
+#endif
+
+// Samples of a pixel, as a bit mask, that a triangle whose edge functions
+// are w0, w1 and w2 at the pixel centre covers
+inline unsigned coveredSamples(const SampleOffsets& samples, int64_t w0, int64_t w1, int64_t w2) {
+    if (w0 + samples.wMax[0] < 0 || w1 + samples.wMax[1] < 0 || w2 + samples.wMax[2] < 0) return 0;
+    if (w0 + samples.wMin[0] >= 0 && w1 + samples.wMin[1] >= 0 && w2 + samples.wMin[2] >= 0) {
+        return (1u << samples.count) - 1;
+    }
+    unsigned mask = 0;
+    for (int k = 0; k < samples.count; k++) {
+        if (((w0 + samples.w[0][k]) | (w1 + samples.w[1][k]) | (w2 + samples.w[2][k])) >= 0) mask |= 1u << k;
+    }
+    return mask;
+}
+
+// Depth tests the covered samples of a pixel whose centre depth is z,
+// writing depth, and color unless colors is null, where they pass; returns
+// the mask of those that did. The sample count is a multiple of 4.
+inline unsigned writeSamples(const SampleOffsets& samples, unsigned covered, float z, float* depths, Color* colors,
+                             const Color& color) {
+    unsigned passed = 0;
+#ifdef __SSE2__
+    static_assert(sizeof(Color) == 4, "sample colours are written as 32-bit lanes");
+    const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+    uint32_t bits;
+    std::memcpy(&bits, &color, sizeof(bits));
+    const __m128i fill = _mm_set1_epi32((int)bits);
+    for (int k = 0; k < samples.count; k += 4) {
+        __m128i lanes = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)(covered >> k)), laneBits), laneBits);
+        __m128 zs = _mm_add_ps(_mm_set1_ps(z), _mm_loadu_ps(samples.z + k));
+        __m128 depth = _mm_loadu_ps(depths + k);
+        __m128 pass = _mm_and_ps(_mm_castsi128_ps(lanes), _mm_cmplt_ps(zs, depth));
+        int mask = _mm_movemask_ps(pass);
+        if (mask == 0) continue;
+        passed |= (unsigned)mask << k;
+        _mm_storeu_ps(depths + k, _mm_or_ps(_mm_and_ps(pass, zs), _mm_andnot_ps(pass, depth)));
+        if (colors) {
+            __m128i* dst = (__m128i*)(colors + k);
+            __m128i keep = _mm_castps_si128(pass);
+            _mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(keep, fill), _mm_andnot_si128(keep, _mm_loadu_si128(dst))));
+        }
+    }
+#else
+    for (int k = 0; k < samples.count; k++) {
+        float zs = z + samples.z[k];
+        if ((covered >> k & 1) && zs < depths[k]) {
+            depths[k] = zs;
+            if (colors) colors[k] = color;
+            passed |= 1u << k;
+        }
+    }
+#endif
+    return passed;
+}
+
+// Multisampled kernel: colors and depths hold row.samples->count entries
+// per pixel. Coverage and depth are per sample, the colour per triangle.
+template <bool COLOR>
+inline void rasterRowSamples(const RasterRow& row, Color* colors, float* depths) {
+    const SampleOffsets& samples = *row.samples;
+    int64_t w0 = row.w[0], w1 = row.w[1], w2 = row.w[2];
+    for (int i = 0; i < row.count; i++) {
+        unsigned covered = coveredSamples(samples, w0, w1, w2);
+        if (covered) {
+            float z = row.zRow + row.zStepX * (float)(row.xOffset + i);
+            writeSamples(samples, covered, z, depths + i * samples.count,
+                         COLOR ? colors + i * samples.count : nullptr, row.color);
+        }
+        w0 += row.stepX[0];
+        w1 += row.stepX[1];
+        w2 += row.stepX[2];
+    }
+}
+
+// Averages the S colour samples of each of count pixels into colors, with
+// rounding, and keeps the nearest of their depths
+typedef void (*ResolveRowFn)(const Color* sampleColors, const float* sampleDepths, int count, Color* colors,
+                             float* depths);
+
+template <int S>
+inline void resolveRow(const Color* sampleColors, const float* sampleDepths, int count, Color* colors,
+                       float* depths) {
+    static_assert(S == 4 || S == 8, "resolve handles 4 or 8 samples");
+    const int shift = S == 4 ? 2 : 3;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(S / 2);
+    for (int i = 0; i < count; i++) {
+        // Four colours widen to two sums of pairs, 16 bits per channel
+        __m128i sum = zero;
+        __m128 nearest = _mm_loadu_ps(sampleDepths);
+        for (int k = 0; k < S; k += 4) {
+            __m128i c = _mm_loadu_si128((const __m128i*)(sampleColors + k));
+            sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpackhi_epi8(c, zero)));
+            nearest = _mm_min_ps(nearest, _mm_loadu_ps(sampleDepths + k));
+        }
+        sum = _mm_add_epi16(sum, _mm_unpackhi_epi64(sum, sum));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, round), shift);
+        int bits = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+        std::memcpy(static_cast<void*>(&colors[i]), &bits, sizeof(bits));
+        nearest = _mm_min_ps(nearest, _mm_movehl_ps(nearest, nearest));
+        nearest = _mm_min_ss(nearest, _mm_shuffle_ps(nearest, nearest, 1));
+        depths[i] = _mm_cvtss_f32(nearest);
+        sampleColors += S;
+        sampleDepths += S;
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        int sum[4] = {S / 2, S / 2, S / 2, S / 2};
+        float nearest = sampleDepths[0];
+        for (int k = 0; k < S; k++) {
+            sum[0] += sampleColors[k].r;
+            sum[1] += sampleColors[k].g;
+            sum[2] += sampleColors[k].b;
+            sum[3] += sampleColors[k].a;
+            nearest = std::min(nearest, sampleDepths[k]);
+        }
+        colors[i] = Color((unsigned char)(sum[0] >> shift), (unsigned char)(sum[1] >> shift),
+                          (unsigned char)(sum[2] >> shift), (unsigned char)(sum[3] >> shift));
+        depths[i] = nearest;
+        sampleColors += S;
+        sampleDepths += S;
+    }
+#endif
+}
+
+inline ResolveRowFn selectResolveKernel(int samples) {
+    if (samples == 8) return resolveRow<8>;
+    if (samples == 4) return resolveRow<4>;
+    return nullptr;
+}
+
+// Nearest and farthest depth of a rows x count block of the depth buffer
+inline void depthRange(const float* depths, int stride, int count, int rows, float& nearest, float& farthest) {
+    int i = 0;
+#ifdef __SSE2__
+    if (count >= 4) {
+        __m128 lo = _mm_loadu_ps(depths), hi = lo;
+        for (int y = 0; y < rows; y++) {
+            const float* row = depths + (size_t)y * stride;
+            for (int x = 0; x + 4 <= count; x += 4) {
+                __m128 d = _mm_loadu_ps(row + x);
+                lo = _mm_min_ps(lo, d);
+                hi = _mm_max_ps(hi, d);
+            }
+        }
+        lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+        lo = _mm_min_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+        hi = _mm_max_ps(hi, _mm_movehl_ps(hi, hi));
+        hi = _mm_max_ss(hi, _mm_shuffle_ps(hi, hi, 1));
+        nearest = _mm_cvtss_f32(lo);
+        farthest = _mm_cvtss_f32(hi);
+        i = count & ~3;
+    } else
+#endif
+    {
+        nearest = depths[0];
+        farthest = depths[0];
+    }
+    for (int y = 0; y < rows; y++) {
+        const float* row = depths + (size_t)y * stride;
+        for (int x = i; x < count; x++) {
+            nearest = std::min(nearest, row[x]);
+            farthest = std::max(farthest, row[x]);
+        }
+    }
+}
+
+inline RasterRowFn selectRasterKernel(SimdLevel level, bool depthOnly = false) {
+#ifdef RENDER_SIMD_X86
+    if (level == SimdLevel::AVX2) return depthOnly ? rasterRowAVX2<false> : rasterRowAVX2<true>;
+    if (level == SimdLevel::SSE4) return depthOnly ? rasterRowSSE4<false> : rasterRowSSE4<true>;
+#else
+    (void)level;
+#endif
+    return depthOnly ? rasterRowScalar<false> : rasterRowScalar<true>;
+}
+
+#endif
@@ -0,0 +1,772 @@
+#ifndef RENDERSERVER_H
+#define RENDERSERVER_H
+
+#include "Renderer.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Buffered reads of lines and byte counts from a socket
+class SocketReader {
+private:
+    int fd;
+    char buffer[4096];
+    size_t begin, end;
+    size_t maxLine;
+    bool tooLong;
+
+    bool fill() {
+        ssize_t got;
+        do {
+            got = ::read(fd, buffer, sizeof(buffer));
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) return false;
+        begin = 0;
+        end = (size_t)got;
+        return true;
+    }
+
+public:
+    // Lines longer than maxLine_ bytes end the stream, see lineTooLong
+    explicit SocketReader(int fd_, size_t maxLine_ = std::string::npos)
+        : fd(fd_), begin(0), end(0), maxLine(maxLine_), tooLong(false) {}
+
+    // The next line without its "\n" (or "\r\n"); false at end of stream
+    // or once a line runs past maxLine
+    bool readLine(std::string& line) {
+        line.clear();
+        while (!tooLong) {
+            if (begin == end && !fill()) return false;
+            const char* start = buffer + begin;
+            const char* newline = (const char*)std::memchr(start, '\n', end - begin);
+            size_t count = newline ? newline - start : end - begin;
+            if (line.size() + count > maxLine) {
+                tooLong = true;
+                break;
+            }
+            line.append(start, count);
+            if (newline) {
+                begin += count + 1;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+            begin = end;
+        }
+        line.clear();
+        return false;
+    }
+
+    // True once readLine has given up on a line over maxLine
+    bool lineTooLong() const { return tooLong; }
+
+    bool readBytes(unsigned char* out, size_t size) {
+        while (size > 0) {
+            if (begin == end && !fill()) return false;
+            size_t count = std::min(size, end - begin);
+            std::memcpy(out, buffer + begin, count);
+            begin += count;
+            out += count;
+            size -= count;
+        }
+        return true;
+    }
+};
+
+inline bool writeAll(int fd, const void* data, size_t size) {
+    const char* bytes = (const char*)data;
+    while (size > 0) {
+        ssize_t written = ::write(fd, bytes, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+inline bool writeAll(int fd, const std::string& text) { return writeAll(fd, text.data(), text.size()); }
+
+// A connected stream socket to the Unix domain socket at path, -1 on failure
+inline int connectUnixSocket(const std::string& path) {
+    sockaddr_un address;
+    if (path.size() >= sizeof(address.sun_path)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (connect(fd, (const sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One image to render, parsed from a request line such as
+//   render model="parts dir" size=800x600 camera=px,py,pz,tx,ty,tz fov=45
+//          light=dir,x,y,z[,r,g,b[,intensity]] diffuse=r,g,b msaa=4 smooth=1
+// Lights are dir,dx,dy,dz / point,px,py,pz / spot,px,py,pz,dx,dy,dz, each
+// optionally followed by a colour and an intensity; a request may list
+// several. diffuse, ambient and specular replace that colour in every
+// material, the .mtl ones included (mtl=1, the default), for this request
+// only. Anything left out is what render_engine does by default: the
+// camera frames the model, with main.cpp's two lights and base material.
+struct RenderRequest {
+    std::string model;
+    int width, height, samples;
+    bool smooth, deferred, materials;
+    bool hasCamera;
+    Vec3 position, target;
+    float fov; // degrees
+    std::vector<Light> lights;
+    bool hasDiffuse, hasAmbient, hasSpecular;
+    Color diffuse, ambient, specular;
+
+    RenderRequest()
+        : width(800), height(600), samples(1), smooth(false), deferred(false), materials(true), hasCamera(false),
+          fov(45.0f), hasDiffuse(false), hasAmbient(false), hasSpecular(false) {}
+
+    static bool parseFloats(const std::string& text, std::vector<float>& values) {
+        values.clear();
+        std::istringstream in(text);
+        std::string field;
+        while (std::getline(in, field, ',')) {
+            char* end = nullptr;
+            float value = std::strtof(field.c_str(), &end);
+            if (field.empty() || *end != '\0' || !std::isfinite(value)) return false;
+            values.push_back(value);
+        }
+        return true;
+    }
+
+    static bool parseColor(const std::vector<float>& values, size_t first, Color& color) {
+        if (values.size() < first + 3) return false;
+        unsigned char c[3];
+        for (int i = 0; i < 3; i++) c[i] = (unsigned char)std::max(0.0f, std::min(255.0f, values[first + i]));
+        color = Color(c[0], c[1], c[2]);
+        return true;
+    }
+
+    // Unit vector along v; false for a zero or overflowing one, which has no direction
+    static bool parseDirection(const Vec3& v, Vec3& direction) {
+        float length = v.length();
+        if (!(length > 0) || !std::isfinite(length)) return false;
+        direction = v / length;
+        return true;
+    }
+
+    static bool parseLight(const std::string& text, Light& light) {
+        size_t comma = text.find(',');
+        if (comma == std::string::npos) return false;
+        std::string kind = text.substr(0, comma);
+        std::vector<float> values;
+        if (!parseFloats(text.substr(comma + 1), values)) return false;
+        size_t count;
+        if (kind == "dir") {
+            light.type = 0;
+            count = 3;
+        } else if (kind == "point") {
+            light.type = 1;
+            count = 3;
+        } else if (kind == "spot") {
+            light.type = 2;
+            count = 6;
+        } else {
+            return false;
+        }
+        if (values.size() != count && values.size() != count + 3 && values.size() != count + 4) return false;
+        Vec3 first(values[0], values[1], values[2]);
+        if (light.type == 0) {
+            if (!parseDirection(first, light.direction)) return false;
+        } else {
+            light.position = first;
+        }
+        if (light.type == 2 && !parseDirection(Vec3(values[3], values[4], values[5]), light.direction)) return false;
+        if (values.size() > count) parseColor(values, count, light.color);
+        if (values.size() > count + 3) light.intensity = values[count + 3];
+        return true;
+    }
+
+    // False with a message for anything malformed or out of range
+    bool parse(const std::string& line, std::string& error) {
+        size_t i = 0;
+        auto skipSpaces = [&]() {
+            while (i < line.size() && std::isspace((unsigned char)line[i])) i++;
+        };
+        skipSpaces();
+        size_t wordEnd = line.find_first_of(" \t", i);
+        if (line.compare(i, wordEnd == std::string::npos ? std::string::npos : wordEnd - i, "render") != 0) {
+            error = "expected render";
+            return false;
+        }
+        i = wordEnd == std::string::npos ? line.size() : wordEnd;
+        while (skipSpaces(), i < line.size()) {
+            size_t equals = line.find('=', i);
+            if (equals == std::string::npos) {
+                error = "expected key=value at " + line.substr(i);
+                return false;
+            }
+            std::string key = line.substr(i, equals - i), value;
+            i = equals + 1;
+            if (i < line.size() && line[i] == '"') {
+                size_t quote = line.find('"', i + 1);
+                if (quote == std::string::npos) {
+                    error = "unterminated quote";
+                    return false;
+                }
+                value = line.substr(i + 1, quote - i - 1);
+                i = quote + 1;
+            } else {
+                size_t space = line.find_first_of(" \t", i);
+                if (space == std::string::npos) space = line.size();
+                value = line.substr(i, space - i);
+                i = space;
+            }
+            if (!set(key, value)) {
+                error = "bad value for " + key + ": " + value;
+                return false;
+            }
+        }
+        if (model.empty()) {
+            error = "no model";
+            return false;
+        }
+        if (deferred && samples > 1) {
+            error = "msaa does not apply to deferred";
+            return false;
+        }
+        return true;
+    }
+
+    bool set(const std::string& key, const std::string& value) {
+        std::vector<float> values;
+        if (key == "model") {
+            model = value;
+            return !model.empty();
+        } else if (key == "size") {
+            char* end = nullptr;
+            long w = std::strtol(value.c_str(), &end, 10);
+            if (*end != 'x') return false;
+            long h = std::strtol(end + 1, &end, 10);
+            if (*end != '\0' || w < 1 || h < 1 || w > 8192 || h > 8192) return false;
+            width = (int)w;
+            height = (int)h;
+            return true;
+        } else if (key == "msaa") {
+            samples = std::atoi(value.c_str());
+            return samples == 1 || samples == 4 || samples == 8;
+        } else if (key == "smooth" || key == "deferred" || key == "mtl") {
+            if (value != "0" && value != "1") return false;
+            (key == "smooth" ? smooth : key == "deferred" ? deferred : materials) = value == "1";
+            return true;
+        } else if (key == "camera") {
+            if (!parseFloats(value, values) || values.size() != 6) return false;
+            hasCamera = true;
+            position = Vec3(values[0], values[1], values[2]);
+            target = Vec3(values[3], values[4], values[5]);
+            Vec3 forward;
+            return parseDirection(target - position, forward);
+        } else if (key == "fov") {
+            if (!parseFloats(value, values) || values.size() != 1) return false;
+            fov = values[0];
+            return fov > 0 && fov < 180;
+        } else if (key == "light") {
+            Light light;
+            if (!parseLight(value, light)) return false;
+            lights.push_back(light);
+            return true;
+        } else if (key == "diffuse" || key == "ambient" || key == "specular") {
+            Color color;
+            if (!parseFloats(value, values) || values.size() != 3 || !parseColor(values, 0, color)) return false;
+            if (key == "diffuse") {
+                hasDiffuse = true;
+                diffuse = color;
+            } else if (key == "ambient") {
+                hasAmbient = true;
+                ambient = color;
+            } else {
+                hasSpecular = true;
+                specular = color;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // The same text for requests that render the same image, however the
+    // line was written; coalescing compares these
+    std::string key() const {
+        std::ostringstream out;
+        out << std::setprecision(9) << model << '\n' << width << 'x' << height << ' ' << samples << smooth
+            << deferred << materials << ' ' << fov;
+        if (hasCamera) {
+            out << " camera " << position.x << ',' << position.y << ',' << position.z << ',' << target.x << ','
+                << target.y << ',' << target.z;
+        }
+        for (const Light& light : lights) {
+            out << " light " << light.type << ',' << light.position.x << ',' << light.position.y << ','
+                << light.position.z << ',' << light.direction.x << ',' << light.direction.y << ','
+                << light.direction.z << ',' << (int)light.color.r << ',' << (int)light.color.g << ','
+                << (int)light.color.b << ',' << light.intensity;
+        }
+        if (hasDiffuse) out << " diffuse " << (int)diffuse.r << ',' << (int)diffuse.g << ',' << (int)diffuse.b;
+        if (hasAmbient) out << " ambient " << (int)ambient.r << ',' << (int)ambient.g << ',' << (int)ambient.b;
+        if (hasSpecular) out << " specular " << (int)specular.r << ',' << (int)specular.g << ',' << (int)specular.b;
+        return out.str();
+    }
+};
+
+// Loaded models by path, with normals generated and the bounds the default
+// camera is framed by. Holds up to capacity models, dropping the least
+// recently used; models still being rendered stay alive until released.
+class ModelCache {
+public:
+    struct Entry {
+        std::mutex loading;
+        bool loaded;
+        Model model;
+        Vec3 center;
+        float maxDim, radius;
+        uint64_t lastUse;
+
+        Entry() : loaded(false), maxDim(0), radius(0), lastUse(0) {}
+    };
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<Entry> > entries;
+    size_t capacity;
+    uint64_t clock;
+    size_t loads;
+
+public:
+    explicit ModelCache(size_t capacity_ = 8) : capacity(std::max<size_t>(1, capacity_)), clock(0), loads(0) {}
+
+    // The model at path, loaded through loader (file, directory of parts,
+    // mesh cache) on first use; requests for a model being loaded wait for
+    // that load. Null with a message if it cannot be read.
+    std::shared_ptr<const Entry> get(const std::string& path, Renderer& loader, std::string& error) {
+        std::shared_ptr<Entry> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<Entry>& slot = entries[path];
+            if (!slot) slot = std::make_shared<Entry>();
+            slot->lastUse = ++clock;
+            entry = slot;
+            if (entries.size() > capacity) {
+                auto oldest = entries.end();
+                for (auto it = entries.begin(); it != entries.end(); ++it) {
+                    if (it->second != entry && (oldest == entries.end() || it->second->lastUse < oldest->second->lastUse)) {
+                        oldest = it;
+                    }
+                }
+                entries.erase(oldest);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(entry->loading);
+        if (entry->loaded) return entry;
+        if (!loader.loadOBJFiles(std::vector<std::string>(1, path), entry->model) || entry->model.getVertices().empty()) {
+            error = "cannot load " + path;
+            std::lock_guard<std::mutex> cacheLock(mutex);
+            auto it = entries.find(path);
+            if (it != entries.end() && it->second == entry) entries.erase(it);
+            return nullptr;
+        }
+        entry->model.generateNormals();
+        Vec3 minBounds, maxBounds;
+        entry->model.getBounds(minBounds, maxBounds);
+        Vec3 size = maxBounds - minBounds;
+        entry->center = (minBounds + maxBounds) * 0.5f;
+        entry->maxDim = std::max({size.x, size.y, size.z});
+        entry->radius = size.length() * 0.5f;
+        entry->loaded = true;
+        std::lock_guard<std::mutex> cacheLock(mutex);
+        loads++;
+        return entry;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    size_t getLoadCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return loads;
+    }
+};
+
+// Serves render requests over a Unix domain socket, keeping models loaded
+// between them. Each connection sends request lines and gets back, for each
+// in order, "OK <bytes>\n" and a binary PPM, "BUSY\n" when the queue is
+// full, or "ERROR <message>\n". "stats" returns one line of counters. A
+// line over MAX_REQUEST_LINE bytes gets "ERROR line too long\n" and the
+// connection is closed.
+//
+// Requests are rendered by a fixed set of workers, each with a Renderer
+// (and thread pool) of its own. A request for an image already queued or
+// being rendered waits for that render instead of queueing another, and
+// at most maxQueue distinct images wait for a worker; beyond that requests
+// are turned away at once rather than piling up latency.
+class RenderServer {
+private:
+    // Longest request line; a client going past it gets an error and is
+    // disconnected instead of growing the line without end
+    static const size_t MAX_REQUEST_LINE = 4096;
+
+    struct Ticket {
+        RenderRequest request;
+        std::string key;
+        bool done;
+        std::string error;
+        std::shared_ptr<const std::vector<unsigned char> > image;
+
+        Ticket() : done(false) {}
+    };
+
+    // A client's thread; done once it has closed fd and may be joined
+    struct Connection {
+        std::thread thread;
+        int fd;
+        bool done;
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::unique_ptr<Renderer> renderer;
+        std::shared_ptr<const ModelCache::Entry> scene; // the model its BVH and shadow maps are for
+    };
+
+    std::string socketPath;
+    int listenFd;
+    int threadsPerWorker;
+    size_t maxQueue;
+    ModelCache models;
+
+    std::mutex mutex;
+    std::condition_variable queued, finished;
+    std::deque<std::shared_ptr<Ticket> > queue;
+    std::map<std::string, std::shared_ptr<Ticket> > inflight; // queued or rendering, by key
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::list<Connection> connections;
+    bool stopping;
+    size_t requests, rendered, coalesced, rejected, failed;
+
+    RenderServer(const RenderServer&);
+    RenderServer& operator=(const RenderServer&);
+
+    // Joins an image already on its way, queues a new one, or returns null
+    // when the queue is full
+    std::shared_ptr<Ticket> admit(const RenderRequest& request) {
+        std::string key = request.key();
+        std::lock_guard<std::mutex> lock(mutex);
+        requests++;
+        auto it = inflight.find(key);
+        if (it != inflight.end()) {
+            coalesced++;
+            return it->second;
+        }
+        if (queue.size() >= maxQueue) {
+            rejected++;
+            return nullptr;
+        }
+        std::shared_ptr<Ticket> ticket = std::make_shared<Ticket>();
+        ticket->request = request;
+        ticket->key = key;
+        inflight[key] = ticket;
+        queue.push_back(ticket);
+        queued.notify_one();
+        return ticket;
+    }
+
+    std::string stats() {
+        std::ostringstream out;
+        size_t modelCount = models.size(), loadCount = models.getLoadCount();
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "STATS requests=" << requests << " rendered=" << rendered << " coalesced=" << coalesced
+            << " rejected=" << rejected << " failed=" << failed << " queued=" << queue.size()
+            << " models=" << modelCount << " loads=" << loadCount << "\n";
+        return out.str();
+    }
+
+    // Sets the renderer up the way main.cpp does, then applies the request
+    bool render(Worker& worker, const RenderRequest& request, std::vector<unsigned char>& image, std::string& error) {
+        Renderer* renderer = worker.renderer.get();
+        if (!renderer || renderer->width != request.width || renderer->height != request.height ||
+            renderer->framebuffer.getSampleCount() != request.samples) {
+            worker.scene.reset();
+            worker.renderer.reset(new Renderer(request.width, request.height, threadsPerWorker));
+            renderer = worker.renderer.get();
+            renderer->verbose = false;
+            renderer->framebuffer.setSampleCount(request.samples);
+        }
+
+        std::shared_ptr<const ModelCache::Entry> entry = models.get(request.model, *renderer, error);
+        if (!entry) return false;
+        const Model& model = entry->model;
+        Shader& shader = renderer->shader;
+        shader.modelMatrix = Matrix4x4();
+        shader.enableShadows = true;
+        shader.enableAO = true;
+        shader.aoRadius = entry->maxDim * 0.05f;
+        if (entry != worker.scene) {
+            renderer->buildScene(model);
+            renderer->invalidateShadowMaps();
+            worker.scene = entry;
+        }
+
+        // Libraries are read once per renderer with main.cpp's base
+        // material, so the request's colours go on top of what they resolve
+        // to; otherwise the first request would decide every later image
+        Material base;
+        base.diffuse = Color(150, 150, 200);
+        base.specular = Color(255, 255, 255);
+        base.ambient = Color(30, 30, 50);
+        shader.material = base;
+        shader.materials.clear();
+        if (request.materials) renderer->loadMaterials(model);
+        auto applyColors = [&](Material& material) {
+            if (request.hasDiffuse) material.diffuse = request.diffuse;
+            if (request.hasSpecular) material.specular = request.specular;
+            if (request.hasAmbient) material.ambient = request.ambient;
+        };
+        applyColors(shader.material);
+        for (Material& material : shader.materials) applyColors(material);
+
+        shader.lights = request.lights;
+        if (shader.lights.empty()) {
+            Light directional;
+            directional.type = 0;
+            directional.direction = Vec3(-1, -1, -1).normalize();
+            shader.lights.push_back(directional);
+            Light point;
+            point.type = 1;
+            point.position = Vec3(200, 200, 200);
+            point.color = Color(255, 200, 150);
+            point.intensity = 0.8f;
+            shader.lights.push_back(point);
+        }
+
+        float fov = request.fov * 3.14159f / 180.0f;
+        CameraSpec camera(entry->center + Vec3(entry->maxDim * 0.8f, entry->maxDim * 0.3f, entry->maxDim * 1.2f),
+                          entry->center, fov);
+        if (request.hasCamera) camera = CameraSpec(request.position, request.target, fov);
+        camera.near = entry->maxDim * 0.01f;
+        camera.fitFar(entry->center, entry->radius);
+        renderer->setCamera(camera);
+
+        renderer->deferred = request.deferred;
+        renderer->smoothShading = request.smooth;
+        renderer->framebuffer.clear(Color(20, 30, 50));
+        renderer->renderModel(model);
+        Framebuffer::encodePPM(renderer->framebuffer.getColorRow(0), request.width, request.height, image);
+        return true;
+    }
+
+    void workerLoop(Worker& worker) {
+        while (true) {
+            std::shared_ptr<Ticket> ticket;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping) return;
+                ticket = queue.front();
+                queue.pop_front();
+            }
+            std::shared_ptr<std::vector<unsigned char> > image = std::make_shared<std::vector<unsigned char> >();
+            std::string error;
+            bool ok = render(worker, ticket->request, *image, error);
+            std::lock_guard<std::mutex> lock(mutex);
+            inflight.erase(ticket->key);
+            if (ok) {
+                ticket->image = image;
+                rendered++;
+            } else {
+                ticket->error = error;
+                failed++;
+            }
+            ticket->done = true;
+            finished.notify_all();
+        }
+    }
+
+    void serveConnection(Connection& connection) {
+        int fd = connection.fd;
+        SocketReader reader(fd, MAX_REQUEST_LINE);
+        std::string line;
+        while (reader.readLine(line)) {
+            if (line.find_first_not_of(" \t") == std::string::npos) continue;
+            if (line == "stats") {
+                if (!writeAll(fd, stats())) break;
+                continue;
+            }
+            RenderRequest request;
+            std::string error;
+            if (!request.parse(line, error)) {
+                if (!writeAll(fd, "ERROR " + error + "\n")) break;
+                continue;
+            }
+            std::shared_ptr<Ticket> ticket = admit(request);
+            if (!ticket) {
+                if (!writeAll(fd, "BUSY\n")) break;
+                continue;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return ticket->done || stopping; });
+                if (!ticket->done) break;
+            }
+            if (!ticket->image) {
+                if (!writeAll(fd, "ERROR " + ticket->error + "\n")) break;
+                continue;
+            }
+            const std::vector<unsigned char>& image = *ticket->image;
+            if (!writeAll(fd, "OK " + std::to_string(image.size()) + "\n") || !writeAll(fd, image.data(), image.size())) {
+                break;
+            }
+        }
+        if (reader.lineTooLong()) writeAll(fd, std::string("ERROR line too long\n"));
+        std::lock_guard<std::mutex> lock(mutex);
+        close(fd);
+        connection.done = true;
+    }
+
+public:
+    // threads is the total across workers, <= 0 for every hardware thread
+    RenderServer(const std::string& socketPath_, int workerCount = 1, int threads = 0, int maxQueue_ = 16,
+                 size_t maxModels = 8)
+        : socketPath(socketPath_), listenFd(-1), maxQueue(std::max(1, maxQueue_)), models(maxModels),
+          stopping(false), requests(0), rendered(0), coalesced(0), rejected(0), failed(0) {
+        workerCount = std::max(1, workerCount);
+        if (threads <= 0) threads = ThreadPool::defaultThreadCount();
+        threadsPerWorker = std::max(1, threads / workerCount);
+        for (int i = 0; i < workerCount; i++) workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+
+    ~RenderServer() {
+        stop();
+        for (std::unique_ptr<Worker>& worker : workers) {
+            if (worker->thread.joinable()) worker->thread.join();
+        }
+        if (listenFd >= 0) {
+            close(listenFd);
+            unlink(socketPath.c_str());
+        }
+    }
+
+    // Binds the socket, replacing a stale one at the path, and starts the
+    // workers. False if the socket cannot be created.
+    bool start() {
+        sockaddr_un address;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Error: Socket path too long: " << socketPath << std::endl;
+            return false;
+        }
+        // A client that hangs up mid-image must not end the server
+        signal(SIGPIPE, SIG_IGN);
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0) {
+            std::cerr << "Error: Cannot create socket: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        unlink(socketPath.c_str());
+        if (bind(listenFd, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 64) != 0) {
+            std::cerr << "Error: Cannot listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        for (std::unique_ptr<Worker>& worker : workers) {
+            Worker* w = worker.get();
+            w->thread = std::thread([this, w] { workerLoop(*w); });
+        }
+        return true;
+    }
+
+    // Accepts connections, one thread each, until stop()
+    void serve() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                if (fd >= 0) close(fd);
+                break;
+            }
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                std::cerr << "Error: accept failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            reapConnections();
+            connections.push_back(Connection());
+            Connection& connection = connections.back();
+            connection.fd = fd;
+            connection.done = false;
+            connection.thread = std::thread([this, &connection] { serveConnection(connection); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Connection& connection : connections) {
+                if (!connection.done) shutdown(connection.fd, SHUT_RDWR);
+            }
+        }
+        for (Connection& connection : connections) connection.thread.join();
+        connections.clear();
+    }
+
+    // Joins the threads of clients that have gone; called with mutex held,
+    // which a finished thread no longer needs
+    void reapConnections() {
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Makes serve() return; callable from any thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+            stopping = true;
+            queued.notify_all();
+            finished.notify_all();
+        }
+        // Wakes accept, which then sees stopping
+        if (listenFd >= 0) {
+            int fd = connectUnixSocket(socketPath);
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    int getWorkerCount() const { return (int)workers.size(); }
+    int getThreadsPerWorker() const { return threadsPerWorker; }
+};
+
+#endif
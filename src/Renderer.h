@@ -3,91 +3,836 @@
 
 #include "Framebuffer.h"
 #include "Model.h"
+#include "MeshCache.h"
 #include "Shader.h"
 #include "Matrix4x4.h"
+#include "ThreadPool.h"
+#include "ImageWriter.h"
+#include "Clipper.h"
+#include "Frustum.h"
+#include "BVH.h"
+#include "ShadowMap.h"
+#include "SSAO.h"
+#include "GBuffer.h"
+#include "Varyings.h"
+#include "MaterialLibrary.h"
+#include "Camera.h"
+#include "FrameArena.h"
+#include "VertexKernels.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+
+// Output of the geometry pass: a shaded triangle in screen space
+struct ScreenTriangle {
+    Vec3 v[3];
+    Color color;
+};
+
+// Faces of a geometry pass block waiting to be flat shaded together: the
+// vertex each is shaded from, its material id and the first of its screen
+// triangles
+struct ShadeQueue {
+    std::vector<Vec3> positions, normals;
+    std::vector<uint16_t> materials;
+    std::vector<int> firstTriangle;
+
+    void clear() {
+        positions.clear();
+        normals.clear();
+        materials.clear();
+        firstTriangle.clear();
+    }
+
+    void push(const Vertex& vertex, uint16_t material, int triangle) {
+        positions.push_back(vertex.worldPos);
+        normals.push_back(vertex.normal);
+        materials.push_back(material);
+        firstTriangle.push_back(triangle);
+    }
+};
 
 class Renderer {
 public:
     int width, height;
     Framebuffer framebuffer;
     Shader shader;
+    int tileSize;
+    float guardBand;   // x/y clip planes at +-guardBand * w, in NDC units
+    bool useMeshCache; // load through .rmesh files next to the sources
+    bool binaryPPM;    // P6 output; false writes ASCII P3
+    bool frustumCulling;   // skip parts whose bounds are outside the view
+    bool occlusionCulling; // draw parts front to back, skipping hidden ones
+    int shadowMapSize;     // per directional/spot light; 0 leaves shadows to rays
+    bool deferred;         // rasterize into a G-buffer and light each visible pixel once
+    bool smoothShading;    // forward: shade every fragment from interpolated normals
+    bool verbose;          // print each frame's statistics
+
+    TextureCache textures; // images the materials' maps point into
+    MaterialLibrary materialLibrary;
+
+    // Called with [y0, y1) whenever renderModel has finished a band of rows
+    std::function<void(int, int)> onRowsComplete;
+
+private:
+    // Faces per geometry pass work item, and per occlusion culling batch
+    static const int BLOCK_SIZE = 4096;
+    static const int OCCLUSION_BATCH_FACES = 16384;
 
-    Renderer(int w, int h) : width(w), height(h), framebuffer(w, h) {}
+    std::unique_ptr<ThreadPool> pool;
+    BVH scene;
+    std::vector<std::unique_ptr<ShadowMap> > shadowMaps;
+    // What the shadow maps were drawn for. They depend on the model and the
+    // lights but not on the camera, so other views of the scene reuse them.
+    const Model* shadowModel;
+    Matrix4x4 shadowModelMatrix;
+    std::vector<Light> shadowLights;
+    int shadowSize;
+    SSAO ssao;
+    GBuffer gbuffer;
+    const uint16_t* faceMaterials;       // of the model being drawn, null if it has none
+    bool texturedFrame;                  // some material has maps
+    Matrix4x4 inverseViewProjection;     // NDC to world space
+    std::vector<VaryingPlanes<SurfaceVaryings> > facePlanes; // for smooth shading
+    std::vector<VaryingPlanes<TexturedVaryings> > texturedFacePlanes; // the same for textured materials
+    std::vector<VaryingPlanes<NormalVaryings> > normalFacePlanes;     // for the G-buffer resolve
+    std::vector<Vec4> faceTangents;
+    TransformedVertices transformed;
+    VertexKernelFn transformVertices;    // the vertex pass, for the CPU's SIMD level
+    std::vector<std::vector<ScreenTriangle> > blockTriangles;
+    std::vector<ShadeQueue> blockQueues;
+    std::vector<ScreenTriangle> triangles;
+    std::vector<std::vector<int> > tileBins;
+    std::unique_ptr<std::atomic<int>[]> tilesLeftInRow;
+    int tileRows;                        // tilesLeftInRow's length
+    FrameArena frameArena;               // lists renderModel rebuilds every frame
+    std::unique_ptr<PPMStreamWriter> stream;
+    std::string streamName;
+    std::atomic<bool> streamFailed; // a band failed to write; later ones are skipped
+    bool rowsStreamed;
+    size_t lastShadedFragments;
+
+public:
+    // threads <= 0 uses every hardware thread
+    Renderer(int w, int h, int threads = 0)
+        : width(w), height(h), framebuffer(w, h), tileSize(64), guardBand(8.0f), useMeshCache(true),
+          binaryPPM(true), frustumCulling(true), occlusionCulling(false), shadowMapSize(1024), deferred(false),
+          smoothShading(false), verbose(true), pool(new ThreadPool(threads)), shadowModel(nullptr), shadowSize(0),
+          faceMaterials(nullptr), texturedFrame(false),
+          transformVertices(selectVertexKernel(detectSimdLevel())), tileRows(0), streamFailed(false), rowsStreamed(false), lastShadedFragments(0) {}
+
+    void setThreadCount(int threads) { pool.reset(new ThreadPool(threads)); }
+    int getThreadCount() const { return pool->getThreadCount(); }
+    ThreadPool& getThreadPool() { return *pool; }
+    // Fragments smooth shading shaded in the last renderModel
+    size_t getShadedFragments() const { return lastShadedFragments; }
 
     bool loadOBJ(const std::string& filename, Model& model) {
-        return model.loadOBJ(filename);
+        return model.loadOBJ(filename, pool.get());
+    }
+
+    // Loads files and directories of .obj parts into one model on the render
+    // threads, going through the .rmesh cache unless it is disabled
+    bool loadOBJFiles(const std::vector<std::string>& paths, Model& model) {
+        std::vector<std::string> filenames;
+        for (const std::string& path : paths) {
+            if (Model::isDirectory(path)) {
+                if (!Model::listOBJFiles(path, filenames)) {
+                    std::cerr << "Error: Cannot read directory " << path << std::endl;
+                    return false;
+                }
+            } else {
+                filenames.push_back(path);
+            }
+        }
+        if (filenames.empty()) {
+            std::cerr << "Error: No .obj files to load" << std::endl;
+            return false;
+        }
+        if (useMeshCache) return MeshCache::loadOBJFiles(filenames, model, pool.get());
+        return model.loadOBJFiles(filenames, pool.get());
+    }
+
+    // Builds the world-space BVH that shadow and AO rays are traced
+    // against; call again after changing the model or its modelMatrix
+    void buildScene(const Model& model) {
+        auto start = std::chrono::steady_clock::now();
+        const auto& vertices = model.getVertices();
+        const auto& indices = model.getIndices();
+        int faceCount = (int)model.getTriangleCount();
+        std::vector<Vec3> corners(indices.size());
+        pool->parallelForRange(faceCount, 4096, [&](int begin, int end) {
+            for (size_t c = (size_t)begin * 3; c < (size_t)end * 3; c++) {
+                corners[c] = shader.modelMatrix.transform(vertices.position(indices[c]));
+            }
+        });
+        scene.build(corners.data(), faceCount, pool.get());
+        shader.scene = scene.empty() ? nullptr : &scene;
+        if (scene.empty()) return;
+
+        // Rays leave surfaces a little above them, relative to the scene size
+        const BVHNode& root = scene.getRoot();
+        shader.rayBias = (root.boundsMax - root.boundsMin).length() * 1e-4f;
+        if (!verbose) return;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Scene BVH: " << scene.getNodeCount() << " nodes over " << scene.getTriangleCount()
+                  << " triangles (" << seconds * 1000.0 << " ms)" << std::endl;
+    }
+
+    // Draws a depth-only shadow map for each directional and spot light,
+    // fitted to the model's world-space bounding sphere, unless the maps
+    // were last drawn for the same model, model matrix and lights
+    void renderShadowMaps(const Model& model) {
+        if (shadowModel == &model && shadowSize == shadowMapSize && sameShadowInputs()) return;
+        auto start = std::chrono::steady_clock::now();
+        shadowModel = nullptr;
+        shader.shadowMaps.assign(shader.lights.size(), nullptr);
+        if (shadowMapSize <= 0 || model.getVertices().empty()) return;
+
+        Vec3 lo = model.getVertices().position(0), hi = lo;
+        for (const ModelPart& part : model.getParts()) {
+            lo = Vec3(std::min(lo.x, part.boundsMin.x), std::min(lo.y, part.boundsMin.y), std::min(lo.z, part.boundsMin.z));
+            hi = Vec3(std::max(hi.x, part.boundsMax.x), std::max(hi.y, part.boundsMax.y), std::max(hi.z, part.boundsMax.z));
+        }
+        Vec3 center = shader.modelMatrix.transform((lo + hi) * 0.5f);
+        float radius = 0;
+        for (int i = 0; i < 8; i++) {
+            Vec3 corner(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+            radius = std::max(radius, (shader.modelMatrix.transform(corner) - center).length());
+        }
+
+        int drawn = 0;
+        for (size_t l = 0; l < shader.lights.size(); l++) {
+            const Light& light = shader.lights[l];
+            if (light.type != 0 && light.type != 2) continue;
+            if (shadowMaps.size() <= l) shadowMaps.resize(l + 1);
+            if (!shadowMaps[l] || shadowMaps[l]->getSize() != shadowMapSize) {
+                shadowMaps[l].reset(new ShadowMap(shadowMapSize));
+            }
+            ShadowMap& map = *shadowMaps[l];
+            if (light.type == 0) map.setDirectional(light.direction, center, radius);
+            else map.setSpot(light.position, light.direction, center, radius);
+            map.render(model, shader.modelMatrix, pool.get());
+            if (!drawn++) shader.lightSpaceMatrix = map.lightSpaceMatrix;
+            shader.shadowMaps[l] = &map;
+        }
+        shadowModel = &model;
+        shadowModelMatrix = shader.modelMatrix;
+        shadowLights = shader.lights;
+        shadowSize = shadowMapSize;
+        if (!drawn || !verbose) return;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Shadow maps: " << drawn << " of " << shader.lights.size() << " lights, " << shadowMapSize
+                  << "x" << shadowMapSize << " (" << seconds * 1000.0 << " ms)" << std::endl;
+    }
+
+    // Makes the next renderShadowMaps redraw, for a model changed in place
+    void invalidateShadowMaps() { shadowModel = nullptr; }
+
+    bool sameShadowInputs() const {
+        if (!std::equal(&shadowModelMatrix.m[0][0], &shadowModelMatrix.m[0][0] + 16, &shader.modelMatrix.m[0][0]) ||
+            shadowLights.size() != shader.lights.size()) {
+            return false;
+        }
+        for (size_t l = 0; l < shadowLights.size(); l++) {
+            const Light& a = shadowLights[l];
+            const Light& b = shader.lights[l];
+            if (a.type != b.type || a.position.x != b.position.x || a.position.y != b.position.y ||
+                a.position.z != b.position.z || a.direction.x != b.direction.x || a.direction.y != b.direction.y ||
+                a.direction.z != b.direction.z) {
+                return false;
+            }
+        }
+        return true;
     }
 
     void renderModel(const Model& model) {
+        if (shader.enableShadows) renderShadowMaps(model);
+        // Rows are final only after the passes over the finished frame
+        bool postPass = deferred || (shader.enableAO && !shader.rayTracedAO);
+
         const auto& vertices = model.getVertices();
-        const auto& faces = model.getFaces();
-        
-        int trianglesRendered = 0;
-        
-        for (const auto& face : faces) {
-            Vec3 worldVerts[3];
-            Vec3 normals[3] = {Vec3(0,0,1), Vec3(0,0,1), Vec3(0,0,1)};
-            Vec2 texCoords[3] = {Vec2(0,0), Vec2(0,0), Vec2(0,0)};
-            Vertex shaderVerts[3];
-            Vec3 screenVerts[3];
-
-            // Get vertex data and run vertex shader
-            bool clipped = false;
-            for (int i = 0; i < 3; ++i) {
-                worldVerts[i] = model.getVertex(face.v[i]);
-                if (face.vn[i] >= 0) normals[i] = model.getNormal(face.vn[i]);
-                if (face.vt[i] >= 0) texCoords[i] = model.getTexCoord(face.vt[i]);
-
-                shaderVerts[i] = shader.vertexShader(worldVerts[i], normals[i], texCoords[i]);
-                
-                // Clip test - if any vertex is too far behind or in front, skip triangle
-                if (shaderVerts[i].position.z < -1.0f || shaderVerts[i].position.z > 1.0f) {
-                    clipped = true;
-                    break;
+        const auto& indices = model.getIndices();
+        const auto& parts = model.getParts();
+        const auto& partVertices = model.getPartVertices();
+        int vertexCount = (int)vertices.size();
+        int faceCount = (int)model.getTriangleCount();
+        transformed.resize(vertexCount);
+        const auto& materialIds = model.getFaceMaterials();
+        faceMaterials = materialIds.size() == (size_t)faceCount ? materialIds.data() : nullptr;
+        texturedFrame = shader.material.isTextured();
+        for (const Material& material : shader.materials) texturedFrame = texturedFrame || material.isTextured();
+        if (smoothShading && !deferred) {
+            if (texturedFrame) {
+                texturedFacePlanes.resize(faceCount);
+                faceTangents.resize(faceCount);
+            } else {
+                facePlanes.resize(faceCount);
+            }
+        }
+        if (deferred) normalFacePlanes.resize(faceCount);
+
+        // Per-frame lists come from the arena, which keeps its memory
+        frameArena.reset();
+        ArenaAllocator<int> ints(frameArena);
+        ArenaAllocator<VertexRange> ranges(frameArena);
+
+        // Whole parts outside the view volume are dropped before any of their
+        // vertices are shaded. A model without parts is drawn as one.
+        ArenaVector<int> visible(ints);
+        visible.reserve(parts.size());
+        Frustum frustum(shader.mvpMatrix);
+        for (int p = 0; p < (int)parts.size(); p++) {
+            const ModelPart& part = parts[p];
+            if (!frustumCulling || (frustum.intersectsSphere(part.center, part.radius) &&
+                                    frustum.intersectsBox(part.boundsMin, part.boundsMax))) {
+                visible.push_back(p);
+            }
+        }
+        int outsideParts = (int)(parts.size() - visible.size());
+
+        // Batch b draws visible[batchStarts[b]] .. visible[batchStarts[b + 1] - 1].
+        // Occlusion culling draws near parts first and tests each later
+        // batch against the coarse depth of what is already on screen.
+        ArenaVector<int> batchStarts(ints);
+        batchStarts.reserve(parts.size() + 2);
+        batchStarts.push_back(0);
+        if (parts.empty() && faceCount > 0) {
+            visible.push_back(-1);
+            batchStarts.push_back(1);
+        } else if (occlusionCulling) {
+            ArenaVector<float> nearest(parts.size(), 0.0f, ArenaAllocator<float>(frameArena));
+            for (int p : visible) {
+                nearest[p] = shader.mvpMatrix.transform4(parts[p].center).w - parts[p].radius;
+            }
+            // Ties keep part order, as a stable sort would
+            std::sort(visible.begin(), visible.end(),
+                      [&](int a, int b) { return nearest[a] < nearest[b] || (nearest[a] == nearest[b] && a < b); });
+            int batchFaces = 0;
+            for (int i = 0; i < (int)visible.size(); i++) {
+                if (i > 0 && batchFaces >= OCCLUSION_BATCH_FACES) {
+                    batchStarts.push_back(i);
+                    batchFaces = 0;
                 }
-                
-                // Convert to screen coordinates but keep depth
-                screenVerts[i].x = (shaderVerts[i].position.x + 1.0f) * width * 0.5f;
-                screenVerts[i].y = (shaderVerts[i].position.y + 1.0f) * height * 0.5f;
-                screenVerts[i].z = shaderVerts[i].position.z; // Keep NDC depth for z-buffer
-            }
-            
-            if (clipped) continue;
-
-            // Back-face culling in world space using face normals
-            Vec3 worldEdge1 = worldVerts[1] - worldVerts[0];
-            Vec3 worldEdge2 = worldVerts[2] - worldVerts[0];
-            Vec3 faceNormal = worldEdge1.cross(worldEdge2);
-            Vec3 viewDir = shader.cameraPos - worldVerts[0];
-            
-            if (faceNormal.dot(viewDir) > 0) { // Front-facing triangle
-                // Check if any part of triangle is on screen
-                bool onScreen = false;
+                batchFaces += parts[visible[i]].faceCount;
+            }
+            if (!visible.empty()) batchStarts.push_back((int)visible.size());
+        } else {
+            batchStarts.push_back((int)visible.size());
+        }
+        int batchCount = (int)batchStarts.size() - 1;
+
+        int occludedParts = 0, shadedVertices = 0, drawnFaces = 0;
+        size_t renderedTriangles = 0, shadedFragments = 0;
+        double vertexSeconds = 0;
+        for (int b = 0; b < batchCount; b++) {
+            ArenaVector<int> drawn(ints);
+            drawn.reserve(batchStarts[b + 1] - batchStarts[b]);
+            for (int i = batchStarts[b]; i < batchStarts[b + 1]; i++) {
+                int p = visible[i];
+                if (b > 0 && isPartOccluded(parts[p])) {
+                    occludedParts++;
+                } else {
+                    drawn.push_back(p);
+                }
+            }
+
+            // Spans of faces and welded vertices the batch touches
+            ArenaVector<VertexRange> faceRanges(ranges), vertexRanges(ranges);
+            faceRanges.reserve(drawn.size());
+            vertexRanges.reserve(drawn.size());
+            for (int p : drawn) {
+                if (p < 0) {
+                    faceRanges.push_back(VertexRange{0, faceCount});
+                    vertexRanges.push_back(VertexRange{0, vertexCount});
+                } else {
+                    faceRanges.push_back(VertexRange{parts[p].firstFace, parts[p].firstFace + parts[p].faceCount});
+                    vertexRanges.push_back(partVertices[p]);
+                }
+            }
+
+            // Vertex pass: each welded vertex is shaded once, not once per
+            // face, streaming its components several vertices at a time
+            auto vertexStart = std::chrono::steady_clock::now();
+            ArenaVector<VertexRange> vertexBlocks(ranges);
+            mergeRanges(vertexRanges);
+            splitRanges(vertexRanges, 4096, vertexBlocks);
+            pool->parallelFor((int)vertexBlocks.size(), [&](int block) {
+                transformVertices(vertices, shader.modelMatrix, shader.mvpMatrix, vertexBlocks[block].first,
+                                  vertexBlocks[block].end, transformed);
+            });
+            vertexSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - vertexStart).count();
+            for (const VertexRange& range : vertexBlocks) shadedVertices += range.end - range.first;
+
+            // Geometry pass: culling, clipping and flat shading gathered from the
+            // vertex pass. Each block of faces keeps its own output, so joining
+            // the blocks in order preserves the submission order.
+            ArenaVector<VertexRange> faceBlocks(ranges);
+            splitRanges(faceRanges, BLOCK_SIZE, faceBlocks);
+            // Only grown, so the per-block lists keep their capacity from
+            // batch to batch and frame to frame
+            if (blockTriangles.size() < faceBlocks.size()) {
+                blockTriangles.resize(faceBlocks.size());
+                blockQueues.resize(faceBlocks.size());
+            }
+            pool->parallelFor((int)faceBlocks.size(), [&](int block) {
+                std::vector<ScreenTriangle>& out = blockTriangles[block];
+                ShadeQueue& queue = blockQueues[block];
+                out.clear();
+                queue.clear();
+                for (int f = faceBlocks[block].first; f < faceBlocks[block].end; f++) {
+                    Vertex shaderVerts[3];
+                    for (int i = 0; i < 3; i++) shaderVerts[i] = transformed.load(indices[f * 3 + i]);
+                    setupTriangle(shaderVerts, out, f, &queue);
+                }
+                shadeQueue(queue, out);
+            });
+            for (const VertexRange& range : faceBlocks) drawnFaces += range.end - range.first;
+
+            triangles.clear();
+            for (size_t block = 0; block < faceBlocks.size(); block++) {
+                triangles.insert(triangles.end(), blockTriangles[block].begin(), blockTriangles[block].end());
+            }
+
+            // Debug first few triangles
+            for (size_t t = 0; verbose && b == 0 && t < triangles.size() && t < 3; t++) {
+                std::cout << "Triangle " << (t + 1) << " screen vertices: ";
                 for (int i = 0; i < 3; i++) {
-                    if (screenVerts[i].x >= -50 && screenVerts[i].x < width + 50 &&
-                        screenVerts[i].y >= -50 && screenVerts[i].y < height + 50) {
-                        onScreen = true;
-                        break;
-                    }
+                    const Vec3& v = triangles[t].v[i];
+                    std::cout << "(" << v.x << "," << v.y << "," << v.z << ") ";
+                }
+                std::cout << std::endl;
+            }
+
+            // Samples are resolved and rows final only once the last batch is in
+            bool finalBatch = b + 1 == batchCount;
+            bool last = finalBatch && !postPass;
+            if (pool->getThreadCount() == 1) {
+                shadedFragments += drawTriangles(nullptr, 0, 0, width, height);
+                if (finalBatch) framebuffer.resolve();
+                if (last && onRowsComplete) onRowsComplete(0, height);
+            } else {
+                shadedFragments += rasterizeTiled(finalBatch, last);
+            }
+            renderedTriangles += triangles.size();
+        }
+
+        // Without the cache the vertex shader would run once per corner
+        if (verbose && shadedVertices > 0) {
+            double reuse = 3.0 * drawnFaces / shadedVertices;
+            std::cout << "Vertex cache: " << shadedVertices << " unique vertices for " << drawnFaces * 3
+                      << " corners (reuse " << reuse << "x), vertex pass " << vertexSeconds * 1000.0
+                      << " ms, ~" << vertexSeconds * (reuse - 1.0) * 1000.0 << " ms saved" << std::endl;
+        }
+        if (verbose && !parts.empty()) {
+            std::cout << "Culling: " << outsideParts << " of " << parts.size() << " parts outside the view";
+            if (occlusionCulling) std::cout << ", " << occludedParts << " occluded";
+            std::cout << ", " << faceCount - drawnFaces << " of " << faceCount << " faces skipped" << std::endl;
+        }
+
+        if (postPass) {
+            finishFrame();
+        } else if (onRowsComplete && batchCount == 0) {
+            onRowsComplete(0, height);
+        }
+        rowsStreamed = true;
+        lastShadedFragments = shadedFragments;
+        if (!verbose) return;
+        RasterStats stats = framebuffer.getStats();
+        std::cout << "Rendered " << renderedTriangles << " triangles" << std::endl;
+        if (smoothShading && !deferred) {
+            std::cout << "Smooth shading: " << shadedFragments << " fragments shaded" << std::endl;
+        }
+        if (framebuffer.getHiZ()) {
+            std::cout << "Hi-Z: " << stats.trianglesCulled << " of " << stats.trianglesDrawn + stats.trianglesCulled
+                      << " triangle draws and " << stats.blocksCulled << " of " << stats.blocksDrawn + stats.blocksCulled
+                      << " " << HIZ_BLOCK << "x" << HIZ_BLOCK << " blocks rejected early" << std::endl;
+        }
+    }
+
+    // Passes over the finished depth buffer: the G-buffer and lighting of
+    // the deferred path, then screen-space AO. They run in bands of rows,
+    // and each band is handed on to onRowsComplete once it is final.
+    void finishFrame() {
+        bool ambientOcclusion = shader.enableAO && !shader.rayTracedAO;
+        if (ambientOcclusion) {
+            auto start = std::chrono::steady_clock::now();
+            ssao.compute(framebuffer, shader.projectionMatrix, shader.aoRadius, shader.aoSamples, pool.get());
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (verbose) {
+                std::cout << "SSAO: " << shader.aoSamples << " samples, radius " << shader.aoRadius << " ("
+                          << seconds * 1000.0 << " ms)" << std::endl;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (deferred) prepareDeferred();
+        std::atomic<int> litPixels(0);
+        pool->parallelForRange(height, 64, [&](int y0, int y1) {
+            if (deferred) {
+                resolveGBufferRows(y0, y1);
+                litPixels.fetch_add(shadeDeferredRows(y0, y1), std::memory_order_relaxed);
+            }
+            if (ambientOcclusion) ssao.applyRows(framebuffer, y0, y1);
+            if (onRowsComplete) onRowsComplete(y0, y1);
+        });
+        if (deferred && verbose) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Deferred shading: " << litPixels.load() << " visible pixels lit once each ("
+                      << seconds * 1000.0 << " ms)" << std::endl;
+        }
+    }
+
+    // Fills shader.materials, indexed by the model's material ids, from the
+    // .mtl files the model references. Names no library defines keep
+    // shader.material. False if a library could not be read.
+    bool loadMaterials(const Model& model) {
+        bool ok = true;
+        for (const std::string& library : model.getMaterialLibraries()) {
+            ok = materialLibrary.load(library, shader.material, &textures) && ok;
+        }
+        const auto& names = model.getMaterialNames();
+        shader.materials.assign(names.size(), shader.material);
+        int found = 0;
+        for (size_t id = 0; id < names.size(); id++) {
+            if (const Material* material = materialLibrary.find(names[id])) {
+                shader.materials[id] = *material;
+                found++;
+            }
+        }
+        if (verbose) {
+            std::cout << "Materials: " << found << " of " << names.size() << " defined in "
+                      << materialLibrary.fileCount() << " libraries" << std::endl;
+        }
+        return ok;
+    }
+
+    void prepareDeferred() {
+        gbuffer.resize(width, height);
+        inverseViewProjection = (shader.projectionMatrix * shader.viewMatrix).inverse();
+    }
+
+    // Fills the G-buffer for rows [y0, y1) from the face index the raster
+    // pass left in each pixel, interpolating only the normal
+    // perspective-correctly across the face with the planes set up when
+    // the face was drawn
+    void resolveGBufferRows(int y0, int y1) {
+        const float background = std::numeric_limits<float>::max();
+        for (int y = y0; y < y1; y++) {
+            const float* depth = framebuffer.getDepthRow(y);
+            const Color* color = framebuffer.getColorRow(y);
+            for (int x = 0; x < width; x++) {
+                if (depth[x] == background) continue;
+                uint32_t face = GBuffer::colorFace(color[x]);
+                float values[NormalVaryings::COUNT];
+                normalFacePlanes[face].evaluate(x, y, values);
+                gbuffer.set(x, y, NormalVaryings::normal(values), faceMaterial(face));
+            }
+        }
+    }
+
+    // Runs the fragment shader once for each visible pixel of rows
+    // [y0, y1), at the world position recovered from its depth; returns
+    // how many pixels it lit
+    int shadeDeferredRows(int y0, int y1) {
+        const float background = std::numeric_limits<float>::max();
+        int lit = 0;
+
+        // Runs of pixels with the same material are shaded as one batch
+        FragmentBatch batch;
+        Color* targets[FragmentBatch::CAPACITY];
+        Color shaded[FragmentBatch::CAPACITY];
+        int batchMaterial = -1;
+        auto flush = [&]() {
+            if (batch.count == 0) return;
+            shader.shadeBatch(batch, materialFor(batchMaterial), shaded);
+            for (int i = 0; i < batch.count; i++) *targets[i] = shaded[i];
+            batch.count = 0;
+        };
+
+        for (int y = y0; y < y1; y++) {
+            const float* depth = framebuffer.getDepthRow(y);
+            Color* color = framebuffer.getColorRow(y);
+            float py = (y + 0.5f) * 2.0f / height - 1.0f;
+            for (int x = 0; x < width; x++) {
+                if (depth[x] == background) continue;
+                int id = gbuffer.getMaterial(x, y);
+                if (id != batchMaterial || batch.full()) {
+                    flush();
+                    batchMaterial = id;
                 }
-                
-                if (onScreen) {
-                    drawTriangle(screenVerts[0], screenVerts[1], screenVerts[2], shaderVerts[0]);
-                    trianglesRendered++;
-                    
-                    // Debug first few triangles
-                    if (trianglesRendered <= 3) {
-                        std::cout << "Triangle " << trianglesRendered << " screen vertices: ";
-                        for (int i = 0; i < 3; i++) {
-                            std::cout << "(" << screenVerts[i].x << "," << screenVerts[i].y << "," << screenVerts[i].z << ") ";
-                        }
-                        std::cout << std::endl;
-                    }
+                targets[batch.count] = &color[x];
+                Vec3 ndc((x + 0.5f) * 2.0f / width - 1.0f, py, depth[x]);
+                batch.push(inverseViewProjection.transform(ndc), gbuffer.getNormal(x, y));
+                lit++;
+            }
+        }
+        flush();
+        return lit;
+    }
+
+    uint16_t faceMaterial(int face) const { return faceMaterials && face >= 0 ? faceMaterials[face] : NO_MATERIAL; }
+
+    const Material& materialFor(int id) const {
+        return id >= 0 && id < (int)shader.materials.size() ? shader.materials[id] : shader.material;
+    }
+
+    // Flat shades the faces in queue, a batch per run of faces with the
+    // same material, and colours their triangles in out
+    void shadeQueue(const ShadeQueue& queue, std::vector<ScreenTriangle>& out) {
+        FragmentBatch batch;
+        Color shaded[FragmentBatch::CAPACITY];
+        int count = (int)queue.positions.size();
+        for (int first = 0, end = 0; first < count; first = end) {
+            uint16_t material = queue.materials[first];
+            end = first + 1;
+            while (end < count && end - first < FragmentBatch::CAPACITY && queue.materials[end] == material) end++;
+            batch.count = 0;
+            for (int k = first; k < end; k++) batch.push(queue.positions[k], queue.normals[k]);
+            shader.shadeBatch(batch, materialFor(material), shaded);
+            for (int k = first; k < end; k++) {
+                int last = k + 1 < count ? queue.firstTriangle[k + 1] : (int)out.size();
+                for (int t = queue.firstTriangle[k]; t < last; t++) out[t].color = shaded[k - first];
+            }
+        }
+    }
+
+    // Transforms, culls, clips and shades one face without the vertex cache,
+    // appending the screen triangles it produces to out
+    void processFace(const Model& model, int face, std::vector<ScreenTriangle>& out) {
+        const auto& vertices = model.getVertices();
+        const uint32_t* corners = &model.getIndices()[face * 3];
+        Vertex shaderVerts[3];
+        for (int i = 0; i < 3; ++i) {
+            shaderVerts[i] = shader.vertexShader(vertices.position(corners[i]), vertices.normal(corners[i]),
+                                                 vertices.texCoord(corners[i]));
+        }
+        setupTriangle(shaderVerts, out);
+    }
+
+    // Culls, clips and shades a triangle of vertex shader outputs. Clipping
+    // runs in clip space against the near and far planes and the x/y guard
+    // band, then the pieces are divided by w, mapped to the screen and
+    // appended to out as a fan. The deferred path leaves shading to the
+    // lighting pass and gives the pieces the index of face instead, as does
+    // smooth shading, which sets up the face's varyings for the raster
+    // pass; with a queue, shading is left to shadeQueue.
+    void setupTriangle(const Vertex shaderVerts[3], std::vector<ScreenTriangle>& out, int face = -1,
+                       ShadeQueue* queue = nullptr) {
+        // Back-face culling in world space using face normals
+        const Vec3& worldVert0 = shaderVerts[0].worldPos;
+        Vec3 worldEdge1 = shaderVerts[1].worldPos - worldVert0;
+        Vec3 worldEdge2 = shaderVerts[2].worldPos - worldVert0;
+        Vec3 faceNormal = worldEdge1.cross(worldEdge2);
+        Vec3 viewDir = shader.cameraPos - worldVert0;
+        if (faceNormal.dot(viewDir) <= 0) return;
+
+        // Drop triangles entirely outside one plane of the view frustum
+        int outside = ~0, crossing = 0;
+        for (int i = 0; i < 3; ++i) {
+            outside &= Clipper::outcode(shaderVerts[i].clipPos, 1.0f);
+            crossing |= Clipper::outcode(shaderVerts[i].clipPos, guardBand);
+        }
+        if (outside) return;
+
+        Vec4 polygon[Clipper::MAX_VERTICES];
+        for (int i = 0; i < 3; ++i) polygon[i] = shaderVerts[i].clipPos;
+        int count = crossing ? Clipper::clipPolygon(polygon, 3, crossing, guardBand) : 3;
+        if (count < 3) return;
+
+        // Flat shading from the first original vertex, shared by every piece
+        ScreenTriangle tri;
+        if ((deferred || smoothShading) && face >= 0) {
+            tri.color = GBuffer::faceColor(face);
+            if (deferred) {
+                normalFacePlanes[face].setup(shaderVerts, width, height);
+            } else if (texturedFrame) {
+                texturedFacePlanes[face].setup(shaderVerts, width, height);
+                faceTangents[face] = Shader::faceTangent(shaderVerts);
+            } else {
+                facePlanes[face].setup(shaderVerts, width, height);
+            }
+        } else if (queue) {
+            queue->push(shaderVerts[0], faceMaterial(face), (int)out.size());
+        } else {
+            tri.color = shader.fragmentShader(shaderVerts[0]);
+        }
+
+        Vec3 screen[Clipper::MAX_VERTICES];
+        for (int i = 0; i < count; ++i) {
+            Vec3 ndc = polygon[i].project();
+            screen[i] = Vec3((ndc.x + 1.0f) * width * 0.5f, (ndc.y + 1.0f) * height * 0.5f, ndc.z);
+        }
+        for (int i = 1; i + 1 < count; ++i) {
+            tri.v[0] = screen[0];
+            tri.v[1] = screen[i];
+            tri.v[2] = screen[i + 1];
+            out.push_back(tri);
+        }
+    }
+
+    // Bins triangles into screen tiles, then rasterizes the tiles in
+    // parallel. Each tile is owned by one worker and sees its triangles in
+    // submission order, so the result matches the serial path exactly.
+    // With resolve, each tile resolves its samples while they are in cache.
+    // Returns how many fragments smooth shading shaded.
+    size_t rasterizeTiled(bool resolve = true, bool notifyRows = true) {
+        // Tiles own whole coarse depth blocks
+        int side = (std::max(tileSize, 1) + HIZ_BLOCK - 1) / HIZ_BLOCK * HIZ_BLOCK;
+        int tilesX = (width + side - 1) / side;
+        int tilesY = (height + side - 1) / side;
+        tileBins.resize(tilesX * tilesY);
+        for (auto& bin : tileBins) bin.clear();
+
+        for (int t = 0; t < (int)triangles.size(); t++) {
+            const Vec3* v = triangles[t].v;
+            float minX = std::max(0.0f, std::min({v[0].x, v[1].x, v[2].x}));
+            float minY = std::max(0.0f, std::min({v[0].y, v[1].y, v[2].y}));
+            float maxX = std::min((float)(width - 1), std::max({v[0].x, v[1].x, v[2].x}));
+            float maxY = std::min((float)(height - 1), std::max({v[0].y, v[1].y, v[2].y}));
+            if (minX > maxX || minY > maxY) continue;
+
+            int tx0 = (int)minX / side, tx1 = (int)maxX / side;
+            int ty0 = (int)minY / side, ty1 = (int)maxY / side;
+            for (int ty = ty0; ty <= ty1; ty++) {
+                for (int tx = tx0; tx <= tx1; tx++) {
+                    tileBins[ty * tilesX + tx].push_back(t);
                 }
             }
         }
-        
-        std::cout << "Rendered " << trianglesRendered << " triangles" << std::endl;
+
+        if (tileRows != tilesY) {
+            tilesLeftInRow.reset(new std::atomic<int>[tilesY]);
+            tileRows = tilesY;
+        }
+        for (int ty = 0; ty < tilesY; ty++) tilesLeftInRow[ty].store(tilesX);
+
+        std::atomic<size_t> fragments(0);
+        pool->parallelFor(tilesX * tilesY, [&](int tile) {
+            int x0 = (tile % tilesX) * side;
+            int y0 = (tile / tilesX) * side;
+            int x1 = std::min(width, x0 + side);
+            int y1 = std::min(height, y0 + side);
+            size_t shaded = drawTriangles(&tileBins[tile], x0, y0, x1, y1);
+            if (shaded) fragments.fetch_add(shaded, std::memory_order_relaxed);
+            if (resolve) framebuffer.resolve(x0, y0, x1, y1);
+            // The last tile of a row hands the finished band on
+            if (tilesLeftInRow[tile / tilesX].fetch_sub(1) == 1 && notifyRows && onRowsComplete) {
+                onRowsComplete(y0, y1);
+            }
+        });
+        return fragments.load();
+    }
+
+    // Draws the triangles listed, or all of them if list is null, inside
+    // [x0, x1) x [y0, y1). Smooth shading shades every fragment that passes
+    // the depth test, in batches; within a batch a nearer fragment drawn
+    // later still lands last. A multisampled fragment is shaded once and
+    // its colour goes to the samples that passed. Returns how many
+    // fragments it shaded.
+    size_t drawTriangles(const std::vector<int>* list, int x0, int y0, int x1, int y1) {
+        int count = list ? (int)list->size() : (int)triangles.size();
+        if (!smoothShading || deferred) {
+            for (int i = 0; i < count; i++) {
+                const ScreenTriangle& tri = triangles[list ? (*list)[i] : i];
+                framebuffer.drawTriangle(tri.v[0], tri.v[1], tri.v[2], tri.color, x0, y0, x1, y1);
+            }
+            return 0;
+        }
+        if (texturedFrame) return drawSmooth(texturedFacePlanes, list, count, x0, y0, x1, y1);
+        return drawSmooth(facePlanes, list, count, x0, y0, x1, y1);
+    }
+
+    template <class Layout>
+    size_t drawSmooth(const std::vector<VaryingPlanes<Layout> >& planes, const std::vector<int>* list, int count,
+                      int x0, int y0, int x1, int y1) {
+        FragmentBatch batch;
+        Color* targets[FragmentBatch::CAPACITY];
+        unsigned masks[FragmentBatch::CAPACITY];
+        Color shaded[FragmentBatch::CAPACITY];
+        size_t fragments = 0;
+        int batchMaterial = -1;
+        auto flush = [&]() {
+            if (batch.count == 0) return;
+            shader.shadeBatch(batch, materialFor(batchMaterial), shaded);
+            for (int i = 0; i < batch.count; i++) {
+                for (unsigned mask = masks[i], k = 0; mask; mask >>= 1, k++) {
+                    if (mask & 1) targets[i][k] = shaded[i];
+                }
+            }
+            fragments += batch.count;
+            batch.count = 0;
+        };
+        for (int i = 0; i < count; i++) {
+            const ScreenTriangle& tri = triangles[list ? (*list)[i] : i];
+            int face = (int)GBuffer::colorFace(tri.color);
+            if (faceMaterial(face) != batchMaterial) {
+                flush();
+                batchMaterial = faceMaterial(face);
+            }
+            framebuffer.drawTriangleVaryings(tri.v[0], tri.v[1], tri.v[2], planes[face], x0, y0, x1, y1,
+                                             [&](int x, int y, const float* values, unsigned samples) {
+                targets[batch.count] = framebuffer.getSampleColors(x, y);
+                masks[batch.count] = samples;
+                pushFragment(batch, planes[face], face, x, y, values);
+                if (batch.full()) flush();
+            });
+        }
+        flush();
+        return fragments;
+    }
+
+    void pushFragment(FragmentBatch& batch, const VaryingPlanes<SurfaceVaryings>&, int, int, int,
+                      const float* values) {
+        batch.push(SurfaceVaryings::worldPos(values), SurfaceVaryings::normal(values).normalize());
+    }
+
+    // Samples the material's maps at the fragment, at the mip level its
+    // texture coordinate derivatives call for
+    void pushFragment(FragmentBatch& batch, const VaryingPlanes<TexturedVaryings>& planes, int face, int x, int y,
+                      const float* values) {
+        const Material& surface = materialFor(faceMaterial(face));
+        Vec2 uv = TexturedVaryings::texCoord(values);
+        float dudx, dudy, dvdx, dvdy;
+        planes.derivatives(TexturedVaryings::TEX_COORD, x, y, uv.x, dudx, dudy);
+        planes.derivatives(TexturedVaryings::TEX_COORD + 1, x, y, uv.y, dvdx, dvdy);
+
+        Vertex vertex;
+        vertex.normal = TexturedVaryings::normal(values).normalize();
+        if (surface.normalMap) {
+            vertex.tangent = faceTangents[face];
+            float lod = surface.normalMap->lod(dudx, dvdx, dudy, dvdy);
+            vertex.normal = shader.calculateNormalFromMap(vertex, surface.normalMap->sample(uv, lod));
+        }
+        Vec3 albedo(1, 1, 1);
+        if (surface.diffuseMap) albedo = surface.diffuseMap->sample(uv, surface.diffuseMap->lod(dudx, dvdx, dudy, dvdy));
+        batch.push(TexturedVaryings::worldPos(values), vertex.normal, albedo);
+    }
+
+    // True if the part's bounding box projects behind everything already
+    // drawn under it. Boxes reaching behind the near plane are never hidden.
+    bool isPartOccluded(const ModelPart& part) {
+        float minX = std::numeric_limits<float>::max(), maxX = -minX;
+        float minY = minX, maxY = maxX, minZ = minX;
+        for (int i = 0; i < 8; i++) {
+            Vec3 corner(i & 1 ? part.boundsMax.x : part.boundsMin.x, i & 2 ? part.boundsMax.y : part.boundsMin.y,
+                        i & 4 ? part.boundsMax.z : part.boundsMin.z);
+            Vec4 clip = shader.mvpMatrix.transform4(corner);
+            if (clip.w <= 0 || clip.z < -clip.w) return false;
+            Vec3 ndc = clip.project();
+            float x = (ndc.x + 1.0f) * width * 0.5f, y = (ndc.y + 1.0f) * height * 0.5f;
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+            minZ = std::min(minZ, ndc.z);
+        }
+        // Depth is nearest at a box corner; leave room for rounding
+        minZ -= (std::fabs(minZ) + 1.0f) * (1.0f / (1 << 20));
+        return framebuffer.isRectHidden((int)std::floor(minX), (int)std::floor(minY), (int)std::floor(maxX),
+                                        (int)std::floor(maxY), minZ);
     }
 
     void drawTriangle(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Vertex& shaderVert) {
@@ -96,9 +841,110 @@ public:
         framebuffer.drawTriangle(v0, v1, v2, pixelColor);
     }
 
-    void render() {
-        // Just save the framebuffer - don't clear it as rendering has already happened
-        framebuffer.saveToPPM("output.ppm");
+    // Streams the rows of the following renderModel calls into a binary PPM
+    // as their tiles finish, instead of writing the image in render()
+    bool beginStreamingOutput(const std::string& filename) {
+        stream.reset(new PPMStreamWriter());
+        if (!stream->open(filename, width, height)) {
+            std::cerr << "Error: Cannot open " << filename << " for writing" << std::endl;
+            stream.reset();
+            return false;
+        }
+        streamName = filename;
+        streamFailed = false;
+        rowsStreamed = false;
+        PPMStreamWriter* writer = stream.get();
+        onRowsComplete = [this, writer](int y0, int y1) {
+            if (!streamFailed && !writer->writeRows(framebuffer, y0, y1)) streamFailed = true;
+        };
+        return true;
+    }
+
+    // Sorts ranges and merges the ones that overlap or touch, in place
+    template <class Ranges>
+    static void mergeRanges(Ranges& ranges) {
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const VertexRange& a, const VertexRange& b) { return a.first < b.first; });
+        size_t merged = 0;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            VertexRange range = ranges[i];
+            if (range.first >= range.end) continue;
+            if (merged > 0 && range.first <= ranges[merged - 1].end) {
+                ranges[merged - 1].end = std::max(ranges[merged - 1].end, range.end);
+            } else {
+                ranges[merged++] = range;
+            }
+        }
+        ranges.erase(ranges.begin() + merged, ranges.end());
+    }
+
+    // Cuts ranges into pieces of at most size, keeping their order
+    template <class Ranges>
+    static void splitRanges(const Ranges& ranges, int size, Ranges& pieces) {
+        pieces.clear();
+        for (const VertexRange& range : ranges) {
+            for (int first = range.first; first < range.end; first += size) {
+                pieces.push_back(VertexRange{first, std::min(range.end, first + size)});
+            }
+        }
+    }
+
+    // Points the shader at camera, with the framebuffer's aspect ratio
+    void setCamera(const CameraSpec& camera) {
+        shader.viewMatrix = Matrix4x4::lookAt(camera.position, camera.target, camera.up);
+        shader.projectionMatrix = Matrix4x4::perspective(camera.fov, (float)width / height, camera.near, camera.far);
+        shader.cameraPos = camera.position;
+        shader.updateMVP();
+    }
+
+    // Renders model from each camera in turn into prefix0000.ppm,
+    // prefix0001.ppm and so on. What does not depend on the camera (the
+    // model, its materials, the BVH, the shadow maps) is shared by all the
+    // frames, and each frame is encoded and written as a pool job while the
+    // next one renders. Statistics are printed for the first frame
+    // only. False if a frame could not be written.
+    bool renderFrames(const Model& model, const std::vector<CameraSpec>& cameras, const std::string& prefix,
+                      const Color& background) {
+        PPMFrameEncoder encoder(*pool);
+        bool wasVerbose = verbose;
+        std::function<void(int, int)> rowsComplete;
+        rowsComplete.swap(onRowsComplete);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < cameras.size(); i++) {
+            setCamera(cameras[i]);
+            framebuffer.clear(background);
+            renderModel(model);
+            verbose = false;
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d", (int)i);
+            encoder.submit(framebuffer, prefix + number + ".ppm");
+        }
+        bool ok = encoder.finish();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        verbose = wasVerbose;
+        rowsComplete.swap(onRowsComplete);
+        std::cout << "Batch: " << cameras.size() << " frames in " << seconds << " s, "
+                  << (seconds > 0 ? cameras.size() / seconds : 0.0) << " frames/s ("
+                  << encoder.getWaitSeconds() * 1000.0 << " ms spent waiting for the encoder)" << std::endl;
+        return ok;
+    }
+
+    // False, with an error printed, if the image could not be written
+    bool render() {
+        // Just save the framebuffer - don't clear it as rendering has already happened.
+        // renderModel resolves samples itself; anything else drawn is resolved here.
+        if (!rowsStreamed) framebuffer.resolve();
+        if (stream) {
+            // Nothing was streamed if the image was drawn without renderModel
+            bool ok = !streamFailed;
+            if (ok && !rowsStreamed) ok = stream->writeRows(framebuffer, 0, height);
+            ok = stream->close() && ok;
+            stream.reset();
+            onRowsComplete = nullptr;
+            if (!ok) std::cerr << "Error: Cannot write " << streamName << std::endl;
+            return ok;
+        }
+        return framebuffer.saveToPPM("output.ppm", binaryPPM);
     }
 };
 
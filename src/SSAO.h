@@ -0,0 +1,387 @@
+#ifndef SSAO_H
+#define SSAO_H
+
+#include "Framebuffer.h"
+#include "Matrix4x4.h"
+#include "ThreadPool.h"
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Lesson 8: Screen-space ambient occlusion, run as a pass over the depth
+// buffer once the frame is rasterized, so its cost depends on the image
+// size and not on overdraw. View-space depth and normals are rebuilt per
+// pixel, points in the hemisphere above each pixel are checked against
+// the depth drawn where they project, and a depth-aware blur removes the
+// noise of the per-pixel sample rotation before the colours are darkened.
+class SSAO {
+public:
+    int blurRadius;       // taps either side of a pixel, in each blur direction
+    float depthSharpness; // blur weights reach 0 at a depth difference of 1/this of the depth
+    float minimum;        // floor of the AO factor
+
+private:
+    // Rows per work item of each pass
+    static const int ROWS = 8;
+
+    int width, height;
+    int samples;
+    float radius;
+    Matrix4x4 projection;
+    std::vector<float> viewDepth; // distance in front of the camera, FLT_MAX where nothing was drawn
+    std::vector<float> normalX, normalY, normalZ; // view space, facing the camera
+    std::vector<float> occlusion, blurred;        // AO factor per pixel
+    // Sample offsets in units of radius, z along the normal, padded to a
+    // multiple of 4 with zero-weight entries
+    std::vector<float> kernelX, kernelY, kernelZ, kernelWeight;
+    std::vector<float> blurWeights;
+
+public:
+    SSAO()
+        : blurRadius(2), depthSharpness(16.0f), minimum(0.1f), width(0), height(0), samples(0), radius(0) {}
+
+    // Occlusion of every pixel of framebuffer, which was drawn with
+    // projection. aoRadius is in view-space units; aoSamples sets the
+    // quality and the cost, which grows linearly with it.
+    void compute(const Framebuffer& framebuffer, const Matrix4x4& projection_, float aoRadius, int aoSamples,
+                 ThreadPool* pool = nullptr) {
+        width = framebuffer.getWidth();
+        height = framebuffer.getHeight();
+        projection = projection_;
+        radius = aoRadius;
+        setSamples(std::max(0, aoSamples));
+        size_t pixels = (size_t)width * height;
+        viewDepth.resize(pixels);
+        normalX.resize(pixels);
+        normalY.resize(pixels);
+        normalZ.resize(pixels);
+        occlusion.resize(pixels);
+        blurred.resize(pixels);
+        if (samples == 0) {
+            std::fill(occlusion.begin(), occlusion.end(), 1.0f);
+            return;
+        }
+
+        auto rows = [&](void (SSAO::*pass)(int, int, const Framebuffer&)) {
+            auto fn = [&](int y0, int y1) { (this->*pass)(y0, y1, framebuffer); };
+            if (pool) pool->parallelForRange(height, ROWS, fn);
+            else fn(0, height);
+        };
+        rows(&SSAO::linearizeRows);
+        rows(&SSAO::normalRows);
+        rows(&SSAO::occlusionRows);
+        if (blurRadius > 0) {
+            blurWeights.resize(blurRadius + 1);
+            float sigma = (blurRadius + 1) * 0.5f;
+            for (int k = 0; k <= blurRadius; k++) blurWeights[k] = std::exp(-k * k / (2.0f * sigma * sigma));
+            rows(&SSAO::blurRowsHorizontal);
+            rows(&SSAO::blurRowsVertical);
+        }
+    }
+
+    // Darkens rows [y0, y1) of framebuffer by the last computed occlusion
+    void applyRows(Framebuffer& framebuffer, int y0, int y1) const {
+        if (framebuffer.isDepthOnly()) return;
+        const float background = std::numeric_limits<float>::max();
+        for (int y = y0; y < y1; y++) {
+            Color* color = framebuffer.getColorRow(y);
+            const float* ao = &occlusion[y * width];
+            const float* depth = &viewDepth[y * width];
+            for (int x = 0; x < width; x++) {
+                if (depth[x] == background) continue;
+                int scale = (int)(ao[x] * 256.0f + 0.5f);
+                color[x].r = (unsigned char)((color[x].r * scale) >> 8);
+                color[x].g = (unsigned char)((color[x].g * scale) >> 8);
+                color[x].b = (unsigned char)((color[x].b * scale) >> 8);
+            }
+        }
+    }
+
+    float getOcclusion(int x, int y) const { return occlusion[y * width + x]; }
+
+private:
+    // Cosine-weighted golden-angle spiral over the hemisphere, with lengths
+    // from a second low-discrepancy sequence so that more of the samples
+    // fall close to the pixel
+    void setSamples(int count) {
+        if (count == samples && (int)kernelX.size() == (count + 3) / 4 * 4) return;
+        samples = count;
+        int padded = (count + 3) / 4 * 4;
+        kernelX.assign(padded, 0.0f);
+        kernelY.assign(padded, 0.0f);
+        kernelZ.assign(padded, 0.0f);
+        kernelWeight.assign(padded, 0.0f);
+        for (int i = 0; i < count; i++) {
+            float r = std::sqrt((i + 0.5f) / count);
+            float phi = i * 2.3999632f;
+            float t = std::fmod(i * 0.618034f + 0.5f, 1.0f);
+            float length = 0.1f + 0.9f * t * t;
+            kernelX[i] = r * std::cos(phi) * length;
+            kernelY[i] = r * std::sin(phi) * length;
+            kernelZ[i] = std::sqrt(std::max(0.0f, 1.0f - r * r)) * length;
+            kernelWeight[i] = 1.0f;
+        }
+    }
+
+    // View-space z from NDC depth, and x, y from NDC x, y at that z, for
+    // perspective and orthographic projections alike
+    float viewZ(float ndcZ) const {
+        const auto& m = projection.m;
+        return (m[2][3] - ndcZ * m[3][3]) / (ndcZ * m[3][2] - m[2][2]);
+    }
+
+    Vec3 viewPosition(int x, int y) const {
+        const auto& m = projection.m;
+        float z = -viewDepth[y * width + x];
+        float w = m[3][2] * z + m[3][3];
+        float ndcX = (x + 0.5f) * 2.0f / width - 1.0f;
+        float ndcY = (y + 0.5f) * 2.0f / height - 1.0f;
+        return Vec3((ndcX * w - m[0][2] * z - m[0][3]) / m[0][0], (ndcY * w - m[1][2] * z - m[1][3]) / m[1][1], z);
+    }
+
+    void linearizeRows(int y0, int y1, const Framebuffer& framebuffer) {
+        const float background = std::numeric_limits<float>::max();
+        for (int y = y0; y < y1; y++) {
+            const float* depth = framebuffer.getDepthRow(y);
+            float* out = &viewDepth[y * width];
+            for (int x = 0; x < width; x++) {
+                out[x] = depth[x] <= 1.0f ? -viewZ(depth[x]) : background;
+            }
+        }
+    }
+
+    // Normals from the depth of the neighbours; on each axis the neighbour
+    // nearer in depth is used, so pixels on a silhouette take the slope of
+    // their own surface
+    void normalRows(int y0, int y1, const Framebuffer&) {
+        const float background = std::numeric_limits<float>::max();
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                float d = viewDepth[i];
+                Vec3 normal(0, 0, 1);
+                if (d != background) {
+                    Vec3 p = viewPosition(x, y);
+                    Vec3 dx, dy;
+                    bool hasX = neighbourDelta(x, y, 1, 0, d, p, dx);
+                    bool hasY = neighbourDelta(x, y, 0, 1, d, p, dy);
+                    if (hasX && hasY) {
+                        Vec3 n = dx.cross(dy);
+                        float length = n.length();
+                        if (length > 0) {
+                            normal = n * (1.0f / length);
+                            if (normal.dot(p) > 0) normal = normal * -1.0f;
+                        }
+                    }
+                }
+                normalX[i] = normal.x;
+                normalY[i] = normal.y;
+                normalZ[i] = normal.z;
+            }
+        }
+    }
+
+    // Step from p towards whichever of its two neighbours along (sx, sy) is
+    // closer in depth, pointing along +x or +y
+    bool neighbourDelta(int x, int y, int sx, int sy, float d, const Vec3& p, Vec3& delta) const {
+        const float background = std::numeric_limits<float>::max();
+        float best = background;
+        int bestSide = 0;
+        for (int side = -1; side <= 1; side += 2) {
+            int nx = x + sx * side, ny = y + sy * side;
+            if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+            float nd = viewDepth[ny * width + nx];
+            if (nd == background) continue;
+            float diff = std::fabs(nd - d);
+            if (diff < best) {
+                best = diff;
+                bestSide = side;
+            }
+        }
+        if (!bestSide) return false;
+        Vec3 q = viewPosition(x + sx * bestSide, y + sy * bestSide);
+        delta = bestSide > 0 ? q - p : p - q;
+        return true;
+    }
+
+    void occlusionRows(int y0, int y1, const Framebuffer&) {
+        const float background = std::numeric_limits<float>::max();
+        // Sample rotations in a 4x4 interleaved pattern, which the blur
+        // averages out
+        static const int pattern[16] = {0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5};
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                if (viewDepth[i] == background) {
+                    occlusion[i] = 1.0f;
+                    continue;
+                }
+                Vec3 p = viewPosition(x, y);
+                Vec3 normal(normalX[i], normalY[i], normalZ[i]);
+                float turn = pattern[(y & 3) * 4 + (x & 3)] * (6.2831853f / 16.0f);
+                Vec3 rotation(std::cos(turn), std::sin(turn), 0.0f);
+                Vec3 tangent = rotation - normal * rotation.dot(normal);
+                if (tangent.length() < 1e-3f) {
+                    Vec3 across(-rotation.y, rotation.x, 0.0f);
+                    tangent = across - normal * across.dot(normal);
+                }
+                tangent = tangent.normalize();
+                Vec3 bitangent = normal.cross(tangent);
+                float occluded = occludedSamples(p, tangent, bitangent, normal);
+                occlusion[i] = std::max(minimum, 1.0f - occluded / samples);
+            }
+        }
+    }
+
+    // Weighted count of the kernel points around p that are behind what
+    // was drawn where they project. Occluders much nearer or farther than
+    // p count for less, so distant geometry doesn't darken silhouettes.
+    float occludedSamples(const Vec3& p, const Vec3& t, const Vec3& b, const Vec3& n) const {
+        const auto& m = projection.m;
+        float centreDepth = -p.z;
+        float bias = radius * 0.03f;
+        float halfW = width * 0.5f, halfH = height * 0.5f;
+        float occluded = 0.0f;
+#ifdef __SSE2__
+        __m128 r4 = _mm_set1_ps(radius);
+        __m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+        __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+        __m128 maxX = _mm_set1_ps(width - 1.0f), maxY = _mm_set1_ps(height - 1.0f);
+        __m128 centre = _mm_set1_ps(centreDepth);
+        __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 sum = zero;
+        for (size_t k = 0; k < kernelX.size(); k += 4) {
+            __m128 kx = _mm_mul_ps(_mm_loadu_ps(&kernelX[k]), r4);
+            __m128 ky = _mm_mul_ps(_mm_loadu_ps(&kernelY[k]), r4);
+            __m128 kz = _mm_mul_ps(_mm_loadu_ps(&kernelZ[k]), r4);
+            __m128 sx = _mm_add_ps(px, _mm_add_ps(_mm_add_ps(_mm_mul_ps(kx, _mm_set1_ps(t.x)),
+                                                             _mm_mul_ps(ky, _mm_set1_ps(b.x))),
+                                                  _mm_mul_ps(kz, _mm_set1_ps(n.x))));
+            __m128 sy = _mm_add_ps(py, _mm_add_ps(_mm_add_ps(_mm_mul_ps(kx, _mm_set1_ps(t.y)),
+                                                             _mm_mul_ps(ky, _mm_set1_ps(b.y))),
+                                                  _mm_mul_ps(kz, _mm_set1_ps(n.y))));
+            __m128 sz = _mm_add_ps(pz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(kx, _mm_set1_ps(t.z)),
+                                                             _mm_mul_ps(ky, _mm_set1_ps(b.z))),
+                                                  _mm_mul_ps(kz, _mm_set1_ps(n.z))));
+
+            // Project to pixel coordinates
+            __m128 w = _mm_add_ps(_mm_mul_ps(sz, _mm_set1_ps(m[3][2])), _mm_set1_ps(m[3][3]));
+            __m128 cx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, _mm_set1_ps(m[0][0])), _mm_mul_ps(sz, _mm_set1_ps(m[0][2]))),
+                                   _mm_set1_ps(m[0][3]));
+            __m128 cy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sy, _mm_set1_ps(m[1][1])), _mm_mul_ps(sz, _mm_set1_ps(m[1][2]))),
+                                   _mm_set1_ps(m[1][3]));
+            __m128 screenX = _mm_mul_ps(_mm_add_ps(_mm_div_ps(cx, w), one), _mm_set1_ps(halfW));
+            __m128 screenY = _mm_mul_ps(_mm_add_ps(_mm_div_ps(cy, w), one), _mm_set1_ps(halfH));
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(w, zero), _mm_cmpge_ps(screenX, zero)),
+                                       _mm_and_ps(_mm_cmpge_ps(screenY, zero),
+                                                  _mm_and_ps(_mm_cmplt_ps(screenX, _mm_set1_ps((float)width)),
+                                                             _mm_cmplt_ps(screenY, _mm_set1_ps((float)height)))));
+            screenX = _mm_min_ps(_mm_max_ps(screenX, zero), maxX);
+            screenY = _mm_min_ps(_mm_max_ps(screenY, zero), maxY);
+            __m128i xi = _mm_cvttps_epi32(screenX), yi = _mm_cvttps_epi32(screenY);
+
+            // Gather the depth drawn under each sample
+            int xs[4], ys[4];
+            _mm_storeu_si128((__m128i*)xs, xi);
+            _mm_storeu_si128((__m128i*)ys, yi);
+            __m128 scene = _mm_setr_ps(viewDepth[ys[0] * width + xs[0]], viewDepth[ys[1] * width + xs[1]],
+                                       viewDepth[ys[2] * width + xs[2]], viewDepth[ys[3] * width + xs[3]]);
+
+            __m128 sampleDepth = _mm_sub_ps(zero, sz);
+            __m128 behind = _mm_cmplt_ps(scene, _mm_sub_ps(sampleDepth, _mm_set1_ps(bias)));
+            __m128 range = _mm_min_ps(one, _mm_div_ps(r4, _mm_and_ps(_mm_sub_ps(centre, scene), absMask)));
+            __m128 hit = _mm_and_ps(_mm_and_ps(inside, behind), _mm_mul_ps(range, _mm_loadu_ps(&kernelWeight[k])));
+            sum = _mm_add_ps(sum, hit);
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, sum);
+        occluded = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+        for (int k = 0; k < samples; k++) {
+            Vec3 s = p + (t * kernelX[k] + b * kernelY[k] + n * kernelZ[k]) * radius;
+            float w = m[3][2] * s.z + m[3][3];
+            float screenX = ((m[0][0] * s.x + m[0][2] * s.z + m[0][3]) / w + 1.0f) * halfW;
+            float screenY = ((m[1][1] * s.y + m[1][2] * s.z + m[1][3]) / w + 1.0f) * halfH;
+            if (!(w > 0) || !(screenX >= 0 && screenX < width && screenY >= 0 && screenY < height)) continue;
+            float scene = viewDepth[(int)screenY * width + (int)screenX];
+            if (scene < -s.z - bias) occluded += std::min(1.0f, radius / std::fabs(centreDepth - scene));
+        }
+#endif
+        return occluded;
+    }
+
+    // Weight of a neighbour at depth d for a pixel at centre depth, where
+    // scale is depthSharpness / centre
+    static float depthWeight(float d, float centre, float scale) {
+        return std::max(0.0f, 1.0f - std::fabs(d - centre) * scale);
+    }
+
+    // Bilateral tap sum for one pixel from src, stepping by stride between
+    // taps and clamping to [lo, hi] along the blur direction
+    float blurPixel(const std::vector<float>& src, int i, int pos, int lo, int hi, int stride) const {
+        float centre = viewDepth[i];
+        float scale = depthSharpness / centre;
+        float sum = src[i] * blurWeights[0], total = blurWeights[0];
+        for (int k = 1; k <= blurRadius; k++) {
+            for (int side = -1; side <= 1; side += 2) {
+                int q = std::min(hi, std::max(lo, pos + side * k));
+                int j = i + (q - pos) * stride;
+                float weight = blurWeights[k] * depthWeight(viewDepth[j], centre, scale);
+                sum += src[j] * weight;
+                total += weight;
+            }
+        }
+        return sum / total;
+    }
+
+#ifdef __SSE2__
+    // blurPixel for 4 neighbouring pixels along x whose taps are all in bounds
+    void blur4(const std::vector<float>& src, std::vector<float>& dst, int i, int stride) const {
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 centre = _mm_loadu_ps(&viewDepth[i]);
+        __m128 scale = _mm_div_ps(_mm_set1_ps(depthSharpness), centre);
+        __m128 w0 = _mm_set1_ps(blurWeights[0]);
+        __m128 sum = _mm_mul_ps(_mm_loadu_ps(&src[i]), w0), total = w0;
+        for (int k = 1; k <= blurRadius; k++) {
+            for (int side = -1; side <= 1; side += 2) {
+                int j = i + side * k * stride;
+                __m128 d = _mm_loadu_ps(&viewDepth[j]);
+                __m128 similarity = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_and_ps(_mm_sub_ps(d, centre), absMask), scale));
+                __m128 weight = _mm_mul_ps(_mm_set1_ps(blurWeights[k]), _mm_max_ps(_mm_setzero_ps(), similarity));
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&src[j]), weight));
+                total = _mm_add_ps(total, weight);
+            }
+        }
+        _mm_storeu_ps(&dst[i], _mm_div_ps(sum, total));
+    }
+#endif
+
+    void blurRowsHorizontal(int y0, int y1, const Framebuffer&) {
+        for (int y = y0; y < y1; y++) {
+            int row = y * width, x = 0;
+#ifdef __SSE2__
+            for (; x < blurRadius && x < width; x++) blurred[row + x] = blurPixel(occlusion, row + x, x, 0, width - 1, 1);
+            for (; x + 4 + blurRadius <= width; x += 4) blur4(occlusion, blurred, row + x, 1);
+#endif
+            for (; x < width; x++) blurred[row + x] = blurPixel(occlusion, row + x, x, 0, width - 1, 1);
+        }
+    }
+
+    void blurRowsVertical(int y0, int y1, const Framebuffer&) {
+        for (int y = y0; y < y1; y++) {
+            int row = y * width, x = 0;
+#ifdef __SSE2__
+            if (y >= blurRadius && y + blurRadius < height) {
+                for (; x + 4 <= width; x += 4) blur4(blurred, occlusion, row + x, width);
+            }
+#endif
+            for (; x < width; x++) occlusion[row + x] = blurPixel(blurred, row + x, y, 0, height - 1, width);
+        }
+    }
+};
+
+#endif
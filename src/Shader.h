@@ -3,14 +3,24 @@
 
 #include "Vec3.h"
 #include "Matrix4x4.h"
+#include "BVH.h"
+#include "ShadowMap.h"
+#include "Texture.h"
+#include <algorithm>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Vertex shader output / Fragment shader input
 struct Vertex {
-    Vec3 position;
+    Vec4 clipPos;  // before the perspective divide
+    Vec3 position; // NDC
     Vec3 normal;
     Vec2 texCoord;
     Vec3 worldPos;
     Vec3 color;
+    Vec4 tangent;  // world space, w the handedness of the bitangent; 0 if unknown
 };
 
 // Light structure
@@ -32,9 +42,58 @@ struct Material {
     Color ambient;
     float shininess;
     float roughness;
+    const Texture* diffuseMap; // tints diffuse; textures belong to a TextureCache
+    const Texture* normalMap;  // tangent-space normals
+
+    // Kept from .mtl files for completeness; the shader is opaque
+    Color transmission;    // Tf
+    float refractiveIndex; // Ni
+    int illumination;      // illum model
     
     Material() : diffuse(128, 128, 128), specular(255, 255, 255), 
-                 ambient(32, 32, 32), shininess(32.0f), roughness(0.5f) {}
+                 ambient(32, 32, 32), shininess(32.0f), roughness(0.5f), diffuseMap(nullptr), normalMap(nullptr),
+                 transmission(0, 0, 0), refractiveIndex(1.0f), illumination(2) {}
+
+    bool isTextured() const { return diffuseMap || normalMap; }
+};
+
+// Up to CAPACITY fragments for Shader::shadeBatch, one array per component.
+// Textured batches carry a diffuse tint per fragment; a batch holds
+// fragments of one kind.
+struct FragmentBatch {
+    static const int CAPACITY = 64; // a multiple of 4
+    int count;
+    bool textured;
+    float posX[CAPACITY], posY[CAPACITY], posZ[CAPACITY]; // world space
+    float normalX[CAPACITY], normalY[CAPACITY], normalZ[CAPACITY];
+    float albedoR[CAPACITY], albedoG[CAPACITY], albedoB[CAPACITY];
+
+    FragmentBatch() : count(0), textured(false) {
+        for (float* a : {posX, posY, posZ, normalX, normalY, normalZ, albedoR, albedoG, albedoB}) {
+            std::fill(a, a + CAPACITY, 0.0f);
+        }
+    }
+
+    bool full() const { return count == CAPACITY; }
+
+    void push(const Vec3& position, const Vec3& normal) {
+        posX[count] = position.x; posY[count] = position.y; posZ[count] = position.z;
+        normalX[count] = normal.x; normalY[count] = normal.y; normalZ[count] = normal.z;
+        count++;
+    }
+
+    void push(const Vec3& position, const Vec3& normal, const Vec3& albedo) {
+        albedoR[count] = albedo.x; albedoG[count] = albedo.y; albedoB[count] = albedo.z;
+        textured = true;
+        push(position, normal);
+    }
+
+    Vertex vertex(int i) const {
+        Vertex v;
+        v.worldPos = Vec3(posX[i], posY[i], posZ[i]);
+        v.normal = Vec3(normalX[i], normalY[i], normalZ[i]);
+        return v;
+    }
 };
 
 class Shader {
@@ -47,17 +106,28 @@ public:
     Vec3 cameraPos;
     std::vector<Light> lights;
     Material material;
+    std::vector<Material> materials; // by G-buffer material id; material for ids past the end
     
-    // Shadow mapping
+    // Shadow mapping: one map per light, null for lights without one.
+    // lightSpaceMatrix is that of the first light with a map.
     Matrix4x4 lightSpaceMatrix;
+    std::vector<const ShadowMap*> shadowMaps;
     bool enableShadows;
     
-    // Ambient occlusion
+    // Ambient occlusion: a screen-space pass over the finished frame, or
+    // with rayTracedAO, rays through scene from each shaded face
     bool enableAO;
+    bool rayTracedAO;
     float aoRadius;
     int aoSamples;
 
-    Shader() : enableShadows(false), enableAO(false), aoRadius(1.0f), aoSamples(16) {
+    // World-space geometry that shadow and AO rays are traced against, and
+    // how far rays start off the surface to miss the face they leave
+    const BVH* scene;
+    float rayBias;
+
+    Shader() : enableShadows(false), enableAO(false), rayTracedAO(false), aoRadius(1.0f), aoSamples(16),
+               scene(nullptr), rayBias(1e-3f) {
         // Default light
         Light defaultLight;
         defaultLight.direction = Vec3(0, -1, -1).normalize();
@@ -78,24 +148,27 @@ public:
         output.normal = modelMatrix.transform(normal, 0.0f).normalize(); // Transform normal (w=0)
         output.texCoord = texCoord;
         
-        // Transform to clip space
-        Vec3 clipPos = mvpMatrix.transform(vertex);
-        
-        // Store the clip space position (NDC coordinates)
-        output.position = clipPos;
+        // Transform to clip space; clipping happens before the divide
+        output.clipPos = mvpMatrix.transform4(vertex);
+        output.position = output.clipPos.project();
         
         return output;
     }
 
     // Fragment shader - calculates pixel color
     Color fragmentShader(const Vertex& vertex) {
+        return fragmentShader(vertex, material);
+    }
+
+    Color fragmentShader(const Vertex& vertex, const Material& surface) {
         Vec3 finalColor(0, 0, 0);
         
         // Ambient lighting
-        Vec3 ambient = Vec3(material.ambient.r, material.ambient.g, material.ambient.b) * (1.0f / 255.0f);
+        Vec3 ambient = Vec3(surface.ambient.r, surface.ambient.g, surface.ambient.b) * (1.0f / 255.0f);
         finalColor = finalColor + ambient;
         
-        for (const Light& light : lights) {
+        for (size_t l = 0; l < lights.size(); l++) {
+            const Light& light = lights[l];
             Vec3 lightDir;
             float attenuation = 1.0f;
             
@@ -109,20 +182,22 @@ public:
             
             // Diffuse lighting
             float diff = std::max(0.0f, vertex.normal.dot(lightDir));
-            Vec3 diffuse = Vec3(material.diffuse.r, material.diffuse.g, material.diffuse.b) * (1.0f / 255.0f) * diff;
+            Vec3 diffuse = Vec3(surface.diffuse.r, surface.diffuse.g, surface.diffuse.b) * (1.0f / 255.0f) * diff;
             
             // Specular lighting (Blinn-Phong)
             Vec3 viewDir = (cameraPos - vertex.worldPos).normalize();
             Vec3 halfwayDir = (lightDir + viewDir).normalize();
-            float spec = std::pow(std::max(0.0f, vertex.normal.dot(halfwayDir)), material.shininess);
-            Vec3 specular = Vec3(material.specular.r, material.specular.g, material.specular.b) * (1.0f / 255.0f) * spec;
+            float spec = std::pow(std::max(0.0f, vertex.normal.dot(halfwayDir)), surface.shininess);
+            Vec3 specular = Vec3(surface.specular.r, surface.specular.g, surface.specular.b) * (1.0f / 255.0f) * spec;
             
             Vec3 lightColor = Vec3(light.color.r, light.color.g, light.color.b) * (1.0f / 255.0f);
-            finalColor = finalColor + (diffuse + specular) * lightColor * light.intensity * attenuation;
+            float shadow = diff > 0 ? calculateShadow(vertex, l) : 1.0f;
+            finalColor = finalColor + (diffuse + specular) * lightColor * light.intensity * attenuation * shadow;
         }
         
-        // Apply ambient occlusion if enabled
-        if (enableAO) {
+        // Ray traced ambient occlusion; the screen-space kind is applied
+        // by the renderer after rasterization
+        if (enableAO && rayTracedAO) {
             float ao = calculateAmbientOcclusion(vertex);
             finalColor = finalColor * ao;
         }
@@ -139,43 +214,312 @@ public:
         );
     }
 
-    // Simple ambient occlusion calculation
+    // fragmentShader for a whole batch, written to out[0, batch.count).
+    // Each light is set up once and its type decides the loop it runs,
+    // lighting 4 fragments at a time with the specular power from
+    // powApprox; shadows and ray traced AO stay per fragment.
+    void shadeBatch(const FragmentBatch& batch, const Material& surface, Color* out) {
+        const int N = FragmentBatch::CAPACITY;
+        int count = batch.count;
+        if (count <= 0) return;
+        int padded = (count + 3) & ~3;
+
+        float red[N], green[N], blue[N], shadow[N];
+        float viewX[N], viewY[N], viewZ[N];
+        float* channels[3] = {red, green, blue};
+        const float* view[3] = {viewX, viewY, viewZ};
+        const float* px = batch.posX;
+        const float* py = batch.posY;
+        const float* pz = batch.posZ;
+        const float* nx = batch.normalX;
+        const float* ny = batch.normalY;
+        const float* nz = batch.normalZ;
+
+        Vec3 ambient = Vec3(surface.ambient.r, surface.ambient.g, surface.ambient.b) * (1.0f / 255.0f);
+        std::fill(red, red + padded, ambient.x);
+        std::fill(green, green + padded, ambient.y);
+        std::fill(blue, blue + padded, ambient.z);
+
+        // Direction to the camera, once per fragment for every light
+        for (int i = 0; i < padded; i += 4) {
+#ifdef __SSE2__
+            __m128 x = _mm_sub_ps(_mm_set1_ps(cameraPos.x), _mm_loadu_ps(px + i));
+            __m128 y = _mm_sub_ps(_mm_set1_ps(cameraPos.y), _mm_loadu_ps(py + i));
+            __m128 z = _mm_sub_ps(_mm_set1_ps(cameraPos.z), _mm_loadu_ps(pz + i));
+            normalize4(x, y, z);
+            _mm_storeu_ps(viewX + i, x);
+            _mm_storeu_ps(viewY + i, y);
+            _mm_storeu_ps(viewZ + i, z);
+#else
+            for (int j = i; j < i + 4; j++) {
+                Vec3 v = (cameraPos - Vec3(px[j], py[j], pz[j])).normalize();
+                viewX[j] = v.x; viewY[j] = v.y; viewZ[j] = v.z;
+            }
+#endif
+        }
+
+        for (size_t l = 0; l < lights.size(); l++) {
+            const Light& light = lights[l];
+
+            // Shadows only where the light reaches the front of the surface
+            std::fill(shadow, shadow + padded, 1.0f);
+            if (enableShadows) {
+                for (int i = 0; i < count; i++) {
+                    Vec3 toLight = light.type == 0 ? light.direction * -1.0f
+                                                   : light.position - Vec3(px[i], py[i], pz[i]);
+                    if (Vec3(nx[i], ny[i], nz[i]).dot(toLight) > 0) shadow[i] = calculateShadow(batch.vertex(i), l);
+                }
+            }
+
+            if (light.type == 0) addLight<false>(batch, padded, light, surface, view, shadow, channels);
+            else addLight<true>(batch, padded, light, surface, view, shadow, channels);
+        }
+
+        if (enableAO && rayTracedAO) {
+            for (int i = 0; i < count; i++) {
+                float ao = calculateAmbientOcclusion(batch.vertex(i));
+                red[i] *= ao;
+                green[i] *= ao;
+                blue[i] *= ao;
+            }
+        }
+
+        // Clamp and convert to 8-bit colour
+#ifdef __SSE2__
+        uint32_t packed[N];
+        const __m128 scale = _mm_set1_ps(255.0f), one = _mm_set1_ps(1.0f);
+        for (int i = 0; i < padded; i += 4) {
+            __m128i r = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(one, _mm_loadu_ps(red + i)), scale));
+            __m128i g = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(one, _mm_loadu_ps(green + i)), scale));
+            __m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(one, _mm_loadu_ps(blue + i)), scale));
+            __m128i rgba = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                                        _mm_or_si128(_mm_slli_epi32(b, 16), _mm_set1_epi32((int)0xff000000u)));
+            _mm_storeu_si128((__m128i*)(packed + i), rgba);
+        }
+        for (int i = 0; i < count; i++) {
+            unsigned char bytes[4];
+            std::memcpy(bytes, &packed[i], sizeof(bytes));
+            out[i] = Color(bytes[0], bytes[1], bytes[2], bytes[3]);
+        }
+#else
+        for (int i = 0; i < count; i++) {
+            out[i] = Color((unsigned char)(std::min(1.0f, red[i]) * 255), (unsigned char)(std::min(1.0f, green[i]) * 255),
+                           (unsigned char)(std::min(1.0f, blue[i]) * 255));
+        }
+#endif
+    }
+
+    // Adds one light's diffuse and specular terms to channels, scaled by
+    // shadow; POINT lights fall off with distance, others are directional
+    template <bool POINT>
+    static void addLight(const FragmentBatch& batch, int padded, const Light& light, const Material& surface,
+                         const float* const view[3], const float* shadow, float* const channels[3]) {
+        Vec3 kd = Vec3(surface.diffuse.r, surface.diffuse.g, surface.diffuse.b) * (1.0f / 255.0f);
+        Vec3 ks = Vec3(surface.specular.r, surface.specular.g, surface.specular.b) * (1.0f / 255.0f);
+        Vec3 color = Vec3(light.color.r, light.color.g, light.color.b) * (light.intensity / 255.0f);
+        Vec3 dir = light.direction * -1.0f;
+#ifdef __SSE2__
+        __m128 diffuseColor[3], specularColor[3];
+        for (int c = 0; c < 3; c++) {
+            diffuseColor[c] = _mm_set1_ps(kd[c] * color[c]);
+            specularColor[c] = _mm_set1_ps(ks[c] * color[c]);
+        }
+        const float* albedo[3] = {batch.albedoR, batch.albedoG, batch.albedoB};
+        for (int i = 0; i < padded; i += 4) {
+            __m128 nx = _mm_loadu_ps(batch.normalX + i), ny = _mm_loadu_ps(batch.normalY + i);
+            __m128 nz = _mm_loadu_ps(batch.normalZ + i);
+            __m128 lx = _mm_set1_ps(dir.x), ly = _mm_set1_ps(dir.y), lz = _mm_set1_ps(dir.z);
+            __m128 scale = _mm_loadu_ps(shadow + i);
+            if (POINT) {
+                lx = _mm_sub_ps(_mm_set1_ps(light.position.x), _mm_loadu_ps(batch.posX + i));
+                ly = _mm_sub_ps(_mm_set1_ps(light.position.y), _mm_loadu_ps(batch.posY + i));
+                lz = _mm_sub_ps(_mm_set1_ps(light.position.z), _mm_loadu_ps(batch.posZ + i));
+                __m128 distance = _mm_sqrt_ps(dot4(lx, ly, lz, lx, ly, lz));
+                normalize4(lx, ly, lz);
+                __m128 falloff = _mm_add_ps(_mm_set1_ps(1.0f),
+                                            _mm_mul_ps(distance, _mm_add_ps(_mm_set1_ps(0.09f),
+                                                                            _mm_mul_ps(_mm_set1_ps(0.032f), distance))));
+                scale = _mm_div_ps(scale, falloff);
+            }
+            __m128 diff = _mm_max_ps(_mm_setzero_ps(), dot4(nx, ny, nz, lx, ly, lz));
+
+            __m128 hx = _mm_add_ps(lx, _mm_loadu_ps(view[0] + i));
+            __m128 hy = _mm_add_ps(ly, _mm_loadu_ps(view[1] + i));
+            __m128 hz = _mm_add_ps(lz, _mm_loadu_ps(view[2] + i));
+            normalize4(hx, hy, hz);
+            __m128 spec = powApprox(_mm_max_ps(_mm_setzero_ps(), dot4(nx, ny, nz, hx, hy, hz)), surface.shininess);
+            diff = _mm_mul_ps(diff, scale);
+            spec = _mm_mul_ps(spec, scale);
+            for (int c = 0; c < 3; c++) {
+                __m128 kdc = diffuseColor[c];
+                if (batch.textured) kdc = _mm_mul_ps(kdc, _mm_loadu_ps(albedo[c] + i));
+                __m128 term = _mm_add_ps(_mm_mul_ps(kdc, diff), _mm_mul_ps(specularColor[c], spec));
+                _mm_storeu_ps(channels[c] + i, _mm_add_ps(_mm_loadu_ps(channels[c] + i), term));
+            }
+        }
+#else
+        const float* albedo[3] = {batch.albedoR, batch.albedoG, batch.albedoB};
+        for (int i = 0; i < padded; i++) {
+            Vec3 p(batch.posX[i], batch.posY[i], batch.posZ[i]);
+            Vec3 n(batch.normalX[i], batch.normalY[i], batch.normalZ[i]);
+            Vec3 l = dir;
+            float scale = shadow[i];
+            if (POINT) {
+                float distance = (light.position - p).length();
+                l = (light.position - p).normalize();
+                scale /= 1.0f + 0.09f * distance + 0.032f * distance * distance;
+            }
+            float diff = std::max(0.0f, n.dot(l)) * scale;
+            Vec3 h = (l + Vec3(view[0][i], view[1][i], view[2][i])).normalize();
+            float spec = std::pow(std::max(0.0f, n.dot(h)), surface.shininess) * scale;
+            for (int c = 0; c < 3; c++) {
+                float tint = batch.textured ? albedo[c][i] : 1.0f;
+                channels[c][i] += kd[c] * color[c] * tint * diff + ks[c] * color[c] * spec;
+            }
+        }
+#endif
+    }
+
+#ifdef __SSE2__
+    static __m128 dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+    }
+
+    // Unit vectors by reciprocal square root and one Newton step; zero
+    // vectors stay zero
+    static void normalize4(__m128& x, __m128& y, __m128& z) {
+        __m128 lengthSquared = dot4(x, y, z, x, y, z);
+        __m128 r = _mm_rsqrt_ps(lengthSquared);
+        r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), lengthSquared),
+                                                                   _mm_mul_ps(r, r))));
+        r = _mm_and_ps(r, _mm_cmpgt_ps(lengthSquared, _mm_setzero_ps()));
+        x = _mm_mul_ps(x, r);
+        y = _mm_mul_ps(y, r);
+        z = _mm_mul_ps(z, r);
+    }
+
+    // x^exponent for x in [0, 1] as exp2(exponent * log2(x)), both from
+    // polynomials fitted over one octave (errors ~4e-6 and ~3e-7). An
+    // exponent of 0 gives 1, 0^0 included, as std::pow does.
+    static __m128 powApprox(__m128 x, float exponent) {
+        const __m128 one = _mm_set1_ps(1.0f);
+        if (exponent == 0.0f) return one;
+        __m128i bits = _mm_castps_si128(x);
+        __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+        __m128 t = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)),
+                                                            _mm_castps_si128(one))), one);
+        __m128 log2 = _mm_set1_ps(-0.0260617977f);
+        log2 = _mm_add_ps(_mm_mul_ps(log2, t), _mm_set1_ps(0.121902015f));
+        log2 = _mm_add_ps(_mm_mul_ps(log2, t), _mm_set1_ps(-0.277352926f));
+        log2 = _mm_add_ps(_mm_mul_ps(log2, t), _mm_set1_ps(0.456888664f));
+        log2 = _mm_add_ps(_mm_mul_ps(log2, t), _mm_set1_ps(-0.717897279f));
+        log2 = _mm_add_ps(_mm_mul_ps(log2, t), _mm_set1_ps(1.44251696f));
+        log2 = _mm_add_ps(_mm_mul_ps(log2, t), e);
+
+        // Results under 2^-64 become 0, so products with them never go denormal
+        __m128 y = _mm_min_ps(_mm_setzero_ps(), _mm_mul_ps(log2, _mm_set1_ps(exponent)));
+        __m128 keep = _mm_and_ps(_mm_cmpgt_ps(y, _mm_set1_ps(-64.0f)), _mm_cmpge_ps(x, _mm_set1_ps(1e-30f)));
+        y = _mm_max_ps(y, _mm_set1_ps(-64.0f));
+        __m128i whole = _mm_cvttps_epi32(y);
+        whole = _mm_add_epi32(whole, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(whole), y))); // floor
+        __m128 f = _mm_sub_ps(y, _mm_cvtepi32_ps(whole));
+        __m128 exp2 = _mm_set1_ps(0.00187670843f);
+        exp2 = _mm_add_ps(_mm_mul_ps(exp2, f), _mm_set1_ps(0.00898881279f));
+        exp2 = _mm_add_ps(_mm_mul_ps(exp2, f), _mm_set1_ps(0.05582829f));
+        exp2 = _mm_add_ps(_mm_mul_ps(exp2, f), _mm_set1_ps(0.24015316f));
+        exp2 = _mm_add_ps(_mm_mul_ps(exp2, f), _mm_set1_ps(0.693152748f));
+        exp2 = _mm_add_ps(_mm_mul_ps(exp2, f), one);
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(whole, _mm_set1_epi32(127)), 23));
+        return _mm_and_ps(_mm_mul_ps(exp2, scale), keep);
+    }
+#endif
+
+    // Fraction of aoSamples rays over the hemisphere around the normal
+    // that escape within aoRadius. The directions are a cosine-weighted
+    // spiral, turned per vertex so neighbouring faces don't band.
     float calculateAmbientOcclusion(const Vertex& vertex) {
-        // This is a simplified AO calculation
-        // In a real implementation, you'd sample the depth buffer around the fragment
-        float occlusion = 1.0f;
-        
-        // Sample points around the fragment in screen space
-        // This is a placeholder - real AO would require depth buffer sampling
-        return std::max(0.1f, occlusion);
+        if (!scene || aoSamples <= 0) return 1.0f;
+
+        Vec3 normal = vertex.normal;
+        Vec3 tangent = (std::fabs(normal.x) > 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(normal).normalize();
+        Vec3 bitangent = normal.cross(tangent);
+        Vec3 origin = vertex.worldPos + normal * rayBias;
+        float turn = hashPosition(vertex.worldPos) * 6.2831853f;
+
+        int occluded = 0;
+        RayPacket4 packet;
+        for (int first = 0; first < aoSamples; first += 4) {
+            int active = 0;
+            for (int lane = 0; lane < 4 && first + lane < aoSamples; lane++) {
+                int i = first + lane;
+                float r = std::sqrt((i + 0.5f) / aoSamples);
+                float phi = i * 2.3999632f + turn; // golden angle
+                Vec3 dir = tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) +
+                           normal * std::sqrt(std::max(0.0f, 1.0f - r * r));
+                packet.set(lane, Ray(origin, dir, aoRadius));
+                active |= 1 << lane;
+            }
+            int hits = scene->occluded4(packet, active);
+            for (; hits; hits &= hits - 1) occluded++;
+        }
+        return std::max(0.1f, 1.0f - (float)occluded / aoSamples);
     }
 
-    // Shadow mapping functions
-    float calculateShadow(const Vertex& vertex) {
+    // How much of light lightIndex reaches the vertex: filtered from the
+    // light's shadow map if it has one, else 0 or 1 from a ray through the
+    // scene, else fully lit
+    float calculateShadow(const Vertex& vertex, size_t lightIndex) {
         if (!enableShadows) return 1.0f;
-        
-        // Transform fragment to light space
-        Vec3 lightSpacePos = lightSpaceMatrix.transform(vertex.worldPos);
-        
-        // Perspective divide and transform to [0,1] range
-        lightSpacePos.x = lightSpacePos.x * 0.5f + 0.5f;
-        lightSpacePos.y = lightSpacePos.y * 0.5f + 0.5f;
-        
-        // Simple shadow test (would need shadow map texture in real implementation)
-        return 1.0f; // No shadow for now
+
+        const Light& light = lights[lightIndex];
+        Vec3 toLight = light.type == 0 ? light.direction * -1.0f : light.position - vertex.worldPos;
+        Vec3 normal = vertex.normal.dot(toLight) >= 0 ? vertex.normal : vertex.normal * -1.0f;
+        if (lightIndex < shadowMaps.size() && shadowMaps[lightIndex]) {
+            return shadowMaps[lightIndex]->visibility(vertex.worldPos, normal);
+        }
+        if (!scene) return 1.0f;
+        float tMax = light.type == 0 ? std::numeric_limits<float>::max() : 1.0f;
+        return scene->occluded(Ray(vertex.worldPos + normal * rayBias, toLight, tMax)) ? 0.0f : 1.0f;
     }
 
-    // Normal mapping (Lesson 6bis)
-    Vec3 calculateNormalFromMap(const Vertex& vertex, const Vec3& normalMapSample) {
-        // Calculate tangent space vectors
-        // This is simplified - real implementation would need tangent vectors from the model
+    // Deterministic value in [0, 1) from a position's bits
+    static float hashPosition(const Vec3& p) {
+        uint32_t bits[3];
+        std::memcpy(bits, &p, sizeof(bits));
+        uint32_t h = 2166136261u;
+        for (uint32_t b : bits) h = (h ^ b) * 16777619u;
+        h ^= h >> 15;
+        return (h & 0xffffff) * (1.0f / 16777216.0f);
+    }
+
+    // Normal mapping (Lesson 6bis): normalMapSample is a texel of a
+    // tangent-space normal map, in [0, 1]. The tangent is made
+    // perpendicular to the interpolated normal (Gram-Schmidt) and the
+    // bitangent follows from the two and the tangent's handedness.
+    Vec3 calculateNormalFromMap(const Vertex& vertex, const Vec3& normalMapSample) const {
         Vec3 normal = vertex.normal;
-        Vec3 tangent = Vec3(1, 0, 0); // Simplified tangent
-        Vec3 bitangent = normal.cross(tangent);
-        
-        // Transform normal from tangent space to world space
-        Matrix4x4 tbn; // Would construct TBN matrix here
-        return normal; // Simplified - return original normal
+        Vec3 tangent(vertex.tangent.x, vertex.tangent.y, vertex.tangent.z);
+        tangent = (tangent - normal * normal.dot(tangent)).normalize();
+        if (tangent.dot(tangent) == 0) return normal;
+        Vec3 bitangent = normal.cross(tangent) * (vertex.tangent.w < 0 ? -1.0f : 1.0f);
+
+        Vec3 n = normalMapSample * 2.0f - Vec3(1, 1, 1);
+        return (tangent * n.x + bitangent * n.y + normal * n.z).normalize();
+    }
+
+    // Tangent of a triangle: the world direction in which u grows, from its
+    // positions and texture coordinates. 0 when the coordinates are degenerate.
+    static Vec4 faceTangent(const Vertex corners[3]) {
+        Vec3 e1 = corners[1].worldPos - corners[0].worldPos;
+        Vec3 e2 = corners[2].worldPos - corners[0].worldPos;
+        Vec2 d1 = corners[1].texCoord - corners[0].texCoord;
+        Vec2 d2 = corners[2].texCoord - corners[0].texCoord;
+        float det = d1.x * d2.y - d2.x * d1.y;
+        if (det == 0) return Vec4();
+        Vec3 tangent = (e1 * d2.y - e2 * d1.y) * (1.0f / det);
+        Vec3 bitangent = (e2 * d1.x - e1 * d2.x) * (1.0f / det);
+        float handedness = e1.cross(e2).cross(tangent).dot(bitangent) < 0 ? -1.0f : 1.0f;
+        return Vec4(tangent.normalize(), handedness);
     }
 };
 
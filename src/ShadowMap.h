@@ -0,0 +1,170 @@
+#ifndef SHADOWMAP_H
+#define SHADOWMAP_H
+
+#include "Framebuffer.h"
+#include "Matrix4x4.h"
+#include "Model.h"
+#include "Clipper.h"
+#include "ThreadPool.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// Lesson 7: Shadow mapping. Depth of the scene as seen from one light,
+// drawn through the depth-only raster path, and filtered lookups into it.
+class ShadowMap {
+public:
+    Framebuffer depth;          // depth-only, size x size
+    Matrix4x4 lightSpaceMatrix; // world space to the light's clip space
+    int pcfRadius;              // lookups average (2r+1)^2 texels
+    float depthBias;            // in NDC depth, on top of the normal offset
+
+private:
+    struct Triangle {
+        Vec3 v[3];
+    };
+
+    int size;
+    bool perspective;
+    Vec3 lightPos;
+    float texelScale; // world size of a texel: absolute, or per unit of distance
+    std::vector<Vec4> clipVertices;
+    std::vector<std::vector<Triangle> > blockTriangles;
+    std::vector<std::vector<int> > bandBins;
+    std::vector<Triangle> triangles;
+
+public:
+    explicit ShadowMap(int size_)
+        : depth(size_, size_, true), pcfRadius(1), depthBias(1e-3f), size(size_), perspective(false),
+          texelScale(0) {}
+
+    int getSize() const { return size; }
+
+    // Orthographic view along direction covering the sphere at center
+    void setDirectional(const Vec3& direction, const Vec3& center, float radius) {
+        Vec3 dir = direction.normalize();
+        Vec3 up = std::fabs(dir.y) > 0.99f ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
+        Matrix4x4 view = Matrix4x4::lookAt(center - dir * (radius * 2.0f), center, up);
+        Matrix4x4 projection = Matrix4x4::orthographic(-radius, radius, -radius, radius, radius, radius * 3.0f);
+        lightSpaceMatrix = projection * view;
+        perspective = false;
+        texelScale = 2.0f * radius / size;
+    }
+
+    // Perspective view from position along direction, reaching past the
+    // sphere at center
+    void setSpot(const Vec3& position, const Vec3& direction, const Vec3& center, float radius,
+                 float fov = 3.14159f / 2.0f) {
+        Vec3 dir = direction.normalize();
+        Vec3 up = std::fabs(dir.y) > 0.99f ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
+        float far = (center - position).length() + radius;
+        Matrix4x4 view = Matrix4x4::lookAt(position, position + dir, up);
+        lightSpaceMatrix = Matrix4x4::perspective(fov, 1.0f, far * 0.001f, far) * view;
+        perspective = true;
+        lightPos = position;
+        texelScale = 2.0f * std::tan(fov * 0.5f) / size;
+    }
+
+    // Draws the model's depth from the light. Faces are set up in parallel
+    // blocks, then bands of rows are rasterized by one thread each.
+    void render(const Model& model, const Matrix4x4& modelMatrix, ThreadPool* pool = nullptr) {
+        depth.clear();
+        Matrix4x4 mvp = lightSpaceMatrix * modelMatrix;
+        const auto& vertices = model.getVertices();
+        const auto& indices = model.getIndices();
+        int faceCount = (int)model.getTriangleCount();
+
+        clipVertices.resize(vertices.size());
+        auto transform = [&](int begin, int end) {
+            for (int i = begin; i < end; i++) clipVertices[i] = mvp.transform4(vertices.position(i));
+        };
+        if (pool) pool->parallelForRange((int)vertices.size(), 4096, transform);
+        else transform(0, (int)vertices.size());
+
+        // Both faces of every triangle are drawn: the parts are open shells,
+        // so culling either side would let light through
+        const int BLOCK_SIZE = 4096;
+        int blockCount = (faceCount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        blockTriangles.resize(blockCount);
+        auto setup = [&](int block) {
+            std::vector<Triangle>& out = blockTriangles[block];
+            out.clear();
+            int end = std::min(faceCount, (block + 1) * BLOCK_SIZE);
+            for (int f = block * BLOCK_SIZE; f < end; f++) {
+                Vec4 polygon[Clipper::MAX_VERTICES];
+                int outside = ~0, crossing = 0;
+                for (int i = 0; i < 3; i++) {
+                    polygon[i] = clipVertices[indices[f * 3 + i]];
+                    outside &= Clipper::outcode(polygon[i], 1.0f);
+                    crossing |= Clipper::outcode(polygon[i], 8.0f);
+                }
+                if (outside) continue;
+                int count = crossing ? Clipper::clipPolygon(polygon, 3, crossing, 8.0f) : 3;
+
+                Vec3 screen[Clipper::MAX_VERTICES];
+                for (int i = 0; i < count; i++) {
+                    Vec3 ndc = polygon[i].project();
+                    screen[i] = Vec3((ndc.x + 1.0f) * size * 0.5f, (ndc.y + 1.0f) * size * 0.5f, ndc.z);
+                }
+                for (int i = 1; i + 1 < count; i++) {
+                    Triangle tri = {{screen[0], screen[i], screen[i + 1]}};
+                    out.push_back(tri);
+                }
+            }
+        };
+        if (pool) pool->parallelFor(blockCount, setup);
+        else for (int b = 0; b < blockCount; b++) setup(b);
+
+        triangles.clear();
+        for (const auto& block : blockTriangles) triangles.insert(triangles.end(), block.begin(), block.end());
+
+        // Bands own whole coarse depth blocks, so they can be drawn concurrently
+        const int BAND = 64;
+        int bands = (size + BAND - 1) / BAND;
+        bandBins.resize(bands);
+        for (auto& bin : bandBins) bin.clear();
+        for (int t = 0; t < (int)triangles.size(); t++) {
+            const Vec3* v = triangles[t].v;
+            float minY = std::max(0.0f, std::min({v[0].y, v[1].y, v[2].y}));
+            float maxY = std::min((float)(size - 1), std::max({v[0].y, v[1].y, v[2].y}));
+            if (minY > maxY) continue;
+            for (int b = (int)minY / BAND; b <= (int)maxY / BAND; b++) bandBins[b].push_back(t);
+        }
+        auto draw = [&](int band) {
+            int y0 = band * BAND, y1 = std::min(size, y0 + BAND);
+            for (int t : bandBins[band]) {
+                const Vec3* v = triangles[t].v;
+                depth.drawTriangle(v[0], v[1], v[2], Color(), 0, y0, size, y1);
+            }
+        };
+        if (pool) pool->parallelFor(bands, draw);
+        else for (int b = 0; b < bands; b++) draw(b);
+    }
+
+    // Fraction of the texels around worldPos that see the light (PCF).
+    // normal should face the light; the lookup point is pushed along it by
+    // about a texel so surfaces don't shadow themselves.
+    float visibility(const Vec3& worldPos, const Vec3& normal) const {
+        float texel = perspective ? texelScale * (worldPos - lightPos).length() : texelScale;
+        Vec4 clip = lightSpaceMatrix.transform4(worldPos + normal * (texel * 1.5f));
+        if (clip.w <= 0) return 1.0f;
+        Vec3 ndc = clip.project();
+        if (ndc.z > 1.0f) return 1.0f;
+
+        // Texel under the point, as drawTriangle samples pixel centres
+        int cx = (int)std::floor((ndc.x + 1.0f) * size * 0.5f);
+        int cy = (int)std::floor((ndc.y + 1.0f) * size * 0.5f);
+        float z = ndc.z - depthBias;
+        int lit = 0, total = 0;
+        for (int y = cy - pcfRadius; y <= cy + pcfRadius; y++) {
+            for (int x = cx - pcfRadius; x <= cx + pcfRadius; x++) {
+                // Outside the map counts as lit
+                if (depth.getDepth(x, y) >= z) lit++;
+                total++;
+            }
+        }
+        return (float)lit / total;
+    }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// x86 kernels are compiled per function with target attributes and picked
+// at runtime, so the binary still runs on CPUs without AVX2. Everywhere
+// else only the scalar paths exist.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RENDER_SIMD_X86 1
+#include <immintrin.h>
+#define RENDER_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define RENDER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum class SimdLevel { Scalar = 0, SSE4 = 1, AVX2 = 2 };
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE4: return "sse4";
+        default: return "scalar";
+    }
+}
+
+inline SimdLevel cpuSimdLevel() {
+#ifdef RENDER_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE4;
+#endif
+    return SimdLevel::Scalar;
+}
+
+// Best level the CPU supports, optionally capped by RENDER_SIMD=scalar|sse4|avx2
+inline SimdLevel detectSimdLevel() {
+    static const SimdLevel level = [] {
+        SimdLevel best = cpuSimdLevel();
+        const char* env = std::getenv("RENDER_SIMD");
+        if (env) {
+            SimdLevel cap = SimdLevel::AVX2;
+            if (std::strcmp(env, "scalar") == 0) cap = SimdLevel::Scalar;
+            else if (std::strcmp(env, "sse4") == 0) cap = SimdLevel::SSE4;
+            if ((int)cap < (int)best) best = cap;
+        }
+        return best;
+    }();
+    return level;
+}
+
+// Allocator for arrays the kernels stream through, aligned for the widest
+// vector loads
+template <class T, size_t ALIGN = 32>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <class U>
+    struct rebind {
+        typedef AlignedAllocator<U, ALIGN> other;
+    };
+
+    AlignedAllocator() {}
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U, ALIGN>&) {}
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        size_t bytes = n * sizeof(T);
+        if (posix_memalign(&p, ALIGN, bytes > 0 ? bytes : ALIGN) != 0) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { std::free(p); }
+};
+
+template <class T, class U, size_t ALIGN>
+bool operator==(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) { return true; }
+template <class T, class U, size_t ALIGN>
+bool operator!=(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) { return false; }
+
+// One component of many vertices, e.g. every x
+typedef std::vector<float, AlignedAllocator<float> > FloatStream;
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "Vec3.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+
+// Lesson 6: Textures. An image and its mip chain, every level stored in
+// 4x4 tiles of 64 bytes (one cache line) with the texels of a tile in
+// Morton order, so the 2x2 footprint of a bilinear lookup, and lookups for
+// neighbouring pixels in any direction, mostly land on lines already read.
+class Texture {
+public:
+    static const int TILE = 4;
+
+private:
+    struct Level {
+        int width, height;
+        int tilesX;
+        std::vector<Color> texels;
+    };
+
+    std::vector<Level> levels; // levels[0] is the full image
+
+    static size_t address(const Level& level, int x, int y) {
+        // Interleave the low two bits of x and y
+        int inTile = (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+        return ((size_t)(y / TILE) * level.tilesX + x / TILE) * (TILE * TILE) + inTile;
+    }
+
+    static Level makeLevel(int w, int h) {
+        Level level;
+        level.width = w;
+        level.height = h;
+        level.tilesX = (w + TILE - 1) / TILE;
+        level.texels.resize((size_t)level.tilesX * ((h + TILE - 1) / TILE) * TILE * TILE);
+        return level;
+    }
+
+    static int wrap(int i, int size) {
+        int m = i % size;
+        return m < 0 ? m + size : m;
+    }
+
+public:
+    bool empty() const { return levels.empty(); }
+    int getWidth() const { return levels.empty() ? 0 : levels[0].width; }
+    int getHeight() const { return levels.empty() ? 0 : levels[0].height; }
+    int getLevelCount() const { return (int)levels.size(); }
+
+    Color getTexel(int level, int x, int y) const {
+        const Level& l = levels[level];
+        return l.texels[address(l, x, y)];
+    }
+
+    // Takes w x h texels, bottom row first so that v = 0 is the bottom as
+    // in OBJ texture coordinates, and builds the mip chain down to 1x1 by
+    // averaging 2x2 blocks
+    void setImage(int w, int h, const std::vector<Color>& rows) {
+        levels.clear();
+        if (w <= 0 || h <= 0 || rows.size() < (size_t)w * h) return;
+        levels.push_back(makeLevel(w, h));
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) levels[0].texels[address(levels[0], x, y)] = rows[(size_t)y * w + x];
+        }
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            const Level& src = levels.back();
+            Level dst = makeLevel(std::max(1, src.width / 2), std::max(1, src.height / 2));
+            for (int y = 0; y < dst.height; y++) {
+                for (int x = 0; x < dst.width; x++) {
+                    int sum[4] = {0, 0, 0, 0};
+                    for (int i = 0; i < 4; i++) {
+                        int sx = std::min(src.width - 1, x * 2 + (i & 1));
+                        int sy = std::min(src.height - 1, y * 2 + (i >> 1));
+                        const Color& c = src.texels[address(src, sx, sy)];
+                        sum[0] += c.r;
+                        sum[1] += c.g;
+                        sum[2] += c.b;
+                        sum[3] += c.a;
+                    }
+                    dst.texels[address(dst, x, y)] = Color((unsigned char)((sum[0] + 2) / 4), (unsigned char)((sum[1] + 2) / 4),
+                                                           (unsigned char)((sum[2] + 2) / 4), (unsigned char)((sum[3] + 2) / 4));
+                }
+            }
+            levels.push_back(std::move(dst));
+        }
+    }
+
+    // Reads a binary (P6) or ASCII (P3) PPM with up to 8 bits per channel
+    bool loadPPM(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Error: Cannot open texture " << filename << std::endl;
+            return false;
+        }
+        std::string magic;
+        int header[3] = {0, 0, 0};
+        file >> magic;
+        for (int i = 0; i < 3 && file; i++) {
+            // Comments may sit anywhere in the header
+            while (file >> std::ws && file.peek() == '#') file.ignore(1 << 20, '\n');
+            file >> header[i];
+        }
+        int w = header[0], h = header[1], maxValue = header[2];
+        if (!file || (magic != "P6" && magic != "P3") || w <= 0 || h <= 0 || maxValue <= 0 || maxValue > 255) {
+            std::cerr << "Error: " << filename << " is not an 8-bit PPM image" << std::endl;
+            return false;
+        }
+
+        std::vector<unsigned char> data((size_t)w * h * 3);
+        if (magic == "P6") {
+            file.get(); // the single whitespace byte before the raster
+            file.read((char*)data.data(), data.size());
+        } else {
+            for (size_t i = 0; i < data.size() && file; i++) {
+                int value = 0;
+                file >> value;
+                data[i] = (unsigned char)value;
+            }
+        }
+        if (!file) {
+            std::cerr << "Error: " << filename << " is truncated" << std::endl;
+            return false;
+        }
+
+        // PPM stores the top row first
+        std::vector<Color> rows((size_t)w * h);
+        for (int y = 0; y < h; y++) {
+            const unsigned char* src = &data[(size_t)(h - 1 - y) * w * 3];
+            for (int x = 0; x < w; x++) {
+                rows[(size_t)y * w + x] = Color((unsigned char)(src[x * 3] * 255 / maxValue),
+                                                (unsigned char)(src[x * 3 + 1] * 255 / maxValue),
+                                                (unsigned char)(src[x * 3 + 2] * 255 / maxValue));
+            }
+        }
+        setImage(w, h, rows);
+        return true;
+    }
+
+    // Bilinear lookup in one level, repeating outside [0, 1]; RGB in [0, 1]
+    Vec3 sampleBilinear(const Vec2& uv, int level) const {
+        if (levels.empty()) return Vec3(1, 1, 1);
+        const Level& l = levels[std::max(0, std::min(level, (int)levels.size() - 1))];
+        float x = uv.x * l.width - 0.5f, y = uv.y * l.height - 0.5f;
+        if (!(std::fabs(x) < 1e8f && std::fabs(y) < 1e8f)) x = y = 0;
+        float fx = std::floor(x), fy = std::floor(y);
+        float tx = x - fx, ty = y - fy;
+        int x0 = wrap((int)fx, l.width), y0 = wrap((int)fy, l.height);
+        int x1 = x0 + 1 == l.width ? 0 : x0 + 1;
+        int y1 = y0 + 1 == l.height ? 0 : y0 + 1;
+        const Color& c00 = l.texels[address(l, x0, y0)];
+        const Color& c10 = l.texels[address(l, x1, y0)];
+        const Color& c01 = l.texels[address(l, x0, y1)];
+        const Color& c11 = l.texels[address(l, x1, y1)];
+        float w00 = (1 - tx) * (1 - ty), w10 = tx * (1 - ty), w01 = (1 - tx) * ty, w11 = tx * ty;
+        return Vec3(c00.r * w00 + c10.r * w10 + c01.r * w01 + c11.r * w11,
+                    c00.g * w00 + c10.g * w10 + c01.g * w01 + c11.g * w11,
+                    c00.b * w00 + c10.b * w10 + c01.b * w01 + c11.b * w11) * (1.0f / 255.0f);
+    }
+
+    // Trilinear lookup: bilinear in the two levels around lod, blended
+    Vec3 sample(const Vec2& uv, float lod) const {
+        int last = (int)levels.size() - 1;
+        if (!(lod > 0) || last <= 0) return sampleBilinear(uv, 0);
+        if (lod >= last) return sampleBilinear(uv, last);
+        int level = (int)lod;
+        float t = lod - level;
+        Vec3 a = sampleBilinear(uv, level), b = sampleBilinear(uv, level + 1);
+        return a + (b - a) * t;
+    }
+
+    // Level of detail of a pixel whose texture coordinates change by
+    // (dudx, dvdx) to the next pixel across and (dudy, dvdy) to the next
+    // one up: log2 of the texels the pixel spans along its longer side
+    float lod(float dudx, float dvdx, float dudy, float dvdy) const {
+        if (levels.empty()) return 0;
+        float w = (float)levels[0].width, h = (float)levels[0].height;
+        float across = dudx * dudx * w * w + dvdx * dvdx * h * h;
+        float up = dudy * dudy * w * w + dvdy * dvdy * h * h;
+        float longest = std::max(across, up);
+        return longest > 0 ? 0.5f * std::log2(longest) : 0.0f;
+    }
+};
+
+// Textures by file name, each read and mipmapped once. Loading is not
+// thread safe; materials look their textures up before rendering.
+class TextureCache {
+private:
+    std::map<std::string, std::unique_ptr<Texture> > textures;
+
+public:
+    // Null if the file can't be read, which is reported the first time only
+    const Texture* load(const std::string& filename) {
+        auto it = textures.find(filename);
+        if (it != textures.end()) return it->second.get();
+        std::unique_ptr<Texture> texture(new Texture());
+        if (!texture->loadPPM(filename)) texture.reset();
+        const Texture* result = texture.get();
+        textures[filename] = std::move(texture);
+        return result;
+    }
+
+    size_t size() const { return textures.size(); }
+};
+
+#endif
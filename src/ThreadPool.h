@@ -0,0 +1,305 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A unit of work for ThreadPool::submit. It becomes runnable once every job
+// it depends on has finished.
+struct Job {
+    std::function<void()> fn;
+    std::atomic<int> waitingOn; // unfinished dependencies, plus one until submitted
+    std::atomic<bool> finished;
+    std::mutex mutex;           // guards done and dependents
+    bool done;
+    std::vector<std::shared_ptr<Job> > dependents;
+    std::shared_ptr<Job> self;  // keeps a queued job alive
+
+    Job() : waitingOn(1), finished(false), done(false) {}
+};
+
+typedef std::shared_ptr<Job> JobHandle;
+
+// Work-stealing job system shared by every stage of the engine. Each worker
+// has a deque of tasks: it pushes and pops at the back, so it works depth
+// first on what it just split off, while idle workers steal from the front,
+// where the largest pieces are. Threads outside the pool share one more
+// deque. A thread waiting for tasks to finish runs queued ones meanwhile,
+// so parallelFor nests and a pool of N threads runs N-1 background workers;
+// with nothing left to run it sleeps until a task is queued or what it
+// waits for finishes.
+// Tasks are plain function pointers and ranges kept in ring buffers that
+// only grow, so once warmed up parallelFor does not touch the heap.
+class ThreadPool {
+private:
+    struct Task {
+        void (*run)(ThreadPool& pool, void* context, int begin, int end);
+        void* context;
+        int begin, end;
+    };
+
+    // Ring buffer of tasks; doubles when full
+    struct Queue {
+        std::mutex mutex;
+        std::vector<Task> ring;
+        size_t head, count;
+
+        Queue() : ring(256), head(0), count(0) {}
+
+        void pushBack(const Task& task) {
+            if (count == ring.size()) {
+                std::vector<Task> grown(ring.size() * 2);
+                for (size_t i = 0; i < count; i++) grown[i] = ring[(head + i) % ring.size()];
+                ring.swap(grown);
+                head = 0;
+            }
+            ring[(head + count++) % ring.size()] = task;
+        }
+
+        Task popBack() { return ring[(head + --count) % ring.size()]; }
+
+        Task popFront() {
+            Task task = ring[head];
+            head = (head + 1) % ring.size();
+            count--;
+            return task;
+        }
+    };
+
+    template <class Fn>
+    struct Loop {
+        const Fn* fn;
+        std::atomic<int> remaining;
+    };
+
+    // Which pool's worker the current thread is, if any
+    struct ThreadSlot {
+        const ThreadPool* pool;
+        int index;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue> > queues; // queues[0] for outside threads
+    std::atomic<int> queued;                     // jobs sitting in the queues
+    std::atomic<int> sleeping;
+    std::atomic<int> waiters;                    // sleeping in helpUntil
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<bool> stopping;
+
+    static ThreadSlot& currentSlot() {
+        static thread_local ThreadSlot slot = {nullptr, 0};
+        return slot;
+    }
+
+    int queueIndex() const {
+        const ThreadSlot& slot = currentSlot();
+        return slot.pool == this ? slot.index : 0;
+    }
+
+    void push(const Task& task) {
+        Queue& queue = *queues[queueIndex()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.pushBack(task);
+        }
+        queued.fetch_add(1);
+        if (sleeping.load() > 0) {
+            // A worker between checking queued and waiting holds sleepMutex
+            { std::lock_guard<std::mutex> lock(sleepMutex); }
+            wake.notify_one();
+        }
+    }
+
+    // The newest task of the caller's own queue, else the oldest of another's
+    bool pop(Task& task) {
+        if (queued.load() == 0) return false;
+        int self = queueIndex();
+        int count = (int)queues.size();
+        for (int k = 0; k < count; k++) {
+            Queue& queue = *queues[(self + k) % count];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.count == 0) continue;
+            task = k == 0 ? queue.popBack() : queue.popFront();
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    void pushJob(const JobHandle& job) {
+        job->self = job;
+        push(Task{&runJob, job.get(), 0, 0});
+    }
+
+    static void runJob(ThreadPool& pool, void* context, int, int) {
+        JobHandle job;
+        job.swap(static_cast<Job*>(context)->self);
+        job->fn();
+        std::vector<JobHandle> ready;
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->done = true;
+            ready.swap(job->dependents);
+        }
+        job->finished.store(true);
+        pool.notifyWaiters();
+        for (const JobHandle& next : ready) {
+            if (next->waitingOn.fetch_sub(1) == 1) pool.pushJob(next);
+        }
+    }
+
+    // Runs fn over [begin, end), queueing the upper half of the range
+    // until one index is left
+    template <class Fn>
+    static void runRange(ThreadPool& pool, void* context, int begin, int end) {
+        Loop<Fn>* loop = static_cast<Loop<Fn>*>(context);
+        while (end - begin > 1) {
+            int mid = begin + (end - begin) / 2;
+            pool.push(Task{&runRange<Fn>, loop, mid, end});
+            end = mid;
+        }
+        (*loop->fn)(begin);
+        // Last touch of the loop, which the caller may free
+        if (loop->remaining.fetch_sub(1) == 1) pool.notifyWaiters();
+    }
+
+    // Wakes the threads sleeping in helpUntil to check what they wait for
+    void notifyWaiters() {
+        if (waiters.load() == 0) return;
+        { std::lock_guard<std::mutex> lock(sleepMutex); }
+        wake.notify_all();
+    }
+
+    // Runs queued tasks until done() holds. With nothing to run it yields
+    // for a few rounds, then sleeps as an idle worker does, woken by push
+    // or by notifyWaiters once a job or loop finishes.
+    template <class Done>
+    void helpUntil(const Done& done) {
+        const int SPIN_ROUNDS = 64;
+        int idle = 0;
+        while (!done()) {
+            Task task;
+            if (pop(task)) {
+                task.run(*this, task.context, task.begin, task.end);
+                idle = 0;
+            } else if (++idle < SPIN_ROUNDS) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                sleeping.fetch_add(1);
+                waiters.fetch_add(1);
+                wake.wait(lock, [&] { return queued.load() > 0 || done(); });
+                waiters.fetch_sub(1);
+                sleeping.fetch_sub(1);
+                idle = 0;
+            }
+        }
+    }
+
+    void workerLoop(int index) {
+        currentSlot().pool = this;
+        currentSlot().index = index;
+        while (true) {
+            Task task;
+            if (pop(task)) {
+                task.run(*this, task.context, task.begin, task.end);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.fetch_add(1);
+            wake.wait(lock, [&] { return queued.load() > 0 || stopping.load(); });
+            sleeping.fetch_sub(1);
+            if (stopping.load()) return;
+        }
+    }
+
+public:
+    static int defaultThreadCount() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n > 0 ? (int)n : 1;
+    }
+
+    // threads <= 0 selects one thread per hardware core
+    explicit ThreadPool(int threads = 0) : queued(0), sleeping(0), waiters(0), stopping(false) {
+        if (threads <= 0) threads = defaultThreadCount();
+        for (int i = 0; i < threads; i++) queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        for (int i = 1; i < threads; i++) {
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+        }
+    }
+
+    // Tasks still queued are dropped; wait for the jobs that matter first
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping.store(true);
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    int getThreadCount() const { return (int)workers.size() + 1; }
+
+    // Queues fn to run once every job in dependencies has finished. With no
+    // background workers it runs when some thread waits.
+    JobHandle submit(const std::function<void()>& fn, const std::vector<JobHandle>& dependencies = {}) {
+        JobHandle job = std::make_shared<Job>();
+        job->fn = fn;
+        for (const JobHandle& dependency : dependencies) {
+            if (!dependency) continue;
+            std::lock_guard<std::mutex> lock(dependency->mutex);
+            if (!dependency->done) {
+                job->waitingOn.fetch_add(1);
+                dependency->dependents.push_back(job);
+            }
+        }
+        if (job->waitingOn.fetch_sub(1) == 1) pushJob(job);
+        return job;
+    }
+
+    // Blocks until job has finished, running queued jobs meanwhile
+    void wait(const JobHandle& job) {
+        if (job) helpUntil([&] { return job->finished.load(); });
+    }
+
+    // Runs fn(0) .. fn(count - 1) across the pool and blocks until all
+    // calls have returned. The range is split in halves, one half queued
+    // for stealing and the other split further, down to single indices.
+    template <class Fn>
+    void parallelFor(int count, const Fn& fn) {
+        if (count <= 0) return;
+        if (workers.empty() || count == 1) {
+            for (int i = 0; i < count; i++) fn(i);
+            return;
+        }
+
+        Loop<Fn> loop;
+        loop.fn = &fn;
+        loop.remaining.store(count);
+        runRange<Fn>(*this, &loop, 0, count);
+        helpUntil([&] { return loop.remaining.load() == 0; });
+    }
+
+    // Splits [0, count) into contiguous ranges of roughly grain elements
+    template <class Fn>
+    void parallelForRange(int count, int grain, const Fn& fn) {
+        if (count <= 0) return;
+        if (grain < 1) grain = 1;
+        int chunks = (count + grain - 1) / grain;
+        parallelFor(chunks, [&](int chunk) {
+            int begin = chunk * grain;
+            int end = std::min(count, begin + grain);
+            fn(begin, end);
+        });
+    }
+};
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef VARYINGS_H
+#define VARYINGS_H
+
+#include "Shader.h"
+
+// Varying layouts: the vertex attributes a pass interpolates across its
+// triangles, packed as COUNT floats. Interpolation is templated on the
+// layout, so each pass pays only for the attributes it reads.
+struct NormalVaryings {
+    static const int COUNT = 3;
+
+    static void pack(const Vertex& vertex, float* out) {
+        out[0] = vertex.normal.x;
+        out[1] = vertex.normal.y;
+        out[2] = vertex.normal.z;
+    }
+
+    static Vec3 normal(const float* values) { return Vec3(values[0], values[1], values[2]); }
+};
+
+struct SurfaceVaryings {
+    static const int COUNT = 6;
+
+    static void pack(const Vertex& vertex, float* out) {
+        NormalVaryings::pack(vertex, out);
+        out[3] = vertex.worldPos.x;
+        out[4] = vertex.worldPos.y;
+        out[5] = vertex.worldPos.z;
+    }
+
+    static Vec3 normal(const float* values) { return Vec3(values[0], values[1], values[2]); }
+    static Vec3 worldPos(const float* values) { return Vec3(values[3], values[4], values[5]); }
+};
+
+struct TexturedVaryings {
+    static const int COUNT = 8;
+    static const int TEX_COORD = 6;
+
+    static void pack(const Vertex& vertex, float* out) {
+        SurfaceVaryings::pack(vertex, out);
+        out[6] = vertex.texCoord.x;
+        out[7] = vertex.texCoord.y;
+    }
+
+    static Vec3 normal(const float* values) { return Vec3(values[0], values[1], values[2]); }
+    static Vec3 worldPos(const float* values) { return Vec3(values[3], values[4], values[5]); }
+    static Vec2 texCoord(const float* values) { return Vec2(values[6], values[7]); }
+};
+
+template <class Layout> struct VaryingStepper;
+
+// Perspective-correct interpolation over a triangle, set up from the clip
+// space x, y and w of its corners. Each corner's barycentric weight times
+// 1/w at the pixel is affine in pixel coordinates (2D homogeneous
+// rasterization), so 1/w and every attribute / w are planes that change by
+// a constant from pixel to pixel, and an attribute is the ratio of the two.
+// The planes hold for the clipped pieces of a triangle too, and corners
+// behind the camera need no special case.
+template <class Layout>
+struct VaryingPlanes {
+    static const int COUNT = Layout::COUNT;
+    typedef VaryingStepper<Layout> Stepper;
+
+    // d/dx, d/dy and value at pixel (0, 0), up to a common scale
+    float inverseW[3];
+    float attributes[COUNT][3];
+
+    void setup(const Vertex corners[3], int width, int height) {
+        // Pixel centre x to NDC is x * sx + ox, likewise for y
+        float sx = 2.0f / width, ox = 1.0f / width - 1.0f;
+        float sy = 2.0f / height, oy = 1.0f / height - 1.0f;
+        float weights[3][3];
+        float values[3][COUNT];
+        for (int i = 0; i < 3; i++) {
+            const Vec4& a = corners[(i + 1) % 3].clipPos;
+            const Vec4& b = corners[(i + 2) % 3].clipPos;
+            Vec3 edge = Vec3(a.x, a.y, a.w).cross(Vec3(b.x, b.y, b.w));
+            weights[i][0] = edge.x * sx;
+            weights[i][1] = edge.y * sy;
+            weights[i][2] = edge.x * ox + edge.y * oy + edge.z;
+            Layout::pack(corners[i], values[i]);
+        }
+        for (int c = 0; c < 3; c++) {
+            inverseW[c] = weights[0][c] + weights[1][c] + weights[2][c];
+            for (int k = 0; k < COUNT; k++) {
+                attributes[k][c] = weights[0][c] * values[0][k] + weights[1][c] * values[1][k] +
+                                   weights[2][c] * values[2][k];
+            }
+        }
+    }
+
+    // Attributes at the centre of pixel (x, y)
+    void evaluate(int x, int y, float* out) const {
+        float d = inverseW[0] * x + inverseW[1] * y + inverseW[2];
+        float scale = d != 0 ? 1.0f / d : 0.0f;
+        for (int k = 0; k < COUNT; k++) {
+            out[k] = (attributes[k][0] * x + attributes[k][1] * y + attributes[k][2]) * scale;
+        }
+    }
+
+    // Change of attribute k, whose value at pixel (x, y) is value, to the
+    // next pixel across and up. With a = N / D, da/dx = (dN/dx - a dD/dx) / D.
+    void derivatives(int k, int x, int y, float value, float& ddx, float& ddy) const {
+        float d = inverseW[0] * x + inverseW[1] * y + inverseW[2];
+        if (d == 0) {
+            ddx = ddy = 0;
+            return;
+        }
+        ddx = (attributes[k][0] - value * inverseW[0]) / d;
+        ddy = (attributes[k][1] - value * inverseW[1]) / d;
+    }
+};
+
+// Walks VaryingPlanes along a row of pixels, one add per plane per step
+// and one reciprocal per fragment read
+template <class Layout>
+struct VaryingStepper {
+    static const int COUNT = Layout::COUNT;
+
+    float inverseW, inverseWStep;
+    float values[COUNT], steps[COUNT];
+
+    VaryingStepper(const VaryingPlanes<Layout>& planes, int x, int y) {
+        inverseW = planes.inverseW[0] * x + planes.inverseW[1] * y + planes.inverseW[2];
+        inverseWStep = planes.inverseW[0];
+        for (int k = 0; k < COUNT; k++) {
+            const float* plane = planes.attributes[k];
+            values[k] = plane[0] * x + plane[1] * y + plane[2];
+            steps[k] = plane[0];
+        }
+    }
+
+    void step() {
+        inverseW += inverseWStep;
+        for (int k = 0; k < COUNT; k++) values[k] += steps[k];
+    }
+
+    void get(float* out) const {
+        float scale = inverseW != 0 ? 1.0f / inverseW : 0.0f;
+        for (int k = 0; k < COUNT; k++) out[k] = values[k] * scale;
+    }
+};
+
+#endif
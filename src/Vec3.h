@@ -34,6 +34,26 @@ public:
     const float& operator[](int i) const { return (&x)[i]; }
 };
 
+// Homogeneous point, e.g. a clip-space position before the perspective divide
+class Vec4 {
+public:
+    float x, y, z, w;
+
+    Vec4() : x(0), y(0), z(0), w(0) {}
+    Vec4(float x_, float y_, float z_, float w_) : x(x_), y(y_), z(z_), w(w_) {}
+    Vec4(const Vec3& v, float w_) : x(v.x), y(v.y), z(v.z), w(w_) {}
+
+    Vec4 operator+(const Vec4& v) const { return Vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
+    Vec4 operator-(const Vec4& v) const { return Vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
+    Vec4 operator*(float scalar) const { return Vec4(x * scalar, y * scalar, z * scalar, w * scalar); }
+
+    // Divides by w unless w is 0 or already 1
+    Vec3 project() const {
+        if (w != 0.0f && w != 1.0f) return Vec3(x / w, y / w, z / w);
+        return Vec3(x, y, z);
+    }
+};
+
 class Vec2 {
 public:
     float x, y;
@@ -0,0 +1,191 @@
+#ifndef VERTEXKERNELS_H
+#define VERTEXKERNELS_H
+
+#include "Model.h"
+#include "Matrix4x4.h"
+#include "Shader.h"
+#include "Simd.h"
+#include <vector>
+
+// Vertex shader outputs for every unique vertex of a model, one array per
+// component so the geometry pass reads only what it uses
+struct TransformedVertices {
+    std::vector<float> x, y, z, w;             // clip-space position
+    std::vector<float> worldX, worldY, worldZ;
+    std::vector<float> normalX, normalY, normalZ;
+    std::vector<float> u, v;
+
+    void resize(size_t count) {
+        for (std::vector<float>* a : {&x, &y, &z, &w, &worldX, &worldY, &worldZ,
+                                      &normalX, &normalY, &normalZ, &u, &v}) {
+            a->resize(count);
+        }
+    }
+
+    void store(size_t i, const Vertex& vertex) {
+        x[i] = vertex.clipPos.x; y[i] = vertex.clipPos.y; z[i] = vertex.clipPos.z; w[i] = vertex.clipPos.w;
+        worldX[i] = vertex.worldPos.x; worldY[i] = vertex.worldPos.y; worldZ[i] = vertex.worldPos.z;
+        normalX[i] = vertex.normal.x; normalY[i] = vertex.normal.y; normalZ[i] = vertex.normal.z;
+        u[i] = vertex.texCoord.x; v[i] = vertex.texCoord.y;
+    }
+
+    Vertex load(size_t i) const {
+        Vertex vertex;
+        vertex.clipPos = Vec4(x[i], y[i], z[i], w[i]);
+        vertex.position = vertex.clipPos.project();
+        vertex.worldPos = Vec3(worldX[i], worldY[i], worldZ[i]);
+        vertex.normal = Vec3(normalX[i], normalY[i], normalZ[i]);
+        vertex.texCoord = Vec2(u[i], v[i]);
+        return vertex;
+    }
+};
+
+// Runs Shader::vertexShader on welded vertices [begin, end): world position
+// and normal through model, clip position through mvp. Every kernel does
+// the same float operations in the same order, so all of them write
+// bit-identical results.
+typedef void (*VertexKernelFn)(const VertexStreams& in, const Matrix4x4& model, const Matrix4x4& mvp, int begin,
+                               int end, TransformedVertices& out);
+
+// Reference kernel
+inline void transformVerticesScalar(const VertexStreams& in, const Matrix4x4& model, const Matrix4x4& mvp,
+                                    int begin, int end, TransformedVertices& out) {
+    for (int i = begin; i < end; i++) {
+        Vec3 position = in.position(i);
+        Vec3 world = model.transform(position);
+        Vec3 normal = model.transform(in.normal(i), 0.0f).normalize();
+        Vec4 clip = mvp.transform4(position);
+        out.x[i] = clip.x; out.y[i] = clip.y; out.z[i] = clip.z; out.w[i] = clip.w;
+        out.worldX[i] = world.x; out.worldY[i] = world.y; out.worldZ[i] = world.z;
+        out.normalX[i] = normal.x; out.normalY[i] = normal.y; out.normalZ[i] = normal.z;
+        out.u[i] = in.u[i]; out.v[i] = in.v[i];
+    }
+}
+
+#ifdef RENDER_SIMD_X86
+
+// Row r of a matrix times (x, y, z, w), summed left to right as
+// Matrix4x4::transform4 does
+RENDER_TARGET_SSE4 inline __m128 transformRowSSE4(const __m128* row, __m128 x, __m128 y, __m128 z, __m128 w) {
+    return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(row[0], x), _mm_mul_ps(row[1], y)), _mm_mul_ps(row[2], z)),
+                      _mm_mul_ps(row[3], w));
+}
+
+// Vec4::project: divides by w unless it is 0 or 1
+RENDER_TARGET_SSE4 inline __m128 projectSSE4(__m128 value, __m128 w) {
+    __m128 divide = _mm_and_ps(_mm_cmpneq_ps(w, _mm_setzero_ps()), _mm_cmpneq_ps(w, _mm_set1_ps(1.0f)));
+    return _mm_blendv_ps(value, _mm_div_ps(value, w), divide);
+}
+
+// 4 vertices at a time
+RENDER_TARGET_SSE4 inline void transformVerticesSSE4(const VertexStreams& in, const Matrix4x4& model,
+                                                     const Matrix4x4& mvp, int begin, int end,
+                                                     TransformedVertices& out) {
+    __m128 m[4][4], c[4][4];
+    for (int r = 0; r < 4; r++) {
+        for (int k = 0; k < 4; k++) {
+            m[r][k] = _mm_set1_ps(model.m[r][k]);
+            c[r][k] = _mm_set1_ps(mvp.m[r][k]);
+        }
+    }
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 px = _mm_loadu_ps(&in.x[i]), py = _mm_loadu_ps(&in.y[i]), pz = _mm_loadu_ps(&in.z[i]);
+        __m128 w = transformRowSSE4(m[3], px, py, pz, one);
+        _mm_storeu_ps(&out.worldX[i], projectSSE4(transformRowSSE4(m[0], px, py, pz, one), w));
+        _mm_storeu_ps(&out.worldY[i], projectSSE4(transformRowSSE4(m[1], px, py, pz, one), w));
+        _mm_storeu_ps(&out.worldZ[i], projectSSE4(transformRowSSE4(m[2], px, py, pz, one), w));
+
+        __m128 nx = _mm_loadu_ps(&in.normalX[i]), ny = _mm_loadu_ps(&in.normalY[i]),
+               nz = _mm_loadu_ps(&in.normalZ[i]);
+        __m128 nw = transformRowSSE4(m[3], nx, ny, nz, zero);
+        __m128 tx = projectSSE4(transformRowSSE4(m[0], nx, ny, nz, zero), nw);
+        __m128 ty = projectSSE4(transformRowSSE4(m[1], nx, ny, nz, zero), nw);
+        __m128 tz = projectSSE4(transformRowSSE4(m[2], nx, ny, nz, zero), nw);
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz)));
+        __m128 nonzero = _mm_cmpgt_ps(length, zero);
+        _mm_storeu_ps(&out.normalX[i], _mm_and_ps(_mm_div_ps(tx, length), nonzero));
+        _mm_storeu_ps(&out.normalY[i], _mm_and_ps(_mm_div_ps(ty, length), nonzero));
+        _mm_storeu_ps(&out.normalZ[i], _mm_and_ps(_mm_div_ps(tz, length), nonzero));
+
+        _mm_storeu_ps(&out.x[i], transformRowSSE4(c[0], px, py, pz, one));
+        _mm_storeu_ps(&out.y[i], transformRowSSE4(c[1], px, py, pz, one));
+        _mm_storeu_ps(&out.z[i], transformRowSSE4(c[2], px, py, pz, one));
+        _mm_storeu_ps(&out.w[i], transformRowSSE4(c[3], px, py, pz, one));
+        _mm_storeu_ps(&out.u[i], _mm_loadu_ps(&in.u[i]));
+        _mm_storeu_ps(&out.v[i], _mm_loadu_ps(&in.v[i]));
+    }
+    transformVerticesScalar(in, model, mvp, i, end, out);
+}
+
+RENDER_TARGET_AVX2 inline __m256 transformRowAVX2(const __m256* row, __m256 x, __m256 y, __m256 z, __m256 w) {
+    return _mm256_add_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(row[0], x), _mm256_mul_ps(row[1], y)), _mm256_mul_ps(row[2], z)),
+        _mm256_mul_ps(row[3], w));
+}
+
+RENDER_TARGET_AVX2 inline __m256 projectAVX2(__m256 value, __m256 w) {
+    __m256 divide = _mm256_and_ps(_mm256_cmp_ps(w, _mm256_setzero_ps(), _CMP_NEQ_UQ),
+                                  _mm256_cmp_ps(w, _mm256_set1_ps(1.0f), _CMP_NEQ_UQ));
+    return _mm256_blendv_ps(value, _mm256_div_ps(value, w), divide);
+}
+
+// 8 vertices at a time
+RENDER_TARGET_AVX2 inline void transformVerticesAVX2(const VertexStreams& in, const Matrix4x4& model,
+                                                     const Matrix4x4& mvp, int begin, int end,
+                                                     TransformedVertices& out) {
+    __m256 m[4][4], c[4][4];
+    for (int r = 0; r < 4; r++) {
+        for (int k = 0; k < 4; k++) {
+            m[r][k] = _mm256_set1_ps(model.m[r][k]);
+            c[r][k] = _mm256_set1_ps(mvp.m[r][k]);
+        }
+    }
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 px = _mm256_loadu_ps(&in.x[i]), py = _mm256_loadu_ps(&in.y[i]), pz = _mm256_loadu_ps(&in.z[i]);
+        __m256 w = transformRowAVX2(m[3], px, py, pz, one);
+        _mm256_storeu_ps(&out.worldX[i], projectAVX2(transformRowAVX2(m[0], px, py, pz, one), w));
+        _mm256_storeu_ps(&out.worldY[i], projectAVX2(transformRowAVX2(m[1], px, py, pz, one), w));
+        _mm256_storeu_ps(&out.worldZ[i], projectAVX2(transformRowAVX2(m[2], px, py, pz, one), w));
+
+        __m256 nx = _mm256_loadu_ps(&in.normalX[i]), ny = _mm256_loadu_ps(&in.normalY[i]),
+               nz = _mm256_loadu_ps(&in.normalZ[i]);
+        __m256 nw = transformRowAVX2(m[3], nx, ny, nz, zero);
+        __m256 tx = projectAVX2(transformRowAVX2(m[0], nx, ny, nz, zero), nw);
+        __m256 ty = projectAVX2(transformRowAVX2(m[1], nx, ny, nz, zero), nw);
+        __m256 tz = projectAVX2(transformRowAVX2(m[2], nx, ny, nz, zero), nw);
+        __m256 length = _mm256_sqrt_ps(
+            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, tx), _mm256_mul_ps(ty, ty)), _mm256_mul_ps(tz, tz)));
+        __m256 nonzero = _mm256_cmp_ps(length, zero, _CMP_GT_OQ);
+        _mm256_storeu_ps(&out.normalX[i], _mm256_and_ps(_mm256_div_ps(tx, length), nonzero));
+        _mm256_storeu_ps(&out.normalY[i], _mm256_and_ps(_mm256_div_ps(ty, length), nonzero));
+        _mm256_storeu_ps(&out.normalZ[i], _mm256_and_ps(_mm256_div_ps(tz, length), nonzero));
+
+        _mm256_storeu_ps(&out.x[i], transformRowAVX2(c[0], px, py, pz, one));
+        _mm256_storeu_ps(&out.y[i], transformRowAVX2(c[1], px, py, pz, one));
+        _mm256_storeu_ps(&out.z[i], transformRowAVX2(c[2], px, py, pz, one));
+        _mm256_storeu_ps(&out.w[i], transformRowAVX2(c[3], px, py, pz, one));
+        _mm256_storeu_ps(&out.u[i], _mm256_loadu_ps(&in.u[i]));
+        _mm256_storeu_ps(&out.v[i], _mm256_loadu_ps(&in.v[i]));
+    }
+    transformVerticesScalar(in, model, mvp, i, end, out);
+}
+
+#endif
+
+inline VertexKernelFn selectVertexKernel(SimdLevel level) {
+#ifdef RENDER_SIMD_X86
+    if (level == SimdLevel::AVX2) return transformVerticesAVX2;
+    if (level == SimdLevel::SSE4) return transformVerticesSSE4;
+#else
+    (void)level;
+#endif
+    return transformVerticesScalar;
+}
+
+#endif
@@ -1,16 +1,131 @@
 #include "Renderer.h"
+#include "RenderServer.h"
 #include <iostream>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 
 // Function declaration
 void createTestCube(Renderer& renderer);
 
-int main() {
+int main(int argc, char** argv) {
     const int WIDTH = 800;
     const int HEIGHT = 600;
+
+    // Command line options
+    int threads = 0; // 0 = one per hardware thread
+    bool useMeshCache = true;
+    bool asciiPPM = false;
+    bool streamOutput = false;
+    bool hiZ = false; // coarse depth rejection, also on with --occlusion
+    bool noHiZ = false;
+    bool occlusion = false;
+    bool rayTracedAO = false;
+    bool deferred = false;
+    bool smooth = false;
+    bool useMaterials = true;
+    int samples = 1; // per pixel, MSAA
+    int turntableFrames = 0;
+    std::string cameraFile;             // one camera per line, rendered as numbered frames
+    std::string framePrefix = "frame_"; // numbered frames go to <prefix>0000.ppm, ...
+    std::string diffuseMap, normalMap; // PPM images for the default material
+    std::string serveSocket;           // serve render requests on this Unix socket
+    int serveWorkers = 1;              // requests rendered at once
+    int serveQueue = 16;               // distinct requests waiting before new ones are refused
+    std::vector<std::string> inputs; // .obj files or directories of parts
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--no-cache") == 0) {
+            useMeshCache = false;
+        } else if (std::strcmp(argv[i], "--ascii") == 0) {
+            asciiPPM = true;
+        } else if (std::strcmp(argv[i], "--stream") == 0) {
+            streamOutput = true;
+        } else if (std::strcmp(argv[i], "--hiz") == 0) {
+            hiZ = true;
+        } else if (std::strcmp(argv[i], "--no-hiz") == 0) {
+            noHiZ = true;
+        } else if (std::strcmp(argv[i], "--occlusion") == 0) {
+            occlusion = true;
+        } else if (std::strcmp(argv[i], "--ray-ao") == 0) {
+            rayTracedAO = true;
+        } else if (std::strcmp(argv[i], "--deferred") == 0) {
+            deferred = true;
+        } else if (std::strcmp(argv[i], "--smooth") == 0) {
+            smooth = true;
+        } else if (std::strcmp(argv[i], "--msaa") == 0 && i + 1 < argc) {
+            samples = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--turntable") == 0 && i + 1 < argc) {
+            turntableFrames = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--cameras") == 0 && i + 1 < argc) {
+            cameraFile = argv[++i];
+        } else if (std::strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            framePrefix = argv[++i];
+        } else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            serveWorkers = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+            serveQueue = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--no-mtl") == 0) {
+            useMaterials = false;
+        } else if (std::strcmp(argv[i], "--diffuse-map") == 0 && i + 1 < argc) {
+            diffuseMap = argv[++i];
+        } else if (std::strcmp(argv[i], "--normal-map") == 0 && i + 1 < argc) {
+            normalMap = argv[++i];
+        } else if (argv[i][0] != '-') {
+            inputs.push_back(argv[i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--no-cache] [--hiz | --no-hiz] [--occlusion] [--ray-ao] [--deferred] [--no-mtl]"
+                      << " [--smooth [--diffuse-map file.ppm] [--normal-map file.ppm]] [--msaa 1|4|8] [--ascii | --stream]"
+                      << " [--turntable N | --cameras file.txt] [--prefix name] [--serve socket [--workers N] [--queue N]]"
+                      << " [model.obj | parts-dir ...]" << std::endl;
+            return 1;
+        }
+    }
     
+    // A long-lived process rendering requests, models kept loaded between them
+    if (!serveSocket.empty()) {
+        RenderServer server(serveSocket, serveWorkers, threads, serveQueue);
+        if (!server.start()) return 1;
+        std::cout << "Serving on " << serveSocket << " with " << server.getWorkerCount() << " workers of "
+                  << server.getThreadsPerWorker() << " threads" << std::endl;
+        server.serve();
+        return 0;
+    }
+
     // Create renderer
-    Renderer renderer(WIDTH, HEIGHT);
+    Renderer renderer(WIDTH, HEIGHT, threads);
+    renderer.useMeshCache = useMeshCache;
+    renderer.framebuffer.setHiZ(!noHiZ && (hiZ || occlusion));
+    renderer.occlusionCulling = occlusion;
+    renderer.deferred = deferred;
+    renderer.smoothShading = smooth;
+    // The G-buffer holds one surface per pixel
+    if (deferred && samples > 1) {
+        std::cerr << "Warning: --msaa does not apply to --deferred, rendering single sampled" << std::endl;
+        samples = 1;
+    }
+    if (!renderer.framebuffer.setSampleCount(samples)) return 1;
+    // Textures are sampled where texture coordinates are interpolated per
+    // pixel, which flat shading and the G-buffer do not do
+    if ((!diffuseMap.empty() || !normalMap.empty()) && (!smooth || deferred)) {
+        std::cerr << "Warning: --diffuse-map and --normal-map need --smooth without --deferred, rendering untextured"
+                  << std::endl;
+        diffuseMap.clear();
+        normalMap.clear();
+    }
+    if (!diffuseMap.empty()) renderer.shader.material.diffuseMap = renderer.textures.load(diffuseMap);
+    if (!normalMap.empty()) renderer.shader.material.normalMap = renderer.textures.load(normalMap);
+    renderer.binaryPPM = !asciiPPM;
+    // Batches write every frame as a binary PPM once it is done
+    bool batch = turntableFrames > 0 || !cameraFile.empty();
+    if (batch && (streamOutput || asciiPPM)) {
+        std::cerr << "Warning: --stream and --ascii apply to single frames only" << std::endl;
+    }
+    if (!batch && streamOutput && !asciiPPM && !renderer.beginStreamingOutput("output.ppm")) return 1;
+    std::cout << "Using " << renderer.getThreadCount() << " render threads" << std::endl;
     
     // Setup camera (Lesson 5: Moving the camera)
     Vec3 cameraPos(0, 0, 3);
@@ -20,8 +135,8 @@ int main() {
     // Setup perspective projection (Lesson 4: Perspective projection)
     float fov = 3.14159f / 4.0f; // 45 degrees
     float aspect = (float)WIDTH / (float)HEIGHT;
-    float near = 50.0f;  // Improved for better depth precision
-    float far = 1500.0f; // Reduced far plane for better depth precision
+    float near = 0.1f;
+    float far = 100.0f; // Refitted to the model once one is loaded
     
     // Setup matrices
     renderer.shader.viewMatrix = Matrix4x4::lookAt(cameraPos, cameraTarget, cameraUp);
@@ -50,25 +165,32 @@ int main() {
     renderer.shader.lights.push_back(pointLight);
     
     // Enable advanced features
-    renderer.shader.enableShadows = true; // Lesson 7: Shadow mapping
-    renderer.shader.enableAO = true;      // Lesson 8: Ambient occlusion
+    renderer.shader.enableShadows = true; // Lesson 7: Shadow maps, rays for point lights
+    renderer.shader.enableAO = true;      // Lesson 8: Ambient occlusion, screen space unless --ray-ao
+    renderer.shader.rayTracedAO = rayTracedAO;
     
     // Create a simple test scene if no OBJ file is available
     std::cout << "Attempting to load OBJ file..." << std::endl;
     
     // Try to load the Volkswagen Beetle OBJ file
     bool objLoaded = false;
-    // Try different OBJ files - prioritize the complete model
-    std::vector<std::string> objFiles = {
-        "uploads-files-5718873-Volkswagen+Beetle+1963_obj/Volkswagen Beetle 1963.obj",
-        "uploads-files-5718873-Volkswagen+Beetle+1963_obj/Volkswagen Beetle 1963 Exploded.obj"
-    };
+    // Try different OBJ files - prioritize the complete model, then the
+    // separate parts it ships as
+    std::vector<std::vector<std::string> > objSources;
+    if (!inputs.empty()) {
+        objSources.push_back(inputs);
+    } else {
+        objSources.push_back({"uploads-files-5718873-Volkswagen+Beetle+1963_obj/Volkswagen Beetle 1963.obj"});
+        objSources.push_back({"uploads-files-5718873-Volkswagen+Beetle+1963_obj/Volkswagen Beetle 1963 Exploded.obj"});
+        objSources.push_back({"uploads-files-5718873-Volkswagen+Beetle+1963_obj/OBJ Parts"});
+    }
     
     std::string objFile;
     Model model;
-    for (const auto& file : objFiles) {
-        if (renderer.loadOBJ(file, model)) {
-            objFile = file;
+    for (const auto& source : objSources) {
+        if (renderer.loadOBJFiles(source, model)) {
+            objFile = source[0];
+            if (source.size() > 1) objFile += " (+" + std::to_string(source.size() - 1) + " more)";
             break;
         }
     }
@@ -78,18 +200,8 @@ int main() {
         model.generateNormals();
         
         // Debug: Print model bounds
-        const auto& vertices = model.getVertices();
-        if (!vertices.empty()) {
-            Vec3 minBounds = vertices[0];
-            Vec3 maxBounds = vertices[0];
-            for (const auto& vertex : vertices) {
-                minBounds.x = std::min(minBounds.x, vertex.x);
-                minBounds.y = std::min(minBounds.y, vertex.y);
-                minBounds.z = std::min(minBounds.z, vertex.z);
-                maxBounds.x = std::max(maxBounds.x, vertex.x);
-                maxBounds.y = std::max(maxBounds.y, vertex.y);
-                maxBounds.z = std::max(maxBounds.z, vertex.z);
-            }
+        Vec3 minBounds, maxBounds;
+        if (model.getBounds(minBounds, maxBounds)) {
             std::cout << "Model bounds: Min(" << minBounds.x << ", " << minBounds.y << ", " << minBounds.z << ")";
             std::cout << " Max(" << maxBounds.x << ", " << maxBounds.y << ", " << maxBounds.z << ")" << std::endl;
             
@@ -104,17 +216,47 @@ int main() {
             renderer.shader.material.diffuse = Color(150, 150, 200);
             renderer.shader.material.specular = Color(255, 255, 255);
             renderer.shader.material.ambient = Color(30, 30, 50);
+            // The model's .mtl files override it per face, from that base
+            if (useMaterials) renderer.loadMaterials(model);
             
             // Adjust camera for car model - position camera to view the entire model
             float maxDim = std::max({size.x, size.y, size.z});
             // Move camera closer and at an angle for better view
-            Vec3 cameraPos = center + Vec3(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f);
+            Vec3 cameraOffset(maxDim * 0.8f, maxDim * 0.3f, maxDim * 1.2f);
+            Vec3 cameraPos = center + cameraOffset;
             Vec3 cameraTarget = center;
             
+            // Fit the depth range to the model; geometry nearer than the
+            // near plane gets clipped, not dropped
+            float radius = size.length() * 0.5f;
+            float distance = (cameraPos - center).length();
+            renderer.shader.projectionMatrix = Matrix4x4::perspective(fov, aspect, maxDim * 0.01f, distance + radius);
             renderer.shader.viewMatrix = Matrix4x4::lookAt(cameraPos, cameraTarget, cameraUp);
             renderer.shader.cameraPos = cameraPos;
             renderer.shader.updateMVP();
             
+            // Shadow and AO rays are traced against the model itself
+            renderer.shader.aoRadius = maxDim * 0.05f;
+            if (renderer.shader.enableShadows || (renderer.shader.enableAO && rayTracedAO)) {
+                renderer.buildScene(model);
+            }
+            
+            // Many views of the one loaded scene: a turntable around the
+            // default camera, or the cameras listed in a file
+            if (batch) {
+                std::vector<CameraSpec> cameras;
+                if (turntableFrames > 0) {
+                    cameras = turntableCameras(center, cameraOffset, fov, turntableFrames);
+                } else if (!loadCameraFile(cameraFile, fov, cameras)) {
+                    return 1;
+                }
+                for (CameraSpec& camera : cameras) {
+                    camera.near = maxDim * 0.01f;
+                    camera.fitFar(center, radius);
+                }
+                return renderer.renderFrames(model, cameras, framePrefix, Color(20, 30, 50)) ? 0 : 1;
+            }
+
             // Clear and render the model
             renderer.framebuffer.clear(Color(20, 30, 50));
             renderer.renderModel(model);
@@ -129,7 +271,7 @@ int main() {
     
     // Render the scene
     std::cout << "Rendering..." << std::endl;
-    renderer.render();
+    if (!renderer.render()) return 1;
     
     std::cout << "Render complete! Output saved to output.ppm" << std::endl;
     